@@ -0,0 +1,34 @@
+-- subprocess.communicate on N children, with each engine
+local sp = require "subprocess"
+
+local N = tonumber(os.getenv("N") or 256)
+local SIZE = os.getenv("SIZE") or "1M"
+local CMD = os.getenv("CMD") or ("head -c " .. SIZE .. " /dev/zero; head -c 64k /dev/zero >&2")
+
+-- wall clock time, in seconds
+local function now()
+    local _, s = sp.call_capture{"date", "+%s.%N"}
+    return tonumber(s)
+end
+
+local function run(engine)
+    local procs = {}
+    sp.io_engine(engine)
+    for i=1,N do
+        procs[i] = sp.popen{"sh", "-c", CMD, stdout=sp.PIPE, stderr=sp.PIPE}
+    end
+    local t, c = now(), os.clock()
+    sp.communicate(procs)
+    return now() - t, os.clock() - c
+end
+
+for r=1,3 do
+    for _, engine in ipairs{"poll", "uring"} do
+        local ok, wall, cpu = pcall(run, engine)
+        if ok then
+            print(string.format("%-6s N=%d wall %.3fs cpu %.3fs", engine, N, wall, cpu))
+        else
+            print(engine, wall)
+        end
+    end
+end
@@ -0,0 +1,25 @@
+-- Cost of proc field lookups, and memory per proc
+local sp = require "subprocess"
+
+local N = 5000000
+local p = sp.popen{"sleep", "5", stdout=sp.PIPE}
+local function bench(name, f)
+    local t = os.clock()
+    f()
+    print(string.format("%-12s %.1f ns/access", name, (os.clock() - t) / N * 1e9))
+end
+bench("pid", function() local x for i=1,N do x = p.pid end end)
+bench("stdout", function() local x for i=1,N do x = p.stdout end end)
+bench("exitcode", function() local x for i=1,N do x = p.exitcode end end)
+bench("poll", function() local x for i=1,N do x = p.poll end end)
+p:kill()
+p:wait()
+
+local M = 1000
+local procs = {}
+collectgarbage() collectgarbage()
+local before = collectgarbage("count")
+for i=1,M do procs[i] = sp.popen{"true", stdout=sp.PIPE} end
+collectgarbage() collectgarbage()
+print(string.format("memory/proc  %.0f bytes", (collectgarbage("count") - before) * 1024 / M))
+for i=1,M do procs[i]:wait() end
@@ -0,0 +1,24 @@
+-- Reading a pipe in different ways; parent CPU time, best of 3
+local sp = require "subprocess"
+
+local MB = tonumber(os.getenv("MB") or 200)
+local CMD = "yes 2>/dev/null | head -c " .. MB .. "M"
+
+local function best(f)
+    local b
+    for r=1,3 do
+        local p = sp.popen{"sh", "-c", CMD, stdout=sp.PIPE}
+        local t = os.clock()
+        f(p.stdout)
+        t = os.clock() - t
+        p:wait()
+        if not b or t < b then b = t end
+    end
+    return b
+end
+
+print(string.format("read(\"*a\")    %.3fs", best(function(f) f:read("*a") end)))
+print(string.format("lines()       %.3fs", best(function(f) for l in f:lines() do end end)))
+print(string.format("read(65536)   %.3fs", best(function(f)
+    while f:read(65536) do end
+end)))
@@ -1,8 +1,14 @@
+#if defined(OS_POSIX) && defined(__linux__)
+/* for memmem */
+#define _GNU_SOURCE
+#endif
+
 #include "liolib-copy.h"
 #include "errno.h"
 #include "stdio.h"
 #include "stdlib.h"
 #include "string.h"
+#include "stdint.h"
 
 #define LUA_LIB
 #include "lua.h"
@@ -26,17 +32,200 @@ static int pushresult(lua_State *L, int i, const char *filename)
     }
 }
 
+/*
+** {======================================================
+** LINE MATCHING
+** =======================================================
+*/
+
+/* Not found (in liolib_copy_pats.next) */
+#define NOTFOUND ((size_t) -1)
+
+/* Find needle in hay. POSIX C libraries have memmem, which is vectorized
+   or skips ahead by more than a byte; elsewhere memchr finds the first
+   byte, and the last byte is checked before the rest, so that a common
+   first byte doesn't mean a memcmp at every place it occurs. */
+static const char *findstr(const char *hay, size_t n, const char *needle, size_t m)
+{
+#if defined(OS_POSIX)
+    if (m == 0) return hay;
+    return memmem(hay, n, needle, m);
+#else
+    const char *p, *end;
+    if (m == 0) return hay;
+    if (m > n) return NULL;
+    end = hay + n - m + 1;  /* after the last place it could start */
+    for (p = hay; p < end && (p = memchr(p, needle[0], end - p)) != NULL; ++p)
+        if (p[m-1] == needle[m-1] && memcmp(p + 1, needle + 1, m - 1) == 0) return p;
+    return NULL;
+#endif
+}
+
+/* Read the patterns at index (a string, or a list of strings) into p.
+   The arrays are in a userdata, which is pushed: it and the patterns must
+   be kept for as long as p is used. Returns the number of patterns. */
+int liolib_copy_getpats(lua_State *L, int index, struct liolib_copy_pats *p)
+{
+    int i, n = 1;
+    char *mem;
+
+    if (index < 0) index = lua_gettop(L) + index + 1;
+    if (lua_istable(L, index)) n = (int) lua_objlen(L, index);
+    else luaL_checkstring(L, index);
+    mem = lua_newuserdata(L, n * (sizeof *p->s + sizeof *p->len + sizeof *p->next) + 1);
+    p->n = n;
+    p->s = (const char **) mem;
+    p->len = (size_t *) (p->s + n);
+    p->next = p->len + n;
+    for (i=0; i<n; ++i){
+        if (lua_istable(L, index)){
+            lua_rawgeti(L, index, i + 1);
+            p->s[i] = lua_tolstring(L, -1, &p->len[i]);
+            lua_pop(L, 1);  /* still referenced by the table */
+            if (!p->s[i]) luaL_error(L, "pattern %d is not a string", i + 1);
+        } else {
+            p->s[i] = lua_tolstring(L, index, &p->len[i]);
+        }
+        if (memchr(p->s[i], '\n', p->len[i]))
+            luaL_error(L, "a pattern can't contain a newline");
+    }
+    liolib_copy_resetpats(p);
+    return n;
+}
+
+/* Forget where the patterns were found, before scanning a new buffer
+   (or one that has been changed) */
+void liolib_copy_resetpats(struct liolib_copy_pats *p)
+{
+    int i;
+    for (i=0; i<p->n; ++i)
+        p->next[i] = NOTFOUND;
+}
+
+/* Return where the first pattern found in buf from start onwards is, or
+   n. Where each pattern is found is remembered, so that a pattern is
+   only searched for again after the line it was found in. */
+static size_t firstmatch(struct liolib_copy_pats *p, const char *buf, size_t n, size_t start)
+{
+    const char *found;
+    size_t best = n;
+    int i;
+    for (i=0; i<p->n; ++i){
+        if (p->next[i] == NOTFOUND || p->next[i] < start){
+            found = findstr(buf + start, n - start, p->s[i], p->len[i]);
+            p->next[i] = found ? (size_t) (found - buf) : n;
+        }
+        if (p->next[i] < best) best = p->next[i];
+    }
+    return best;
+}
+
+/* Count the newlines in s */
+static size_t countlines(const char *s, size_t n)
+{
+    const char *end = s + n;
+    size_t count = 0;
+    for (; (s = memchr(s, '\n', end - s)) != NULL; ++s)
+        ++count;
+    return count;
+}
+
+/* Find the next line in buf, from *pos up to n, that contains one of the
+   patterns (or, if invert, that doesn't). buf must end with a newline,
+   unless its last line is the last of the input. Returns the line, with
+   its length (without the newline) in *len, and moves *pos after it.
+   Returns NULL if there are no more. If lineno is not NULL, the number of
+   lines passed over, including the one returned, is added to it. */
+const char *liolib_copy_nextmatch(struct liolib_copy_pats *p, const char *buf, size_t n,
+                                  size_t *pos, int invert, size_t *lineno, size_t *len)
+{
+    size_t start = *pos, at, end;
+    const char *nl;
+
+    while (start < n){
+        at = firstmatch(p, buf, n, start);
+        if (!invert){
+            if (at == n) break;
+            /* the line it is in */
+            end = at;
+            while (at > start && buf[at-1] != '\n') --at;
+        } else {
+            /* the next line, unless it matches */
+            nl = memchr(buf + start, '\n', n - start);
+            end = nl ? (size_t) (nl - buf) : n;
+            if (at < n && at <= end){
+                if (lineno) ++*lineno;
+                start = end + 1;
+                continue;
+            }
+            at = start;
+        }
+        nl = memchr(buf + end, '\n', n - end);
+        end = nl ? (size_t) (nl - buf) : n;
+        if (lineno) *lineno += countlines(buf + start, at - start) + 1;
+        *pos = end < n ? end + 1 : n;
+        *len = end - at;
+        return buf + at;
+    }
+    if (lineno && start < n) *lineno += countlines(buf + start, n - start);
+    *pos = n;
+    return NULL;
+}
+
+/* }====================================================== */
+
 /* If SHARE_LIOLIB is defined, Lua's own FILE* metatable can be used. This is
    fine when the C runtime library used by Lua and by this module is the same,
    but FILE* objects are not compatible between different runtime libraries.
    If Lua was compiled with a different runtime library, DO NOT set SHARE_LIOLIB.
    In this case, copies of Lua's IO functions will be compiled in.
    If SHARE_LIOLIB is set and crashes ensue, turn it off! */
+
+/* From Lua 5.2, a file is a luaL_Stream, which can be made outside the io
+   library, so files made here are Lua's own: io.type knows them, and they
+   have all of the host Lua's methods. On POSIX there is only one C library,
+   so its FILE*s are safe to share. Elsewhere, on Lua 5.1, or if
+   NO_LUAL_STREAM is defined, the copies below are used. */
+#if LUA_VERSION_NUM >= 502 && defined(OS_POSIX) && !defined(NO_LUAL_STREAM)
+#define NATIVE_STREAMS
+#undef SHARE_LIOLIB
+#endif
+
 #ifndef SHARE_LIOLIB
 
+#ifdef NATIVE_STREAMS
+
+/* The FILE* of the file at index, or NULL if it is closed */
+static FILE *getfile(lua_State *L, int index)
+{
+    luaL_Stream *p = (luaL_Stream *)lua_touserdata(L, index);
+    return p->closef == NULL ? NULL : p->f;
+}
+
+static FILE *tofile(lua_State *L)
+{
+    luaL_checkudata(L, 1, LUA_FILEHANDLE);
+    if (getfile(L, 1) == NULL)
+        luaL_error(L, "attempt to use a closed file");
+    return getfile(L, 1);
+}
+
+/* luaL_Stream closef of the files made here */
+static int io_fclose(lua_State *L)
+{
+    luaL_Stream *p = (luaL_Stream *)luaL_checkudata(L, 1, LUA_FILEHANDLE);
+    int ok = p->f == NULL || fclose(p->f) == 0;
+    p->f = NULL;
+    return pushresult(L, ok, NULL);
+}
+
+#else /* #ifdef NATIVE_STREAMS */
+
 #undef LUA_FILEHANDLE
 #define LUA_FILEHANDLE "lio2_FILE*"
 
+#define getfile(L, index) (*(FILE **)lua_touserdata((L), (index)))
+
 #define tofilep(L) ((FILE **)luaL_checkudata(L, 1, LUA_FILEHANDLE))
 
 static FILE *tofile(lua_State *L)
@@ -85,12 +274,15 @@ static int f_lines(lua_State *L)
     return 1;
 }
 
+#endif /* #ifdef NATIVE_STREAMS */
+
 /*
 ** {======================================================
 ** READ
 ** =======================================================
 */
 
+#ifndef NATIVE_STREAMS
 static int read_number(lua_State *L, FILE *f)
 {
     double d;
@@ -99,7 +291,178 @@ static int read_number(lua_State *L, FILE *f)
         return 1;
     } else return 0;  /* read fails */
 }
+#endif
+
+/* Reading many numbers: the file is locked once for a batch of them, and
+   read a character at a time without locking */
+#if defined(OS_WINDOWS)
+#define lockfile(f) _lock_file(f)
+#define unlockfile(f) _unlock_file(f)
+#define getc_nolock(f) _getc_nolock(f)
+#else
+#define lockfile(f) flockfile(f)
+#define unlockfile(f) funlockfile(f)
+#define getc_nolock(f) getc_unlocked(f)
+#endif
+
+/* How many numbers read_numbers reads between lockings of the file */
+#define NUMBATCH 256
+
+/* Longest number read_numbers reads */
+#define NUMLEN 64
 
+#define isnumsep(c) ((c) == ' ' || (c) == '\t' || (c) == '\n' || (c) == '\r' || \
+                     (c) == '\v' || (c) == '\f' || (c) == ',' || (c) == ';')
+#define isdigitc(c) ((c) >= '0' && (c) <= '9')
+#define isnumchar(c) (isdigitc(c) || (c) == '.' || (c) == '+' || (c) == '-' || \
+                      (c) == 'e' || (c) == 'E')
+
+struct numval {
+    lua_Number d;
+#if LUA_VERSION_NUM >= 503
+    lua_Integer i;
+    int isint;
+#endif
+};
+
+/* Powers of ten that are exact as doubles */
+static const double exact_pow10[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+/* Parse the number in s (which is NUL-terminated). Most numbers have few
+   enough digits to be worked out exactly with one multiplication or
+   division; the rest are left to strtod. Returns 0 if s isn't a number. */
+static int parse_number(const char *s, struct numval *v)
+{
+    const char *p = s;
+    uint64_t m = 0;
+    int neg = 0, digits = 0, any = 0, isint = 1, exp = 0, e, eneg;
+    char *end;
+
+    if (*p == '+' || *p == '-') neg = *p++ == '-';
+    for (; isdigitc(*p); ++p, any = 1){
+        if (m == 0 && *p == '0') continue;
+        if (++digits > 19) goto slow;
+        m = m * 10 + (*p - '0');
+    }
+    if (*p == '.'){
+        isint = 0;
+        for (++p; isdigitc(*p); ++p, any = 1){
+            --exp;
+            if (m == 0 && *p == '0') continue;
+            if (++digits > 19) goto slow;
+            m = m * 10 + (*p - '0');
+        }
+    }
+    if (!any) return 0;
+    if (*p == 'e' || *p == 'E'){
+        isint = 0;
+        ++p;
+        eneg = 0;
+        if (*p == '+' || *p == '-') eneg = *p++ == '-';
+        if (!isdigitc(*p)) return 0;
+        for (e = 0; isdigitc(*p); ++p)
+            if (e < 10000) e = e * 10 + (*p - '0');
+        exp += eneg ? -e : e;
+    }
+    if (*p) return 0;
+#if LUA_VERSION_NUM >= 503
+    v->isint = isint && m <= (uint64_t) LUA_MAXINTEGER + neg;
+    if (v->isint){
+        v->i = neg ? (lua_Integer) (0 - m) : (lua_Integer) m;
+        return 1;
+    }
+#else
+    (void) isint;
+#endif
+    if (m < ((uint64_t) 1 << 53) && exp >= -22 && exp <= 22){
+        v->d = exp < 0 ? (double) m / exact_pow10[-exp] : (double) m * exact_pow10[exp];
+        if (neg) v->d = -v->d;
+        return 1;
+    }
+slow:
+#if LUA_VERSION_NUM >= 503
+    v->isint = 0;
+#endif
+    v->d = strtod(s, &end);
+    return *end == '\0' && end != s;
+}
+
+/* Read a number from f, which must be locked, using buf (NUMLEN + 1
+   bytes). Returns 1, 0 at the end of the file, or -1 at something that
+   isn't a number. That is left to be read if it can't start a number, and
+   buf is made empty; otherwise the run of number characters has been read,
+   and buf holds it (its first NUMLEN characters, if longer). */
+static int scan_number(FILE *f, struct numval *v, char *buf)
+{
+    int c, n = 0, toolong = 0;
+
+    do {
+        c = getc_nolock(f);
+    } while (isnumsep(c));
+    if (c == EOF) return 0;
+    if (!isdigitc(c) && c != '.' && c != '+' && c != '-'){
+        ungetc(c, f);
+        buf[0] = '\0';
+        return -1;
+    }
+    for (; c != EOF && isnumchar(c); c = getc_nolock(f)){
+        if (n == NUMLEN) toolong = 1;
+        else buf[n++] = (char) c;
+    }
+    if (c != EOF) ungetc(c, f);
+    buf[n] = '\0';
+    return !toolong && parse_number(buf, v) ? 1 : -1;
+}
+
+/* file:read_numbers([max], [t]) */
+static int f_read_numbers(lua_State *L)
+{
+    FILE *f = tofile(L);
+    lua_Integer max = luaL_optinteger(L, 2, 0);
+    struct numval vals[NUMBATCH];
+    char bad[NUMLEN + 1];
+    lua_Integer count = 0, want;
+    int i, got, r = 1;
+
+    luaL_argcheck(L, max >= 0, 2, "must not be negative");
+    if (lua_isnoneornil(L, 3)){
+        lua_settop(L, 2);
+        lua_createtable(L, max > 0 && max <= NUMBATCH ? (int) max : 0, 0);
+    } else {
+        luaL_checktype(L, 3, LUA_TTABLE);
+        lua_settop(L, 3);
+    }
+    clearerr(f);
+    while (r == 1 && (max == 0 || count < max)){
+        want = max == 0 || max - count > NUMBATCH ? NUMBATCH : max - count;
+        /* no Lua calls while the file is locked, so that an error can't
+           leave it locked */
+        lockfile(f);
+        for (got = 0; got < want && (r = scan_number(f, &vals[got], bad)) == 1; ++got)
+            ;
+        unlockfile(f);
+        for (i=0; i<got; ++i){
+#if LUA_VERSION_NUM >= 503
+            if (vals[i].isint) lua_pushinteger(L, vals[i].i);
+            else
+#endif
+            lua_pushnumber(L, vals[i].d);
+            lua_rawseti(L, 3, (int) ++count);
+        }
+    }
+    if (ferror(f))
+        return pushresult(L, 0, NULL);
+    lua_pushinteger(L, count);
+    if (r != -1) return 2;
+    if (bad[0]) lua_pushfstring(L, "not a number: %s", bad);
+    else lua_pushliteral(L, "not a number");
+    return 3;
+}
+
+#ifndef NATIVE_STREAMS
 static int test_eof(lua_State *L, FILE *f)
 {
     int c = getc(f);
@@ -200,7 +563,7 @@ static int f_read(lua_State *L) {
 
 static int io_readline (lua_State *L)
 {
-    FILE *f = *(FILE **)lua_touserdata(L, lua_upvalueindex(1));
+    FILE *f = getfile(L, lua_upvalueindex(1));
     int sucess;
     if (f == NULL)  /* file is already closed? */
         luaL_error(L, "file is already closed");
@@ -217,10 +580,199 @@ static int io_readline (lua_State *L)
         return 0;
     }
 }
+#endif /* #ifndef NATIVE_STREAMS */
 
 /* }====================================================== */
 
 
+/*
+** {======================================================
+** GREP
+** =======================================================
+*/
+
+/* Initial size of the buffer file:grep reads into */
+#define GREP_BUFSIZE 65536
+
+/* State of a file:grep or file:greplines. The buffer is a userdata of its
+   own, kept at a stack index or upvalue, so that it can be replaced with a
+   bigger one for a long line. */
+struct grep {
+    char *buf;
+    size_t size;
+    size_t have;        /* bytes in buf */
+    size_t complete;    /* bytes in buf up to its last newline */
+    size_t pos;         /* where to carry on looking */
+    size_t lineno;      /* lines before pos */
+    int eof;
+    int stream;         /* give lines as they come, rather than by blocks */
+    int invert;
+    int numbers;
+    struct liolib_copy_pats pats;
+};
+
+/* Set up g for the file at 1, with the patterns at 2 and options at 3.
+   Pushes the patterns' arrays and the buffer. */
+static void grep_init(lua_State *L, struct grep *g)
+{
+    memset(g, 0, sizeof *g);
+    if (!lua_isnoneornil(L, 3)){
+        luaL_checktype(L, 3, LUA_TTABLE);
+        lua_getfield(L, 3, "invert");
+        g->invert = lua_toboolean(L, -1);
+        lua_getfield(L, 3, "numbers");
+        g->numbers = lua_toboolean(L, -1);
+        lua_pop(L, 2);
+    }
+    liolib_copy_getpats(L, 2, &g->pats);
+    g->size = GREP_BUFSIZE;
+    g->buf = lua_newuserdata(L, g->size);
+}
+
+/* What stdio has read ahead of f, where it can be found */
+#if defined(__GLIBC__)
+#define stdio_ahead(f) ((size_t) ((f)->_IO_read_end - (f)->_IO_read_ptr))
+#elif defined(__APPLE__) || defined(__FreeBSD__) || defined(__DragonFly__)
+#define stdio_ahead(f) ((size_t) ((f)->_r > 0 ? (f)->_r : 0))
+#endif
+
+/* Read up to size bytes from f into buf, waiting only for the first one:
+   the rest are what stdio has already read, or (where that can't be
+   found) the rest of that line. Returns 0 at the end of the file or on
+   error. A pipe's lines are given as they arrive, not once a block has
+   filled up. */
+static size_t readsome(FILE *f, char *buf, size_t size)
+{
+    size_t n = 0;
+    int c;
+    lockfile(f);
+    if ((c = getc_nolock(f)) != EOF){
+        buf[n++] = (char) c;
+#ifdef stdio_ahead
+        if (stdio_ahead(f) > 0)
+            n += fread(buf + n, 1, stdio_ahead(f) < size - n ? stdio_ahead(f) : size - n, f);
+#else
+        while (n < size && c != '\n' && (c = getc_nolock(f)) != EOF)
+            buf[n++] = (char) c;
+#endif
+    }
+    unlockfile(f);
+    return n;
+}
+
+/* Return the next line that g is looking for, with its length in *len,
+   or NULL at the end of the file. bufindex is where g's buffer is kept. */
+static const char *grep_next(lua_State *L, struct grep *g, FILE *f, int bufindex, size_t *len)
+{
+    const char *line;
+    char *buf;
+    size_t n;
+
+    for (;;){
+        line = liolib_copy_nextmatch(&g->pats, g->buf, g->complete, &g->pos, g->invert,
+                                     g->numbers ? &g->lineno : NULL, len);
+        if (line || g->eof) return line;
+        /* move the unfinished line to the start, and read some more */
+        memmove(g->buf, g->buf + g->complete, g->have - g->complete);
+        g->have -= g->complete;
+        g->pos = g->complete = 0;
+        liolib_copy_resetpats(&g->pats);
+        if (g->have == g->size){
+            buf = lua_newuserdata(L, g->size * 2);
+            memcpy(buf, g->buf, g->have);
+            lua_replace(L, bufindex);
+            g->buf = buf;
+            g->size *= 2;
+        }
+        if (g->stream) n = readsome(f, g->buf + g->have, g->size - g->have);
+        else n = fread(g->buf + g->have, 1, g->size - g->have, f);
+        if (n == 0){
+            if (ferror(f)) luaL_error(L, "%s", strerror(errno));
+            g->eof = 1;
+            g->complete = g->have;
+            continue;
+        }
+        g->have += n;
+        for (n = g->have; n > 0 && g->buf[n-1] != '\n'; --n)
+            ;
+        g->complete = n;
+    }
+}
+
+/* file:grep(patterns, [options]) */
+static int f_grep(lua_State *L)
+{
+    FILE *f = tofile(L);
+    struct grep g;
+    const char *line;
+    size_t len;
+    int count = 0;
+
+    lua_settop(L, 3);
+    grep_init(L, &g);                       /* 4: patterns, 5: buffer */
+    lua_newtable(L);                        /* 6: lines */
+    if (g.numbers) lua_newtable(L);         /* 7: line numbers */
+    while ((line = grep_next(L, &g, f, 5, &len)) != NULL){
+        ++count;
+        lua_pushlstring(L, line, len);
+        lua_rawseti(L, 6, count);
+        if (g.numbers){
+            lua_pushnumber(L, (lua_Number) g.lineno);
+            lua_rawseti(L, 7, count);
+        }
+    }
+    return g.numbers ? 2 : 1;
+}
+
+static int io_grepline(lua_State *L)
+{
+    FILE *f = getfile(L, lua_upvalueindex(1));
+    struct grep *g = lua_touserdata(L, lua_upvalueindex(2));
+    const char *line;
+    size_t len;
+    if (f == NULL)  /* file is already closed? */
+        luaL_error(L, "file is already closed");
+    g->buf = lua_touserdata(L, lua_upvalueindex(3));
+    line = grep_next(L, g, f, lua_upvalueindex(3), &len);
+    if (!line) return 0;
+    if (g->numbers) lua_pushnumber(L, (lua_Number) g->lineno);
+    lua_pushlstring(L, line, len);
+    return g->numbers ? 2 : 1;
+}
+
+/* file:greplines(patterns, [options]) */
+static int f_greplines(lua_State *L)
+{
+    struct grep *g;
+    tofile(L);  /* check that it's a valid file handle */
+    lua_settop(L, 3);
+    g = lua_newuserdata(L, sizeof *g);      /* 4 */
+    grep_init(L, g);                        /* 5: patterns, 6: buffer */
+    g->stream = 1;
+    lua_pushvalue(L, 1);                    /* the file */
+    lua_pushvalue(L, 4);                    /* its state */
+    lua_pushvalue(L, 6);                    /* its buffer */
+    lua_pushvalue(L, 5);                    /* its patterns' arrays */
+    lua_pushvalue(L, 2);                    /* its patterns */
+    lua_pushcclosure(L, io_grepline, 5);
+    return 1;
+}
+
+/* }====================================================== */
+
+
+/* The methods that Lua's files don't have, as functions taking the file
+   first, so that they can be used on Lua's own files without adding them
+   to their (shared) metatable */
+const luaL_Reg liolib_copy_funcs[] = {
+    {"grep", f_grep},
+    {"greplines", f_greplines},
+    {"read_numbers", f_read_numbers},
+    {NULL, NULL}
+};
+
+#ifndef NATIVE_STREAMS
+
 static int g_write(lua_State *L, FILE *f, int arg)
 {
     int nargs = lua_gettop(L) - 1;
@@ -279,8 +831,11 @@ static int f_flush(lua_State *L)
 static const luaL_Reg flib[] = {
     {"close", io_close},
     {"flush", f_flush},
+    {"grep", f_grep},
+    {"greplines", f_greplines},
     {"lines", f_lines},
     {"read", f_read},
+    {"read_numbers", f_read_numbers},
     {"seek", f_seek},
     {"setvbuf", f_setvbuf},
     {"write", f_write},
@@ -301,8 +856,14 @@ static void createmeta(lua_State *L)
 #endif
 }
 
+#endif /* #ifdef NATIVE_STREAMS */
+
 #else /* #ifndef SHARE_LIOLIB */
 
+const luaL_Reg liolib_copy_funcs[] = {
+    {NULL, NULL}
+};
+
 static int io_fclose(lua_State *L)
 {
     FILE **p = luaL_checkudata(L, 1, LUA_FILEHANDLE);
@@ -316,13 +877,16 @@ static int io_fclose(lua_State *L)
 FILE *liolib_copy_tofile(lua_State *L, int index)
 {
     int eq;
-    if (lua_type(L, index) != LUA_TTABLE) return NULL;
-    lua_getmetatable(L, index);
+    if (lua_type(L, index) != LUA_TUSERDATA || !lua_getmetatable(L, index)) return NULL;
     luaL_getmetatable(L, LUA_FILEHANDLE);
     eq = lua_equal(L, -2, -1);
     lua_pop(L, 2);
     if (!eq) return NULL;
+#ifdef NATIVE_STREAMS
+    return getfile(L, index);
+#else
     return *(FILE **) lua_touserdata(L, index);
+#endif
 }
 
 /*
@@ -330,6 +894,21 @@ FILE *liolib_copy_tofile(lua_State *L, int index)
 ** before opening the actual file; so, if there is a memory error, the
 ** file is not left opened.
 */
+#ifdef NATIVE_STREAMS
+FILE **liolib_copy_newfile(lua_State *L)
+{
+    luaL_Stream *p = (luaL_Stream *)lua_newuserdata(L, sizeof(luaL_Stream));
+    p->f = NULL;
+    p->closef = &io_fclose;
+    luaL_getmetatable(L, LUA_FILEHANDLE);
+    /* made by the io library, which the host may have left out on purpose */
+    if (lua_isnil(L, -1))
+        luaL_error(L, "the io library is not loaded, so files can't be made");
+    lua_setmetatable(L, -2);
+    /* leave file object on stack */
+    return &p->f;
+}
+#else
 FILE **liolib_copy_newfile(lua_State *L)
 {
     FILE **pf = (FILE **)lua_newuserdata(L, sizeof(FILE *));
@@ -352,3 +931,18 @@ FILE **liolib_copy_newfile(lua_State *L)
     /* leave file object on stack */
     return pf;
 }
+#endif
+
+void liolib_copy_close(FILE **pf)
+{
+#ifdef NATIVE_STREAMS
+    /* pf is the first member of the luaL_Stream */
+    luaL_Stream *p = (luaL_Stream *)pf;
+    if (p->closef != NULL && p->f != NULL) fclose(p->f);
+    p->f = NULL;
+    p->closef = NULL;   /* so that Lua sees it as closed */
+#else
+    if (*pf != NULL) fclose(*pf);
+    *pf = NULL;
+#endif
+}
@@ -2,10 +2,32 @@
 #define LIOLIB_COPY_H
 
 #include "lua.h"
+#include "lauxlib.h"
 #include "stdio.h"
 
 FILE *liolib_copy_tofile(lua_State *L, int index);
 FILE **liolib_copy_newfile(lua_State *L);
+/* Close the file of a file object made by liolib_copy_newfile, given the
+   pointer that it returned */
+void liolib_copy_close(FILE **pf);
+/* grep, greplines and read_numbers, which take the file first. The files
+   made by liolib_copy_newfile have them as methods too, unless they are
+   Lua's own (from Lua 5.2, on POSIX). */
+extern const luaL_Reg liolib_copy_funcs[];
+
+/* A set of literal strings to look for in lines, for file:grep and for
+   the filter option of call_capture */
+struct liolib_copy_pats {
+    int n;
+    const char **s;
+    size_t *len;
+    size_t *next;       /* where each was found in the buffer last scanned */
+};
+
+int liolib_copy_getpats(lua_State *L, int index, struct liolib_copy_pats *p);
+void liolib_copy_resetpats(struct liolib_copy_pats *p);
+const char *liolib_copy_nextmatch(struct liolib_copy_pats *p, const char *buf, size_t n,
+                                  size_t *pos, int invert, size_t *lineno, size_t *len);
 
 #if LUA_VERSION_NUM >= 502
 /* lua_equal deprecated in favour of lua_compare */
@@ -0,0 +1,342 @@
+#ifndef SHMRING_H
+#define SHMRING_H
+
+/* A ring of records in shared memory, with one process pushing and one
+   popping, made by subprocess.shmring and given to a child process with
+   the shmring option of subprocess.popen. Linux only.
+
+   The child is given three file descriptors: the memfd holding the ring at
+   shmring_fd (3 by default), an eventfd that is signalled when a record is
+   pushed at shmring_fd + 1, and one that is signalled when a record is
+   popped at shmring_fd + 2. A helper program includes this header and
+   attaches with
+
+       struct shmring r;
+       const void *p;
+       size_t len;
+
+       if (shmring_attach(&r, 3) == -1) ...
+       while ((p = shmring_peek(&r, &len, -1)) != NULL){
+           ... use len bytes at p, in place ...
+           shmring_release(&r);
+       }
+       if (errno != 0) ... an error, rather than the end ...
+
+   The records are mapped twice, one copy after the other, so a record is
+   always contiguous and can be read or written in place. Each side only
+   makes a system call when the other is waiting for it, so a busy ring
+   passes records without any. */
+
+#include "stddef.h"
+#include "stdint.h"
+#include "string.h"
+#include "errno.h"
+#include "time.h"
+#include "poll.h"
+#include "unistd.h"
+#include "sys/mman.h"
+#include "sys/stat.h"
+
+#if defined(__GNUC__)
+#define SHMRING_FN static __attribute__((unused))
+#else
+#define SHMRING_FN static
+#endif
+
+#define SHMRING_MAGIC 0x676e6972u   /* "ring" */
+#define SHMRING_VERSION 1
+#define SHMRING_LINE 64             /* each side's fields on a cache line of their own */
+#define SHMRING_RECHDR 8            /* length of a record's header */
+
+/* Start of the shared memory. The records start at info.offset. */
+struct shmring_hdr {
+    union {
+        struct {
+            uint32_t magic;
+            uint32_t version;
+            uint64_t size;          /* bytes for records, a power of two */
+            uint64_t offset;        /* a multiple of the page size */
+        } s;
+        char pad[SHMRING_LINE];
+    } info;
+    union {                         /* written by the pushing side */
+        struct {
+            uint64_t head;          /* bytes pushed, in total */
+            uint32_t closed;        /* set when nothing more will be pushed */
+            uint32_t waiting;       /* set while waiting for room */
+        } s;
+        char pad[SHMRING_LINE];
+    } prod;
+    union {                         /* written by the popping side */
+        struct {
+            uint64_t tail;          /* bytes popped, in total */
+            uint32_t waiting;       /* set while waiting for a record */
+        } s;
+        char pad[SHMRING_LINE];
+    } cons;
+};
+
+/* One process's view of a ring */
+struct shmring {
+    struct shmring_hdr *hdr;
+    unsigned char *data;    /* records, mapped twice over */
+    size_t mapsize;
+    uint64_t mask;          /* size - 1 */
+    int fd;                 /* the memfd */
+    int pushfd, popfd;      /* eventfds signalled on push and on pop */
+    uint64_t peeked;        /* the size of the record shmring_peek returned */
+};
+
+/* A record is a header holding its length, then the data, padded so that
+   every record starts on an 8-byte boundary */
+#define shmring_recsize(len) (SHMRING_RECHDR + (((uint64_t) (len) + 7) & ~(uint64_t) 7))
+
+/* The largest record that fits */
+#define shmring_maxrecord(r) ((size_t) ((r)->mask + 1 - SHMRING_RECHDR))
+
+/* Map the ring in the memfd fd, which holds a header written by
+   shmring_init. Returns 0, or -1 with errno set. */
+SHMRING_FN int shmring_map(struct shmring *r, int fd, int pushfd, int popfd)
+{
+    struct shmring_hdr h;
+    unsigned char *base;
+    size_t size, offset;
+    ssize_t n = pread(fd, &h, sizeof h, 0);
+
+    if (n != (ssize_t) sizeof h){
+        if (n >= 0) errno = EINVAL;
+        return -1;
+    }
+    size = (size_t) h.info.s.size;
+    offset = (size_t) h.info.s.offset;
+    if (h.info.s.magic != SHMRING_MAGIC || h.info.s.version != SHMRING_VERSION
+            || size == 0 || (size & (size - 1)) != 0 || offset < sizeof h
+            || offset % (size_t) sysconf(_SC_PAGESIZE) != 0
+            || size % (size_t) sysconf(_SC_PAGESIZE) != 0){
+        errno = EINVAL;
+        return -1;
+    }
+    /* reserve room for the header and two copies of the records, then
+       map the file over it */
+    r->mapsize = offset + 2 * size;
+    base = mmap(NULL, r->mapsize, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) return -1;
+    if (mmap(base, offset + size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED
+            || mmap(base + offset + size, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+                    fd, (off_t) offset) == MAP_FAILED){
+        int en = errno;
+        munmap(base, r->mapsize);
+        errno = en;
+        return -1;
+    }
+    r->hdr = (struct shmring_hdr *) base;
+    r->data = base + offset;
+    r->mask = size - 1;
+    r->fd = fd;
+    r->pushfd = pushfd;
+    r->popfd = popfd;
+    r->peeked = 0;
+    return 0;
+}
+
+/* Attach to a ring given to this process at fd, as set up by popen */
+SHMRING_FN int shmring_attach(struct shmring *r, int fd)
+{
+    return shmring_map(r, fd, fd + 1, fd + 2);
+}
+
+/* Write the header of a new ring of size bytes (a power of two, and a
+   multiple of the page size) to the memfd fd, and size the file */
+SHMRING_FN int shmring_init(int fd, size_t size)
+{
+    struct shmring_hdr h;
+    size_t offset = (size_t) sysconf(_SC_PAGESIZE);
+    while (offset < sizeof h) offset *= 2;
+    if (ftruncate(fd, (off_t) (offset + size)) == -1) return -1;
+    memset(&h, 0, sizeof h);
+    h.info.s.magic = SHMRING_MAGIC;
+    h.info.s.version = SHMRING_VERSION;
+    h.info.s.size = size;
+    h.info.s.offset = offset;
+    if (pwrite(fd, &h, sizeof h, 0) != (ssize_t) sizeof h) return -1;
+    return 0;
+}
+
+/* Unmap the ring. The file descriptors are left open. */
+SHMRING_FN void shmring_detach(struct shmring *r)
+{
+    if (r->hdr){
+        munmap(r->hdr, r->mapsize);
+        r->hdr = NULL;
+    }
+}
+
+/* Wake the other side, through the eventfd efd */
+SHMRING_FN void shmring_wake(int efd)
+{
+    uint64_t one = 1;
+    ssize_t n = write(efd, &one, sizeof one);
+    (void) n;   /* if the counter is full, it has plenty of wakeups anyway */
+}
+
+/* Wait until efd is signalled or the deadline *dl (if any) passes.
+   timeout is in milliseconds, -1 to wait for ever; the deadline is worked
+   out on the first call, with *dl set to {0, 0}. Returns 0 when woken, or
+   -1 with errno ETIMEDOUT or another error. */
+SHMRING_FN int shmring_sleep(int efd, int timeout, struct timespec *dl)
+{
+    struct pollfd pfd;
+    struct timespec now;
+    uint64_t v;
+    int n, ms = -1;
+
+    if (timeout >= 0){
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (dl->tv_sec == 0 && dl->tv_nsec == 0){
+            dl->tv_sec = now.tv_sec + timeout / 1000;
+            dl->tv_nsec = now.tv_nsec + (long) (timeout % 1000) * 1000000;
+            if (dl->tv_nsec >= 1000000000){
+                dl->tv_sec++;
+                dl->tv_nsec -= 1000000000;
+            }
+        }
+        ms = (int) ((dl->tv_sec - now.tv_sec) * 1000 + (dl->tv_nsec - now.tv_nsec) / 1000000);
+        if (ms < 0) ms = 0;
+    }
+    pfd.fd = efd;
+    pfd.events = POLLIN;
+    while ((n = poll(&pfd, 1, ms)) == -1 && errno == EINTR) ;
+    if (n == -1) return -1;
+    if (n == 0){
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    if (read(efd, &v, sizeof v) == -1 && errno != EAGAIN) return -1;
+    return 0;
+}
+
+/* Room for a record of len bytes: waits up to timeout milliseconds (-1
+   for ever) until there is room, then returns where to write it. Returns
+   NULL with errno set on failure: EMSGSIZE if it can never fit, EPIPE
+   after shmring_shutdown, ETIMEDOUT. */
+SHMRING_FN void *shmring_reserve(struct shmring *r, size_t len, int timeout)
+{
+    struct shmring_hdr *h = r->hdr;
+    uint64_t head = h->prod.s.head, need = shmring_recsize(len);
+    struct timespec dl = {0, 0};
+
+    if (len > shmring_maxrecord(r)){
+        errno = EMSGSIZE;
+        return NULL;
+    }
+    if (h->prod.s.closed){
+        errno = EPIPE;
+        return NULL;
+    }
+    while (r->mask + 1 - (head - __atomic_load_n(&h->cons.s.tail, __ATOMIC_ACQUIRE)) < need){
+        /* say we're waiting, then look again, so that a pop in between
+           is sure to see the flag and wake us */
+        __atomic_store_n(&h->prod.s.waiting, 1, __ATOMIC_SEQ_CST);
+        if (r->mask + 1 - (head - __atomic_load_n(&h->cons.s.tail, __ATOMIC_SEQ_CST)) < need
+                && shmring_sleep(r->popfd, timeout, &dl) == -1){
+            __atomic_store_n(&h->prod.s.waiting, 0, __ATOMIC_RELAXED);
+            return NULL;
+        }
+        __atomic_store_n(&h->prod.s.waiting, 0, __ATOMIC_RELAXED);
+    }
+    return r->data + (head & r->mask) + SHMRING_RECHDR;
+}
+
+/* Push the record of len bytes written where shmring_reserve said */
+SHMRING_FN void shmring_commit(struct shmring *r, size_t len)
+{
+    struct shmring_hdr *h = r->hdr;
+    uint64_t head = h->prod.s.head;
+    uint32_t n = (uint32_t) len;
+    memcpy(r->data + (head & r->mask), &n, sizeof n);
+    __atomic_store_n(&h->prod.s.head, head + shmring_recsize(len), __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&h->cons.s.waiting, __ATOMIC_SEQ_CST))
+        shmring_wake(r->pushfd);
+}
+
+/* Push a copy of len bytes at buf. Returns 0, or -1 as shmring_reserve. */
+SHMRING_FN int shmring_push(struct shmring *r, const void *buf, size_t len, int timeout)
+{
+    void *p = shmring_reserve(r, len, timeout);
+    if (!p) return -1;
+    memcpy(p, buf, len);
+    shmring_commit(r, len);
+    return 0;
+}
+
+/* Push nothing more. The other side pops what is left, then sees the end. */
+SHMRING_FN void shmring_shutdown(struct shmring *r)
+{
+    struct shmring_hdr *h = r->hdr;
+    __atomic_store_n(&h->prod.s.closed, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&h->cons.s.waiting, __ATOMIC_SEQ_CST))
+        shmring_wake(r->pushfd);
+}
+
+/* The next record: waits up to timeout milliseconds (-1 for ever) for one
+   to be pushed, then returns where it is, with its length in *len. It stays
+   in the ring until shmring_release. Returns NULL at the end, with errno
+   set to 0, or on failure with errno set (ETIMEDOUT, for one, or EPROTO if
+   the other side wrote a record that doesn't fit in what it pushed). */
+SHMRING_FN const void *shmring_peek(struct shmring *r, size_t *len, int timeout)
+{
+    struct shmring_hdr *h = r->hdr;
+    uint64_t head, tail = h->cons.s.tail;
+    struct timespec dl = {0, 0};
+    uint32_t n;
+
+    while ((head = __atomic_load_n(&h->prod.s.head, __ATOMIC_ACQUIRE)) == tail){
+        if (__atomic_load_n(&h->prod.s.closed, __ATOMIC_ACQUIRE)){
+            /* the last record may have been pushed just before */
+            if ((head = __atomic_load_n(&h->prod.s.head, __ATOMIC_ACQUIRE)) != tail) break;
+            errno = 0;
+            return NULL;
+        }
+        __atomic_store_n(&h->cons.s.waiting, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&h->prod.s.head, __ATOMIC_SEQ_CST) == tail
+                && !__atomic_load_n(&h->prod.s.closed, __ATOMIC_SEQ_CST)
+                && shmring_sleep(r->pushfd, timeout, &dl) == -1){
+            __atomic_store_n(&h->cons.s.waiting, 0, __ATOMIC_RELAXED);
+            return NULL;
+        }
+        __atomic_store_n(&h->cons.s.waiting, 0, __ATOMIC_RELAXED);
+    }
+    /* the other side may be buggy or hostile: don't read past the ring */
+    memcpy(&n, r->data + (tail & r->mask), sizeof n);
+    if (n > shmring_maxrecord(r) || shmring_recsize(n) > head - tail){
+        errno = EPROTO;
+        return NULL;
+    }
+    r->peeked = shmring_recsize(n);
+    *len = n;
+    return r->data + (tail & r->mask) + SHMRING_RECHDR;
+}
+
+/* Remove the record returned by shmring_peek */
+SHMRING_FN void shmring_release(struct shmring *r)
+{
+    struct shmring_hdr *h = r->hdr;
+    __atomic_store_n(&h->cons.s.tail, h->cons.s.tail + r->peeked, __ATOMIC_SEQ_CST);
+    r->peeked = 0;
+    if (__atomic_load_n(&h->prod.s.waiting, __ATOMIC_SEQ_CST))
+        shmring_wake(r->popfd);
+}
+
+/* Pop the next record, copying up to max bytes of it to buf. Returns its
+   whole length, or -1 as shmring_peek. */
+SHMRING_FN long shmring_pop(struct shmring *r, void *buf, size_t max, int timeout)
+{
+    size_t len;
+    const void *p = shmring_peek(r, &len, timeout);
+    if (!p) return -1;
+    memcpy(buf, p, len < max ? len : max);
+    shmring_release(r);
+    return (long) len;
+}
+
+#endif
@@ -20,7 +20,12 @@
  */
 
 #ifdef OS_POSIX
-#define _POSIX_SOURCE
+#ifdef __linux__
+/* for pidfds, epoll and other Linux extensions */
+#define _GNU_SOURCE
+#else
+#define _XOPEN_SOURCE 700
+#endif
 #endif
 
 #if !defined(OS_WINDOWS) && !defined(OS_POSIX)
@@ -37,14 +42,51 @@
 #include "errno.h"
 #include "fcntl.h"
 #include "assert.h"
+#include "ctype.h"
 #include "liolib-copy.h"
 #if defined(OS_POSIX)
 #include "unistd.h"
 #include "sys/wait.h"
 #include "sys/stat.h"
+#include "signal.h"
+#include "time.h"
+#include "poll.h"
+#include "sys/socket.h"
+#include "pthread.h"
 #include "stdio.h"
+#include "stdint.h"
+#include "sys/mman.h"
+#include "sys/resource.h"
+#ifdef __linux__
+#include "sched.h"
+#include "dirent.h"
+#include "sys/prctl.h"
+#include "sys/syscall.h"
+#include "sys/epoll.h"
+#include "dlfcn.h"
+#include "linux/version.h"
+#ifdef SYS_pidfd_open
+#define HAVE_PIDFD
+#endif
+/* shared memory rings, made in memfds */
+#ifdef SYS_memfd_create
+#include "sys/eventfd.h"
+#include "shmring.h"
+#define HAVE_SHMRING
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U
+#endif
+#endif
+/* io_uring with IORING_OP_READ/WRITE, unless disabled with -DNO_URING */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,6,0) && defined(SYS_io_uring_setup) && !defined(NO_URING)
+#include "linux/io_uring.h"
+#define HAVE_URING
+#endif
+#endif
 typedef int filedes_t;
 
+extern char **environ;
+
 /* return 1 if the named directory exists and is a directory */
 static int direxists(const char *fname)
 {
@@ -88,12 +130,24 @@ static int direxists(const char *fname)
 struct proc {
 #if defined(OS_POSIX)
     pid_t pid;
+    int pidfd;          /* -1 until wait_any needs one */
+    unsigned waitset;   /* id of the wait set the pidfd was last added to */
+    int pgroup;         /* 1 if the child leads a process group of its own */
+    int procfd;         /* its /proc directory, -1 until sample needs it */
 #elif defined(OS_WINDOWS)
     DWORD pid;
     HANDLE hProcess;
 #endif
     unsigned char done; /* set to 1 when child has finished and closed */
     int exitcode;
+    unsigned waitmark;  /* last wait_any call that this proc was part of */
+    /* Pipe ends for stdin/stdout/stderr. A Lua file object is only made
+       for a pipe when it is first looked up; until then the FILE* is kept
+       here, and after that the file object is referred to by piperefs. */
+    FILE *pipes[3];
+    int piperefs[3];    /* registry references, or LUA_NOREF */
+    int objrefs[3];     /* registry references to the sink or channel used
+                           instead of a pipe, or LUA_NOREF */
 };
 
 /* Lua registry key for proc metatable */
@@ -143,15 +197,45 @@ static struct proc *toproc(lua_State *L, int index)
 static struct proc *newproc(lua_State *L)
 {
     struct proc *proc = lua_newuserdata(L, sizeof *proc);
+    int i;
+    for (i=0; i<3; ++i){
+        proc->pipes[i] = NULL;
+        proc->piperefs[i] = LUA_NOREF;
+        proc->objrefs[i] = LUA_NOREF;
+    }
     proc->done = 1;
     proc->pid = 0;
+#if defined(OS_POSIX)
+    proc->pidfd = -1;
+    proc->waitset = 0;
+    proc->pgroup = 0;
+    proc->procfd = -1;
+#endif
+    proc->waitmark = 0;
     luaL_getmetatable(L, SP_PROC_META);
     lua_setmetatable(L, -2);
-    lua_newtable(L);
-    lua_setfenv(L, -2);
     return proc;
 }
 
+/* Push the file object for pipe i (0, 1 or 2) of a proc, making it if
+   this is the first time it has been asked for. Pushes nil if there is
+   no pipe. */
+static void pushpipe(lua_State *L, struct proc *proc, int i)
+{
+    if (proc->objrefs[i] != LUA_NOREF){
+        lua_rawgeti(L, LUA_REGISTRYINDEX, proc->objrefs[i]);
+    } else if (proc->piperefs[i] != LUA_NOREF){
+        lua_rawgeti(L, LUA_REGISTRYINDEX, proc->piperefs[i]);
+    } else if (proc->pipes[i]){
+        *liolib_copy_newfile(L) = proc->pipes[i];
+        proc->pipes[i] = NULL;
+        lua_pushvalue(L, -1);
+        proc->piperefs[i] = luaL_ref(L, LUA_REGISTRYINDEX);
+    } else {
+        lua_pushnil(L);
+    }
+}
+
 /* Mark a process (at index) as done */
 static void doneproc(lua_State *L, int index)
 {
@@ -160,6 +244,16 @@ static void doneproc(lua_State *L, int index)
         fputs("subprocess.c: doneproc: not a proc\n", stderr);
     } else {
         proc->done = 1;
+#if defined(OS_POSIX)
+        if (proc->pidfd != -1){
+            close(proc->pidfd); /* also removes it from any wait sets */
+            proc->pidfd = -1;
+        }
+        if (proc->procfd != -1){
+            close(proc->procfd);
+            proc->procfd = -1;
+        }
+#endif
         /* remove proc from SP_LIST */
         lua_checkstack(L, 4);
         lua_pushvalue(L, index);    /* stack: proc */
@@ -171,7 +265,10 @@ static void doneproc(lua_State *L, int index)
             lua_pushinteger(L, proc->pid);      /* stack: proc list pid */
             lua_pushvalue(L, -1);               /* stack: proc list pid pid */
             lua_gettable(L, -3);                /* stack: proc list pid proc2 */
-            if (!lua_equal(L, -4, -1)){
+            if (lua_isnil(L, -1)){
+                /* already gone (the list is weak) */
+                lua_pop(L, 2);                  /* stack: proc list */
+            } else if (!lua_equal(L, -4, -1)){
                 /* lookup by pid didn't work */
                 fputs("subprocess.c: doneproc: XXX: pid lookup in SP_LIST failed\n", stderr);
                 lua_pop(L, 2);                  /* stack: proc list */
@@ -186,12 +283,293 @@ static void doneproc(lua_State *L, int index)
     }
 }
 
+#if defined(OS_POSIX)
+/* A wait status can only be collected once, and subprocess.wait collects
+   whichever child exits first, so a Lua state could reap a child that
+   belongs to another Lua state in the same process. To avoid this, every
+   child is recorded here along with the state that started it (identified
+   by its registry). A status collected on behalf of another state is kept
+   until that state asks for it.
+   The children, the orphans and the fork server are shared by every Lua
+   state in the process, and are protected by sp_mutex. Children are only
+   reaped with it held. */
+struct child {
+    pid_t pid;              /* 0 if this slot is free */
+    const void *owner;      /* registry of the owning state; NULL for orphans */
+    unsigned char server;   /* started by the fork server */
+    unsigned char exited;   /* reaped, and stat is its wait status */
+    int stat;
+};
+
+static pthread_mutex_t sp_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* broadcast when a status is kept for another thread, or when a thread
+   stops waiting on behalf of the others */
+static pthread_cond_t sp_cond = PTHREAD_COND_INITIALIZER;
+
+/* Hash table of children, keyed by pid (linear probing) */
+static struct child *children;
+static size_t children_size, nchildren;
+
+/* Set while a thread is blocked in waitid for any child. Other threads
+   that want any child wait on sp_cond instead. */
+static int reaping;
+
+#define sp_lock() pthread_mutex_lock(&sp_mutex)
+#define sp_unlock() pthread_mutex_unlock(&sp_mutex)
+
+static size_t childslot(pid_t pid)
+{
+    return ((size_t) pid * 2654435761u) & (children_size - 1);
+}
+
+static struct child *findchild(pid_t pid)
+{
+    size_t i;
+    if (children_size == 0) return NULL;
+    for (i = childslot(pid); children[i].pid; i = (i + 1) & (children_size - 1))
+        if (children[i].pid == pid) return &children[i];
+    return NULL;
+}
+
+/* Record a new child. Returns -1 if out of memory, in which case the
+   child will be treated like one not started by us. */
+static int addchild(pid_t pid, const void *owner, int server)
+{
+    struct child *c, *old;
+    size_t oldsize, i, j;
+
+    c = findchild(pid);
+    if (!c){
+        if (2 * (nchildren + 1) > children_size){
+            old = children;
+            oldsize = children_size;
+            i = children_size ? children_size * 2 : 64;
+            if ((children = calloc(i, sizeof *children)) == NULL){
+                children = old;
+                return -1;
+            }
+            children_size = i;
+            for (i=0; i<oldsize; ++i){
+                if (!old[i].pid) continue;
+                for (j = childslot(old[i].pid); children[j].pid; j = (j + 1) & (children_size - 1)) ;
+                children[j] = old[i];
+            }
+            free(old);
+        }
+        for (i = childslot(pid); children[i].pid; i = (i + 1) & (children_size - 1)) ;
+        c = &children[i];
+        ++nchildren;
+    }
+    /* if pid was already here, it's a stale entry that nobody collected */
+    c->pid = pid;
+    c->owner = owner;
+    c->server = (unsigned char) server;
+    c->exited = 0;
+    c->stat = 0;
+    return 0;
+}
+
+static void delchild(struct child *c)
+{
+    size_t mask = children_size - 1, i = c - children, j = i, k;
+    /* move later entries of the same run back, so lookups don't stop at
+       the gap */
+    for (;;){
+        j = (j + 1) & mask;
+        if (!children[j].pid) break;
+        k = childslot(children[j].pid);
+        if (i <= j ? (i < k && k <= j) : (i < k || k <= j)) continue;
+        children[i] = children[j];
+        i = j;
+    }
+    children[i].pid = 0;
+    --nchildren;
+}
+
+static int droporphan(pid_t pid);
+
+/* Remove a child that has been collected */
+static void forgetchild(struct child *c)
+{
+    if (!c->owner) droporphan(c->pid);
+    delchild(c);
+}
+
+static void fs_poll(void);
+
+/* Collect the wait status of child pid, without blocking. Returns pid
+   if it has exited, 0 if not and -1 on error. */
+static pid_t collect(pid_t pid, int *stat)
+{
+    struct child *c = findchild(pid);
+    pid_t r;
+    if (c && c->server && !c->exited){
+        fs_poll();
+        c = findchild(pid);
+    }
+    if (c && c->exited){
+        *stat = c->stat;
+        forgetchild(c);
+        return pid;
+    }
+    if (c && c->server) return 0;
+    r = waitpid(pid, stat, WNOHANG);
+    if (r != 0 && c) forgetchild(c);
+    return r;
+}
+
+/* Orphans are children whose proc objects were garbage collected while
+   they were still running. Nothing else will wait for them, so they are
+   kept in this list and reaped a few at a time by prune, instead of being
+   left as zombies. The functions here are called with sp_mutex held. */
+struct orphan {
+    pid_t pid;
+    int pidfd;          /* -1 if not available */
+};
+
+static struct orphan *orphans;
+static size_t norphans, orphans_size;
+static size_t norphans_nofd;    /* number of orphans without a pidfd */
+static size_t orphan_next;      /* where the next round of polling starts */
+#ifdef HAVE_PIDFD
+static int orphan_epfd = -1;    /* epoll set of the orphans' pidfds */
+#endif
+
+/* Number of orphans without pidfds polled by each call to prune */
+#define ORPHAN_REAP_BATCH 16
+
+static void addorphan(pid_t pid)
+{
+    struct orphan *newp;
+    struct child *c;
+    size_t size;
+    int pidfd = -1;
+#ifdef HAVE_PIDFD
+    struct epoll_event ev;
+#endif
+
+    c = findchild(pid);
+    if (c && c->exited){
+        /* reaped in the meantime; nobody wants its status */
+        delchild(c);
+        return;
+    }
+    if (c) c->owner = NULL;
+
+    if (norphans == orphans_size){
+        size = orphans_size ? orphans_size * 2 : 16;
+        newp = realloc(orphans, size * sizeof *orphans);
+        if (!newp) return;  /* can't keep track of it; leave a zombie */
+        orphans = newp;
+        orphans_size = size;
+    }
+#ifdef HAVE_PIDFD
+    if (orphan_epfd == -1)
+        orphan_epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (orphan_epfd != -1)
+        pidfd = syscall(SYS_pidfd_open, pid, 0);
+    if (pidfd != -1){
+        ev.events = EPOLLIN;
+        ev.data.u64 = pid;
+        if (epoll_ctl(orphan_epfd, EPOLL_CTL_ADD, pidfd, &ev)){
+            close(pidfd);
+            pidfd = -1;
+        }
+    }
+#endif
+    if (pidfd == -1) ++norphans_nofd;
+    orphans[norphans].pid = pid;
+    orphans[norphans].pidfd = pidfd;
+    ++norphans;
+}
+
+static void removeorphan(size_t i)
+{
+    if (orphans[i].pidfd != -1)
+        close(orphans[i].pidfd);
+    else
+        --norphans_nofd;
+    orphans[i] = orphans[--norphans];
+}
+
+/* Forget about an orphan that has been reaped by something else.
+   Returns 1 if pid was an orphan. */
+static int droporphan(pid_t pid)
+{
+    size_t i;
+    for (i=0; i<norphans; ++i){
+        if (orphans[i].pid == pid){
+            removeorphan(i);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Reap orphans that have finished. Those with pidfds are found through
+   epoll; the others are polled ORPHAN_REAP_BATCH at a time, or all at
+   once if all is set. */
+static void reaporphans(int all)
+{
+    size_t i, n;
+    int stat;
+    pid_t pid;
+#ifdef HAVE_PIDFD
+    struct epoll_event events[16];
+    int count, j;
+
+    if (orphan_epfd != -1 && norphans > norphans_nofd){
+        do {
+            count = epoll_wait(orphan_epfd, events, 16, 0);
+            for (j=0; j<count; ++j){
+                for (i=0; i<norphans && orphans[i].pid != (pid_t) events[j].data.u64; ++i) ;
+                if (i < norphans && collect(orphans[i].pid, &stat) != 0)
+                    droporphan(events[j].data.u64);
+            }
+        } while (count == 16);
+    }
+#endif
+    n = all ? norphans_nofd : ORPHAN_REAP_BATCH;
+    for (; n > 0 && norphans_nofd > 0; --n){
+        /* find the next orphan without a pidfd */
+        for (;; ++orphan_next){
+            if (orphan_next >= norphans) orphan_next = 0;
+            if (orphans[orphan_next].pidfd == -1) break;
+        }
+        pid = orphans[orphan_next].pid;
+        if (collect(pid, &stat) != 0)
+            droporphan(pid);    /* if collect hasn't already */
+        else
+            ++orphan_next;
+    }
+}
+#endif
+
+/* subprocess.orphans() */
+static int superorphans(lua_State *L)
+{
+#if defined(OS_POSIX)
+    sp_lock();
+    reaporphans(1);
+    lua_pushinteger(L, (lua_Integer) norphans);
+    sp_unlock();
+#elif defined(OS_WINDOWS)
+    lua_pushinteger(L, 0);
+#endif
+    return 1;
+}
+
 /* Remove old SP_LIST entries by polling them.
    Calling this every now and again can avoid leaking proc objects
-   that are not waited for. */
+   that are not waited for. This also reaps finished orphans. */
 static int prune(lua_State *L)
 {
     int top = lua_gettop(L);
+#if defined(OS_POSIX)
+    sp_lock();
+    if (norphans > 0) reaporphans(0);
+    sp_unlock();
+#endif
     lua_checkstack(L, 5);
     luaL_getmetatable(L, SP_LIST);
     if (lua_isnil(L, -1)){
@@ -210,7 +588,13 @@ static int prune(lua_State *L)
 }
 
 /* Special constants for popen arguments. */
-static char PIPE, STDOUT;
+static char PIPE, STDOUT, SOCKET, DEVNULL;
+
+#if defined(OS_POSIX)
+#define DEVNULL_NAME "/dev/null"
+#elif defined(OS_WINDOWS)
+#define DEVNULL_NAME "NUL"
+#endif
 
 /* Names of standard file handles. */
 static const char *fd_names[3] = {"stdin", "stdout", "stderr"};
@@ -221,15 +605,19 @@ struct fdinfo {
     enum {
         FDMODE_INHERIT = 0,  /* fd is inherited from parent */
         FDMODE_FILENAME,     /* open named file */
+        FDMODE_APPEND,       /* open named file for appending (not stdin) */
+        FDMODE_DEVNULL,      /* use the null device */
         FDMODE_FILEDES,      /* use a file descriptor */
         FDMODE_FILEOBJ,      /* use FILE* */
         FDMODE_PIPE,         /* create and use pipe */
-        FDMODE_STDOUT        /* redirect to stdout (only for stderr) */
+        FDMODE_STDOUT,       /* redirect to stdout (only for stderr) */
+        FDMODE_SOCKET        /* use a socket (the same for all streams) */
     } mode;
     union {
         const char *filename;
         filedes_t filedes;
         FILE *fileobj;
+        int socktype;
     } info;
 };
 
@@ -248,6 +636,38 @@ static void closefds(filedes_t *fds, int n)
     }
 }
 
+#if defined(OS_POSIX)
+/* pipe and socketpair, with the fds close-on-exec from the start, so that
+   a child forked by another thread meanwhile can't inherit them */
+static int pipe_cloexec(int fds[2])
+{
+#ifdef __linux__
+    return pipe2(fds, O_CLOEXEC);
+#else
+    /* no pipe2 everywhere; there is a window, but there's no better way */
+    if (pipe(fds) == -1) return -1;
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    return 0;
+#endif
+}
+
+static int socketpair_cloexec(int type, int fds[2])
+{
+#ifdef SOCK_CLOEXEC
+    return socketpair(AF_UNIX, type | SOCK_CLOEXEC, 0, fds);
+#else
+    if (socketpair(AF_UNIX, type, 0, fds) == -1) return -1;
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    return 0;
+#endif
+}
+
+/* dup, close-on-exec */
+#define dup_cloexec(fd) fcntl((fd), F_DUPFD_CLOEXEC, 0)
+#endif
+
 /* Close multiple C files */
 static void closefiles(FILE **files, int n)
 {
@@ -379,133 +799,174 @@ static char *compile_cmdline(const char *const *args)
 }
 #endif
 
-/* Function for opening subprocesses. Returns 0 on success and -1 on failure.
-   On failure, errmsg_out shall contain a '\0'-terminated error message. */
-static int dopopen(const char *const *args,  /* program arguments with NULL sentinel */
-                   const char *executable,   /* actual executable */
-                   struct fdinfo fdinfo[3],  /* info for stdin/stdout/stderr */
-                   int close_fds,            /* 1 to close all fds */
-                   int binary,               /* 1 to use binary files */
-                   const char *cwd,          /* working directory for program */
-                   struct proc *proc,        /* populated on success! */
-                   FILE *pipe_ends_out[3],   /* pipe ends are put here */
-                   char errmsg_out[],        /* written to on failure */
-                   size_t errmsg_len         /* length of errmsg_out (EXCLUDING sentinel) */
-                  )
 #if defined(OS_POSIX)
+/* Most fds that can be given to a child besides stdin, stdout and stderr */
+#define SP_MAXPASS 6
+
+/* Highest CPU number + 1 that the cpus option can use */
+#define SP_MAXCPUS 1024
+#define SP_CPUWORDS (SP_MAXCPUS / (8 * sizeof(unsigned long)))
+
+/* Most resource limits that can be set for a child */
+#define SP_MAXLIMITS 16
+
+/* Settings for the child process, applied after its files are set up and
+   before exec. Any that fail make the spawn fail with their errno. */
+struct spawnopts {
+    int setcpus;                        /* 1 to set the CPU affinity */
+    unsigned long cpus[SP_CPUWORDS];    /* to these CPUs */
+    int setnice;                        /* 1 to set the nice value */
+    int nice;
+    int ioprio;                         /* I/O priority for ioprio_set, or -1 */
+    int policy;                         /* scheduling policy, or -1 */
+    int priority;                       /* static priority for the policy */
+    int pgroup;                         /* 1 for a new process group, 2 for a new session */
+    int detach;                         /* 1 to fork twice, so the child isn't ours */
+    int nlimits;                        /* resource limits to set */
+    struct {
+        int resource;
+        struct rlimit rl;
+    } limits[SP_MAXLIMITS];
+};
+
+/* Everything needed to start a child process. Apart from the strings, this
+   is plain data, so it can be sent to the fork server as it is. */
+struct spawnreq {
+    const char *const *args;    /* program arguments with NULL sentinel */
+    const char *executable;     /* actual executable */
+    const char *cwd;            /* working directory, or NULL */
+    int cwdfd;                  /* the same, opened, or -1 to use the name */
+    int close_fds;              /* 1 to close all other fds */
+    int fds[3];                 /* stdin, stdout and stderr for the child */
+    int npass;                  /* number of other fds for the child */
+    int pass[SP_MAXPASS][2];    /* each fd, and the number it gets in the child */
+    struct spawnopts opts;      /* other settings for the child */
+};
+
+/* Apply opts in a newly forked child. Returns 0, or -1 with errno set. */
+static int applyopts(const struct spawnopts *opts)
 {
-    int fds[3];
     int i;
-    struct fdinfo *fdi;
-    int piperw[2];
+#ifdef __linux__
+    struct sched_param sp;
+    cpu_set_t set;
+#endif
+
+    if (opts->pgroup == 1 && setpgid(0, 0) == -1) return -1;
+    if (opts->pgroup == 2 && setsid() == -1) return -1;
+#ifdef __linux__
+    if (opts->setcpus){
+        CPU_ZERO(&set);
+        for (i=0; i<SP_MAXCPUS; ++i)
+            if (opts->cpus[i / (8 * sizeof(unsigned long))] & (1UL << (i % (8 * sizeof(unsigned long)))))
+                CPU_SET(i, &set);
+        if (sched_setaffinity(0, sizeof set, &set) == -1) return -1;
+    }
+    if (opts->policy != -1){
+        memset(&sp, 0, sizeof sp);
+        sp.sched_priority = opts->priority;
+        if (sched_setscheduler(0, opts->policy, &sp) == -1) return -1;
+    }
+    /* ioprio_set(IOPRIO_WHO_PROCESS, self, ...) */
+    if (opts->ioprio != -1 && syscall(SYS_ioprio_set, 1, 0, opts->ioprio) == -1) return -1;
+#endif
+    if (opts->setnice && setpriority(PRIO_PROCESS, 0, opts->nice) == -1) return -1;
+    for (i=0; i<opts->nlimits; ++i)
+        if (setrlimit(opts->limits[i].resource, &opts->limits[i].rl) == -1) return -1;
+    return 0;
+}
+
+static int readall(int fd, void *buf, size_t n);
+
+/* Fork and exec a child process. Returns its pid, or -1 with errno set if
+   the fork or the exec failed. The fds in req are left open. Unless owner
+   is NULL, the child is recorded as belonging to that Lua state.
+   If req->opts.detach is set, the child is forked from a short-lived
+   middle child instead, so that it is adopted by init (or a subreaper) and
+   is never ours to wait for. */
+static pid_t spawnchild(const struct spawnreq *req, const void *owner)
+{
+    struct child *c;
     int errpipe[2]; /* pipe for returning error status */
+    int moved[SP_MAXPASS];
     int flags;
     int en; /* saved errno */
     int count;
-    pid_t pid;
-
-    errmsg_out[errmsg_len] = '\0';
-
-    for (i=0; i<3; ++i)
-        pipe_ends_out[i] = NULL;
+    int i;
+    pid_t pid, detached;
 
-    /* Manage stdin/stdout/stderr */
-    for (i=0; i<3; ++i){
-        fdi = &fdinfo[i];
-        switch (fdi->mode){
-            case FDMODE_INHERIT:
-inherit:
-                fds[i] = dup(i);
-                if (fds[i] == -1){
-fd_failure:
-                    strncpy(errmsg_out, strerror(errno), errmsg_len + 1);
-                    closefds(fds, i);
-                    closefiles(pipe_ends_out, i);
-                    return -1;
-                }
-                break;
-            case FDMODE_FILENAME:
-                if (i == STDIN_FILENO){
-                    if ((fds[i] = open(fdi->info.filename, O_RDONLY)) == -1) goto fd_failure;
-                } else {
-                    if ((fds[i] = creat(fdi->info.filename, 0666)) == -1) goto fd_failure;
-                }
-                break;
-            case FDMODE_FILEDES:
-                if ((fds[i] = dup(fdi->info.filedes)) == -1) goto fd_failure;
-                break;
-            case FDMODE_FILEOBJ:
-                if ((fds[i] = dup(fileno(fdi->info.fileobj))) == -1) goto fd_failure;
-                break;
-            case FDMODE_PIPE:
-                if (pipe(piperw) == -1) goto fd_failure;
-                if (i == STDIN_FILENO){
-                    fds[i] = piperw[0]; /* give read end to process */
-                    if ((pipe_ends_out[i] = fdopen(piperw[1], "w")) == NULL) goto fd_failure;
-                } else {
-                    fds[i] = piperw[1]; /* give write end to process */
-                    if ((pipe_ends_out[i] = fdopen(piperw[0], "r")) == NULL) goto fd_failure;
-                }
-                break;
-            case FDMODE_STDOUT:
-                if (i == STDERR_FILENO){
-                    if ((fds[STDERR_FILENO] = dup(fds[STDOUT_FILENO])) == -1) goto fd_failure;
-                } else goto inherit;
-                break;
-        }
-    }
-    
-    /* Find executable name */
-    if (!executable){
-        /* use first arg */
-        executable = args[0];
-    }
-    assert(executable != NULL);
+    /* Create a pipe for returning error status; the write end closes
+       on exec */
+    if (pipe_cloexec(errpipe) == -1) return -1;
 
-    /* Create a pipe for returning error status */
-    if (pipe(errpipe) == -1){
-        strncpy(errmsg_out, strerror(errno), errmsg_len + 1);
-        closefds(fds, 3);
-        closefiles(pipe_ends_out, 3);
-        return -1;
-    }
-    /* Make write end close on exec */
-    flags = fcntl(errpipe[1], F_GETFD);
-    if (flags == -1){
-pipe_failure:
-        strncpy(errmsg_out, strerror(errno), errmsg_len + 1);
+    /* Do the fork/exec (TODO: use vfork somehow?)
+       The child must be recorded before anyone can reap it. Holding the
+       lock over the fork costs little, as the kernel serializes forks of
+       a process anyway. */
+    if (owner) sp_lock();
+    pid = fork();
+    if (pid > 0 && owner && !req->opts.detach) addchild(pid, owner, 0);
+    if (pid != 0 && owner && (pid == -1 || !req->opts.detach)) sp_unlock();
+    if (pid == -1){
+        en = errno;
         closefds(errpipe, 2);
-        closefds(fds, 3);
-        closefiles(pipe_ends_out, 3);
+        errno = en;
         return -1;
-    }
-    if (fcntl(errpipe[1], F_SETFD, flags | FD_CLOEXEC) == -1) goto pipe_failure;
-
-    /* Do the fork/exec (TODO: use vfork somehow?) */
-    pid = fork();
-    if (pid == -1) goto pipe_failure;
-    else if (pid == 0){
+    } else if (pid == 0){
         /* child */
         close(errpipe[0]);
-        
+
+        if (req->opts.detach){
+            /* be the middle child: send the real child's pid (or -1 and
+               errno), then leave it to be adopted */
+            detached = fork();
+            if (detached != 0){
+                en = errno;
+                write(errpipe[1], &detached, sizeof detached);
+                if (detached == -1) write(errpipe[1], &en, sizeof en);
+                _exit(0);
+            }
+        }
+
+        /* move the fds to pass out of the way of their numbers, and of
+           stdin/stdout/stderr */
+        for (i=0; i<req->npass; ++i){
+            flags = req->pass[i][1] > 3 ? req->pass[i][1] : 3;
+            if (i == 0 || flags > count) count = flags;
+        }
+        for (i=0; i<req->npass; ++i)
+            if ((moved[i] = fcntl(req->pass[i][0], F_DUPFD_CLOEXEC, count + 1)) == -1) goto child_failure;
+
         /* dup file descriptors */
         for (i=0; i<3; ++i){
-            if (dup2(fds[i], i) == -1) goto child_failure;
+            if (req->fds[i] == i){
+                /* dup2 would do nothing, including clearing FD_CLOEXEC */
+                if (fcntl(i, F_SETFD, 0) == -1) goto child_failure;
+            } else if (dup2(req->fds[i], i) == -1) goto child_failure;
         }
+        for (i=0; i<req->npass; ++i)
+            if (dup2(moved[i], req->pass[i][1]) == -1) goto child_failure;
+
+        /* change directory */
+        if (req->cwdfd != -1){
+            if (fchdir(req->cwdfd)) goto child_failure;
+        } else if (req->cwd && chdir(req->cwd)) goto child_failure;
 
         /* close other fds */
-        if (close_fds){
+        if (req->close_fds){
             for (i=3; i<sysconf(_SC_OPEN_MAX); ++i){
-                if (i != errpipe[1])
+                for (count=0; count<req->npass; ++count)
+                    if (req->pass[count][1] == i) break;
+                if (i != errpipe[1] && count == req->npass)
                     close(i);
             }
         }
 
-        /* change directory */
-        if (cwd && chdir(cwd)) goto child_failure;
+        /* CPUs, priorities etc. */
+        if (applyopts(&req->opts)) goto child_failure;
 
         /* exec! Farewell, subprocess.c! */
-        execvp(executable, (char *const*) args); /* XXX: const cast */
+        execvp(req->executable, (char *const*) req->args); /* XXX: const cast */
 
         /* Oh dear, we're still here. */
 child_failure:
@@ -515,664 +976,5400 @@ child_failure:
     }
 
     /* parent */
-    /* close unneeded fds */
-    closefds(fds, 3);
     close(errpipe[1]);
-    
+
+    if (req->opts.detach){
+        /* reap the middle child, with the lock still held so that no one
+           else can take it for one of theirs */
+        if (readall(errpipe[0], &detached, sizeof detached)){
+            detached = -1;
+            en = errno;
+        } else if (detached == -1 && readall(errpipe[0], &en, sizeof en))
+            en = errno;
+        while (waitpid(pid, &count, 0) == -1 && errno == EINTR) ;
+        if (owner) sp_unlock();
+        if (detached == -1){
+            close(errpipe[0]);
+            errno = en;
+            return -1;
+        }
+        pid = detached;
+    }
+
     /* read errno from child */
     while ((count = read(errpipe[0], &en, sizeof en)) == -1)
         if (errno != EAGAIN && errno != EINTR) break;
-    if (count > 0){
-        /* exec failed */
-        close(errpipe[0]);
-        strncpy(errmsg_out, strerror(en), errmsg_len + 1);
+    close(errpipe[0]);
+    if (count > 0 && req->opts.detach){
+        /* exec failed; init reaps it */
+        errno = en;
+        return -1;
+    } else if (count > 0){
+        /* exec failed; don't leave a zombie */
+        if (owner) sp_lock();
+        while (waitpid(pid, &count, 0) == -1 && errno == EINTR) ;
+        if (owner && (c = findchild(pid)) != NULL) delchild(c);
+        if (owner) sp_unlock();
+        errno = en;
         return -1;
     }
-    close(errpipe[0]);
-
-    /* Child is now running */
-    proc->done = 0;
-    proc->pid = pid;
-    return 0;
+    return pid;
 }
-#elif defined(OS_WINDOWS)
-{
-    HANDLE hfiles[3], piper, pipew, hfile;
-    int i, fd;
-    struct fdinfo *fdi;
-    SECURITY_ATTRIBUTES secattr;
-    STARTUPINFO si;
-    PROCESS_INFORMATION pi;
-    char *cmdline;
 
-    errmsg_out[errmsg_len] = '\0';
+/* The fork server is a small helper process, forked early on by
+   subprocess.forkserver_start, which then starts all child processes on
+   behalf of this process. The cost of forking then depends on the size of
+   the helper rather than the size of this process.
+   Requests are sent over a socket, along with the child's standard file
+   descriptors (using SCM_RIGHTS). The helper is the parent of the children,
+   so it reaps them and sends back their exit statuses. */
 
-    /* Create a SECURITY_ATTRIBUTES for inheritable handles */
-    secattr.nLength = sizeof secattr;
-    secattr.lpSecurityDescriptor = NULL;
-    secattr.bInheritHandle = TRUE;
+/* Message types */
+enum {
+    FS_SPAWN = 1,   /* request: spawnreq, strings and fds follow */
+    FS_SPAWNED,     /* reply: pid, or errno in value */
+    FS_EXITED       /* a child exited: pid, wait status in value */
+};
 
-    for (i=0; i<3; ++i)
-        pipe_ends_out[i] = NULL;
+struct fsmsg {
+    int type;
+    int len;        /* length of data following the message */
+    pid_t pid;
+    int value;
+};
 
-    /* Manage stdin/stdout/stderr */
-    for (i=0; i<3; ++i){
-        fdi = &fdinfo[i];
-        switch (fdi->mode){
-            case FDMODE_INHERIT:
-inherit:
-                /* XXX: duplicated file handles share the
-                   same object (and thus file cursor, etc.).
-                   CreateFile might be a better idea. */
-                hfile = getstdhandle(i);
-                if (hfile == INVALID_HANDLE_VALUE){
-fd_failure:
-                    copy_w32error(errmsg_out, errmsg_len, GetLastError());
-                    closefds(hfiles, i);
-                    closefiles(pipe_ends_out, i);
-                    return -1;
-                }
-dup_hfile:
-                if (DuplicateHandle(GetCurrentProcess(), hfile,
-                    GetCurrentProcess(), &hfiles[i], 0, TRUE,
-                    DUPLICATE_SAME_ACCESS) == 0)
-                {
-                    goto fd_failure;
-                }
-                break;
-            case FDMODE_FILENAME:
-                if (i == STDIN_FILENO){
-                    hfiles[i] = CreateFile(
-                        fdi->info.filename,
-                        GENERIC_READ,
-                        FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
-                        &secattr,
-                        OPEN_EXISTING,
-                        FILE_ATTRIBUTE_NORMAL,
-                        NULL);
-                } else {
-                    hfiles[i] = CreateFile(
-                        fdi->info.filename,
-                        GENERIC_WRITE,
-                        FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
-                        &secattr,
-                        CREATE_ALWAYS,
-                        FILE_ATTRIBUTE_NORMAL,
-                        NULL);
-                }
-                if (hfiles[i] == INVALID_HANDLE_VALUE){
-                    goto fd_failure;
-                }
-                break;
-            case FDMODE_FILEDES:
-                if (DuplicateHandle(GetCurrentProcess(), fdi->info.filedes,
-                    GetCurrentProcess(), &hfiles[i], 0, TRUE,
-                    DUPLICATE_SAME_ACCESS) == 0)
-                {
-                    goto fd_failure;
-                }
-                break;
-            case FDMODE_FILEOBJ:
-                fd = _fileno(fdi->info.fileobj);
-                if (fd == -1){
-get_osf_failure:
-                    strncpy(errmsg_out, strerror(errno), errmsg_len + 1);
-failure:
-                    closefds(hfiles, i);
-                    closefiles(pipe_ends_out, i);
-                    return -1;
-                }
-                hfile = (HANDLE) _get_osfhandle(fd);
-                if (hfile == INVALID_HANDLE_VALUE) goto get_osf_failure;
-                goto dup_hfile;
-            case FDMODE_PIPE:
-                if (CreatePipe(&piper, &pipew, &secattr, 0) == 0)
-                    goto fd_failure;
-                if (i == STDIN_FILENO){
-                    hfiles[i] = piper;
-                    fd = _open_osfhandle((long) pipew, binary ? 0 : _O_TEXT);
-                    if (fd == -1){
-                        strncpy(errmsg_out, "_open_osfhandle failed", errmsg_len + 1);
-                        goto failure;
-                    }
-                    pipe_ends_out[i] = _fdopen(fd, "w");
-                    if (pipe_ends_out[i] == 0){
-                        strncpy(errmsg_out, "_fdopen failed", errmsg_len + 1);
-                        goto failure;
-                    }
-                } else {
-                    hfiles[i] = pipew;
-                    fd = _open_osfhandle((long) piper, _O_RDONLY | (binary ? 0 : _O_TEXT));
-                    if (fd == -1){
-                        strncpy(errmsg_out, "_open_osfhandle failed", errmsg_len + 1);
-                        goto failure;
-                    }
-                    pipe_ends_out[i] = _fdopen(fd, "r");
-                    if (pipe_ends_out[i] == 0){
-                        strncpy(errmsg_out, "_fdopen failed", errmsg_len + 1);
-                        goto failure;
-                    }
-                }
-                break;
-            case FDMODE_STDOUT:
-                if (i == STDERR_FILENO){
-                    hfile = hfiles[STDOUT_FILENO];
-                    goto dup_hfile;
-                } else goto inherit;
+/* Maximum number of file descriptors passed with a message: stdin,
+   stdout, stderr, the fds to pass and the working directory */
+#define FS_MAXFDS (4 + SP_MAXPASS)
+
+/* Layout of the data of FS_SPAWN */
+struct fsspawn {
+    struct spawnreq req;
+    int nargs;
+    int has_executable;
+    int has_cwd;
+    /* followed by args, executable and cwd, each '\0'-terminated */
+};
+
+static int fs_sock = -1;    /* our end of the socket, or -1 */
+static pid_t fs_pid;        /* pid of the fork server */
+/* Set while a thread is blocked waiting for a message. Anyone else who
+   reads a message meanwhile writes to fs_wake, in case the message was
+   the one being waited for. */
+static int fs_reading;
+static int fs_wake[2] = {-1, -1};
+
+/* A thread waiting for the reply to FS_SPAWN. The fork server replies in
+   the order the requests were sent, so whoever reads a reply hands it to
+   the first of these. */
+struct fswaiter {
+    const void *owner;      /* Lua state the child is for */
+    int detach;             /* a detached child, which isn't ours */
+    int done;
+    pid_t pid;              /* when done: the child, or 0 */
+    int err;                /* when done: errno, if pid is 0 */
+    struct fswaiter *next;
+};
+static struct fswaiter *fs_waiters, **fs_waiters_tail = &fs_waiters;
+
+/* Read or write exactly n bytes. Returns 0 on success, -1 on failure,
+   which includes end of file. */
+static int readall(int fd, void *buf, size_t n)
+{
+    ssize_t count;
+    while (n > 0){
+        count = read(fd, buf, n);
+        if (count == -1 && errno == EINTR) continue;
+        if (count <= 0){
+            if (count == 0) errno = EPIPE;
+            return -1;
         }
+        buf = (char *) buf + count;
+        n -= count;
     }
+    return 0;
+}
 
-    /* Find executable name */
-    if (executable == NULL){
-        /* use first arg */
-        /*executable = args[0];*/
+static int writeall(int fd, const void *buf, size_t n)
+{
+    ssize_t count;
+    while (n > 0){
+        count = write(fd, buf, n);
+        if (count == -1 && errno == EINTR) continue;
+        if (count == -1) return -1;
+        buf = (const char *) buf + count;
+        n -= count;
     }
+    return 0;
+}
 
-    /* Compile command line into string. Yuck. */
-    cmdline = compile_cmdline(args);
-    if (!cmdline){
-        strncpy(errmsg_out, "memory full", errmsg_len + 1);
-        closefds(hfiles, 3);
-        closefiles(pipe_ends_out, 3);
-        return -1;
+/* Send a message, with data and file descriptors */
+static int fs_send(int sock, const struct fsmsg *msg, const void *data, const int *fds, int nfds)
+{
+    struct msghdr mh;
+    struct iovec iov;
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(FS_MAXFDS * sizeof(int))];
+    } cbuf;
+    struct cmsghdr *cmsg;
+    ssize_t count;
+
+    memset(&mh, 0, sizeof mh);
+    iov.iov_base = (void *) msg;
+    iov.iov_len = sizeof *msg;
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    if (nfds > 0){
+        mh.msg_control = cbuf.buf;
+        mh.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+        cmsg = CMSG_FIRSTHDR(&mh);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
     }
-    
+    while ((count = sendmsg(sock, &mh, 0)) == -1 && errno == EINTR) ;
+    if (count == -1) return -1;
+    if (writeall(sock, (const char *) msg + count, sizeof *msg - count)) return -1;
+    return writeall(sock, data, msg->len);
+}
 
-    si.cb = sizeof si;
-    si.lpReserved = NULL;
-    si.lpDesktop = NULL;
-    si.lpTitle = NULL;
-    si.dwFlags = STARTF_USESTDHANDLES;
-    si.cbReserved2 = 0;
-    si.lpReserved2 = NULL;
-    si.hStdInput = hfiles[0];
-    si.hStdOutput = hfiles[1];
-    si.hStdError = hfiles[2];
+/* Receive a message. *data is set to a malloc'd buffer holding its data
+   (or NULL), and any file descriptors received are stored in fds. */
+static int fs_recv(int sock, struct fsmsg *msg, char **data, int *fds, int *nfds)
+{
+    struct msghdr mh;
+    struct iovec iov;
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(FS_MAXFDS * sizeof(int))];
+    } cbuf;
+    struct cmsghdr *cmsg;
+    ssize_t count;
+    int flags = 0;
 
-    if (CreateProcess(
-        executable, /* lpApplicationName */
-        cmdline,    /* lpCommandLine */
-        NULL,       /* lpProcessAttributes */
-        NULL,       /* lpThreadAttributes */
-        TRUE,       /* bInheritHandles */
-        0,          /* dwCreationFlags */
-        NULL,       /* lpEnvironment */
-        cwd,        /* lpCurrentDirectory */
-        &si,        /* lpStartupInfo */
-        &pi)        /* lpProcessInformation */
-    == 0){
-        copy_w32error(errmsg_out, errmsg_len, GetLastError());
-        free(cmdline);
-        closefds(hfiles, 3);
-        closefiles(pipe_ends_out, 3);
+#ifdef MSG_CMSG_CLOEXEC
+    flags = MSG_CMSG_CLOEXEC;
+#endif
+    *data = NULL;
+    *nfds = 0;
+    memset(&mh, 0, sizeof mh);
+    iov.iov_base = msg;
+    iov.iov_len = sizeof *msg;
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = cbuf.buf;
+    mh.msg_controllen = sizeof cbuf.buf;
+    while ((count = recvmsg(sock, &mh, flags)) == -1 && errno == EINTR) ;
+    if (count <= 0){
+        if (count == 0) errno = EPIPE;
         return -1;
     }
-    CloseHandle(pi.hThread); /* Don't want this handle */
-    free(cmdline);
-    closefds(hfiles, 3); /* XXX: is this correct? */
-    proc->done = 0;
-    proc->pid = pi.dwProcessId;
-    proc->hProcess = pi.hProcess;
+    for (cmsg = CMSG_FIRSTHDR(&mh); cmsg; cmsg = CMSG_NXTHDR(&mh, cmsg)){
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS){
+            *nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(fds, CMSG_DATA(cmsg), *nfds * sizeof(int));
+        }
+    }
+    if (readall(sock, (char *) msg + count, sizeof *msg - count)) goto failure;
+    if (msg->len > 0){
+        if ((*data = malloc(msg->len + 1)) == NULL) goto failure;
+        if (readall(sock, *data, msg->len)) goto failure;
+        (*data)[msg->len] = '\0';
+    }
     return 0;
+failure:
+    closefds(fds, *nfds);
+    *nfds = 0;
+    free(*data);
+    *data = NULL;
+    return -1;
 }
-#endif
 
-/* popen {arg0, arg1, arg2, ..., [executable=...]} */
-static int superpopen(lua_State *L)
+/* Write end of the fork server's SIGCHLD self-pipe */
+static int fs_sigpipe = -1;
+
+static void fs_sigchld(int sig)
 {
-    struct proc *proc = NULL;
+    int en = errno;
+    char ch = 0;
+    (void) sig;
+    write(fs_sigpipe, &ch, 1);
+    errno = en;
+}
 
-    /* List of arguments (malloc'd NULL-terminated array of C strings.
-       The C strings are owned by Lua) */
-    int nargs = 0;
+/* Main loop of the fork server. Never returns. */
+static void fs_main(int sock)
+{
+    struct pollfd pfds[2];
+    struct sigaction sa;
+    struct fsmsg msg;
+    struct fsspawn *sp;
+    struct spawnreq req;
     const char **args = NULL;
-    /* Command to run (owned by Lua) */
-    const char *executable = NULL;
-    /* Directory to run it in (owned by Lua) */
-    const char *cwd = NULL;
-    /* File options */
-    struct fdinfo fdinfo[3];
-    /* Close fds? */
-    int close_fds = 0;
-    /* Use binary mode for files? */
-    int binary = 0;
-
-    FILE *pipe_ends[3] = {NULL, NULL, NULL};
-    int i, result;
-    FILE *f;
-    const char *s;
-
-    char errmsg_buf[256];
-
-    prune(L);
-
-    luaL_checktype(L, 1, LUA_TTABLE);
-    lua_settop(L, 1);
+    char *data, *str, buf[64];
+    int sigpipe[2], fds[FS_MAXFDS], nfds, i, stat;
+    pid_t pid;
 
-    proc = newproc(L);
+    /* keep nothing of our parent's open, apart from the standard files
+       (which children may inherit) */
+    for (i=3; i<sysconf(_SC_OPEN_MAX); ++i)
+        if (i != sock) close(i);
 
-    /* Stack: kwargs proc <strings etc....>
-       Lua strings are left on the stack while they are needed,
-       and Lua can garbage-collect them later. */
-    
-    /* get arguments */
-    nargs = lua_objlen(L, 1);
-    if (nargs == 0) return luaL_error(L, "no arguments specified");
-    args = lua_newuserdata(L, (nargs + 1) * sizeof *args); /*alloc((nargs + 1) * sizeof *args);*/
-    if (!args) return luaL_error(L, "memory full");
-    for (i=0; i<=nargs; ++i) args[i] = NULL;
-    luaL_checkstack(L, nargs, "cannot grow stack");
-    for (i=1; i<=nargs; ++i){
-        lua_rawgeti(L, 1, i);
-        s = lua_tostring(L, -1);
-        if (!s){
-            /*freestrings(args, nargs);
-            free(args);*/
-            return luaL_error(L, "popen argument %d not a string", (int) i);
+    if (pipe(sigpipe) == -1) _exit(1);
+    for (i=0; i<2; ++i){
+        fcntl(sigpipe[i], F_SETFD, FD_CLOEXEC);
+        fcntl(sigpipe[i], F_SETFL, O_NONBLOCK);
+    }
+    fcntl(sock, F_SETFD, FD_CLOEXEC);
+    fs_sigpipe = sigpipe[1];
+    memset(&sa, 0, sizeof sa);
+    sa.sa_handler = fs_sigchld;
+    sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGCHLD, &sa, NULL);
 
+    pfds[0].fd = sock;
+    pfds[0].events = POLLIN;
+    pfds[1].fd = sigpipe[0];
+    pfds[1].events = POLLIN;
+    for (;;){
+        if (poll(pfds, 2, -1) == -1){
+            if (errno == EINTR) continue;
+            _exit(1);
         }
-        args[i-1] = s; /*strdup(s);*/
-        /*if (args[i-1] == NULL){
-strings_failure:
-            freestrings(args, nargs);
-            free(args);
-            return luaL_error(L, "memory full");
-        } */
-        /*lua_pop(L, 1);*/
+        if (pfds[1].revents){
+            while (read(sigpipe[0], buf, sizeof buf) > 0) ;
+            while ((pid = waitpid(-1, &stat, WNOHANG)) > 0){
+                msg.type = FS_EXITED;
+                msg.len = 0;
+                msg.pid = pid;
+                msg.value = stat;
+                if (fs_send(sock, &msg, NULL, NULL, 0)) _exit(1);
+            }
+        }
+        if (!pfds[0].revents) continue;
+        if (fs_recv(sock, &msg, &data, fds, &nfds)){
+            /* our parent has gone away */
+            _exit(0);
+        }
+        sp = (struct fsspawn *) data;
+        if (msg.type != FS_SPAWN || msg.len < (int) sizeof *sp
+                || sp->req.npass < 0 || sp->req.npass > SP_MAXPASS
+                || nfds != 3 + sp->req.npass + (sp->req.cwdfd != -1)){
+            /* still one reply for each request, which is how they're
+               matched up */
+            closefds(fds, nfds);
+            free(data);
+            msg.type = FS_SPAWNED;
+            msg.len = 0;
+            msg.pid = 0;
+            msg.value = EINVAL;
+            if (fs_send(sock, &msg, NULL, NULL, 0)) _exit(1);
+            continue;
+        }
+        /* unpack the request */
+        req = sp->req;
+        args = realloc(args, (sp->nargs + 1) * sizeof *args);
+        str = data + sizeof *sp;
+        for (i=0; args && i<sp->nargs; ++i){
+            args[i] = str;
+            str += strlen(str) + 1;
+        }
+        msg.pid = 0;
+        msg.value = ENOMEM;
+        if (args){
+            args[sp->nargs] = NULL;
+            req.args = args;
+            req.executable = sp->has_executable ? str : args[0];
+            if (sp->has_executable) str += strlen(str) + 1;
+            req.cwd = sp->has_cwd ? str : NULL;
+            for (i=0; i<3; ++i)
+                req.fds[i] = fds[i];
+            for (i=0; i<req.npass; ++i)
+                req.pass[i][0] = fds[3 + i];
+            if (req.cwdfd != -1)
+                req.cwdfd = fds[3 + req.npass];
+            pid = spawnchild(&req, NULL);
+            msg.pid = pid == -1 ? 0 : pid;
+            msg.value = pid == -1 ? errno : 0;
+        }
+        closefds(fds, nfds);
+        free(data);
+        msg.type = FS_SPAWNED;
+        msg.len = 0;
+        if (fs_send(sock, &msg, NULL, NULL, 0)) _exit(1);
     }
+}
 
-    luaL_checkstack(L, 12, "cannot grow stack");
-    
-    /* get executable string */
-    lua_getfield(L, 1, "executable");
-    s = lua_tostring(L, -1);
-    if (s){
-        executable = s; /*strdup(s);*/
-        /*if (executable == NULL) goto strings_failure;*/
-    } else lua_pop(L, 1);
-    /*lua_pop(L, 1); */ /* to match lua_getfield */
+/* Read one message from the fork server, with sp_mutex held. Exit
+   statuses are stored in the table of children. Returns -1 if the fork
+   server has gone away. */
+static int fs_read(struct fsmsg *msg)
+{
+    struct fswaiter *w;
+    struct child *c;
+    char *data;
+    int fds[FS_MAXFDS], nfds;
+    if (fs_sock == -1){
+        errno = ECHILD;
+        return -1;
+    }
+    if (fs_recv(fs_sock, msg, &data, fds, &nfds)){
+        /* it's dead, Jim. Its children have been adopted by init, so
+           their exit statuses are lost. */
+        close(fs_sock);
+        fs_sock = -1;
+        if (fs_pid > 0)
+            while (waitpid(fs_pid, &nfds, 0) == -1 && errno == EINTR) ;
+        /* no replies are coming */
+        for (w = fs_waiters; w; w = w->next){
+            w->done = 1;
+            w->pid = 0;
+            w->err = ECHILD;
+        }
+        fs_waiters = NULL;
+        fs_waiters_tail = &fs_waiters;
+        if (fs_reading) write(fs_wake[1], "", 1);
+        pthread_cond_broadcast(&sp_cond);
+        errno = ECHILD;
+        return -1;
+    }
+    closefds(fds, nfds);
+    free(data);
+    if (msg->type == FS_SPAWNED && (w = fs_waiters) != NULL){
+        if ((fs_waiters = w->next) == NULL) fs_waiters_tail = &fs_waiters;
+        w->done = 1;
+        w->pid = msg->pid;
+        w->err = msg->value;
+        /* before any FS_EXITED for it is read */
+        if (w->pid != 0 && !w->detach) addchild(w->pid, w->owner, 1);
+        if (fs_reading) write(fs_wake[1], "", 1);
+        pthread_cond_broadcast(&sp_cond);
+    }
+    if (msg->type == FS_EXITED && (c = findchild(msg->pid)) != NULL){
+        c->exited = 1;
+        c->stat = msg->value;
+        if (!c->owner) forgetchild(c);
+        if (fs_reading) write(fs_wake[1], "", 1);
+        pthread_cond_broadcast(&sp_cond);
+    }
+    return 0;
+}
 
-    /* get directory name */
-    lua_getfield(L, 1, "cwd");
-    cwd = lua_tostring(L, -1);
-    if (cwd == NULL) lua_pop(L, 1);
-    else {
-    /*if (lua_isstring(L, -1)){
-        cwd = lua_tostring(L, -1);*/ /*strdup(lua_tostring(L, -1));
-        if (!cwd){
-            free(executable);
-            freestrings(args, nargs);
-            free(args);
-            return luaL_error(L, "memory full");
-        }                            */
-        /* make sure the cwd exists */
-        if (!direxists(cwd)){
-            /*free(executable);
-            freestrings(args, nargs);*/
-            /*free(args);*/
-            return luaL_error(L, "directory `%s' does not exist", cwd);
+/* Read any messages that are waiting, without blocking */
+static void fs_poll(void)
+{
+    struct pollfd pfd;
+    struct fsmsg msg;
+    if (fs_reading) return;     /* they'll get there first */
+    pfd.fd = fs_sock;
+    pfd.events = POLLIN;
+    while (fs_sock != -1 && poll(&pfd, 1, 0) > 0)
+        if (fs_read(&msg)) break;
+}
+
+/* Wait until a message arrives from the fork server (or, if another
+   thread is already waiting for one, until that thread has read it).
+   Called with sp_mutex held, which is released while waiting. */
+static int fs_wait(void)
+{
+    struct pollfd pfds[2];
+    char buf[64];
+    if (fs_sock == -1){
+        errno = ECHILD;
+        return -1;
+    }
+    if (fs_reading){
+        pthread_cond_wait(&sp_cond, &sp_mutex);
+        return 0;
+    }
+    fs_reading = 1;
+    pfds[0].fd = fs_sock;
+    pfds[0].events = POLLIN;
+    pfds[1].fd = fs_wake[0];
+    pfds[1].events = POLLIN;
+    sp_unlock();
+    while (poll(pfds, 2, -1) == -1 && errno == EINTR) ;
+    sp_lock();
+    fs_reading = 0;
+    while (read(fs_wake[0], buf, sizeof buf) > 0) ;
+    fs_poll();
+    pthread_cond_broadcast(&sp_cond);
+    return 0;
+}
+
+/* Start a child using the fork server, on behalf of the Lua state owner.
+   Returns its pid, or -1 with errno set on failure. Called with sp_mutex
+   held, which is released while waiting for the reply, so that other
+   threads can go on (and spawn) meanwhile. */
+static pid_t fs_spawn(const struct spawnreq *req, const void *owner)
+{
+    struct fswaiter *w;
+    struct fsmsg msg;
+    pid_t pid;
+    struct fsspawn *sp;
+    size_t len = sizeof *sp;
+    char *data, *str;
+    int fds[FS_MAXFDS];
+    int i;
+
+    for (i=0; req->args[i]; ++i)
+        len += strlen(req->args[i]) + 1;
+    if (req->executable) len += strlen(req->executable) + 1;
+    if (req->cwd) len += strlen(req->cwd) + 1;
+    if ((w = malloc(sizeof *w)) == NULL) return -1;
+    if ((data = malloc(len)) == NULL){
+        free(w);
+        return -1;
+    }
+    sp = (struct fsspawn *) data;
+    sp->req = *req;
+    sp->nargs = i;
+    sp->has_executable = req->executable != NULL;
+    sp->has_cwd = req->cwd != NULL;
+    str = data + sizeof *sp;
+    for (i=0; req->args[i]; ++i)
+        str = strcpy(str, req->args[i]) + strlen(req->args[i]) + 1;
+    if (req->executable)
+        str = strcpy(str, req->executable) + strlen(req->executable) + 1;
+    if (req->cwd)
+        strcpy(str, req->cwd);
+
+    msg.type = FS_SPAWN;
+    msg.len = len;
+    msg.pid = 0;
+    msg.value = 0;
+    for (i=0; i<3; ++i)
+        fds[i] = req->fds[i];
+    for (i=0; i<req->npass; ++i)
+        fds[3 + i] = req->pass[i][0];
+    if (req->cwdfd != -1)
+        fds[3 + req->npass] = req->cwdfd;
+    /* sent with the lock held, so that the replies come in the order of
+       fs_waiters */
+    i = fs_send(fs_sock, &msg, data, fds, 3 + req->npass + (req->cwdfd != -1));
+    free(data);
+    if (i){
+        free(w);
+        return -1;
+    }
+    w->owner = owner;
+    w->detach = req->opts.detach;
+    w->done = 0;
+    w->next = NULL;
+    *fs_waiters_tail = w;
+    fs_waiters_tail = &w->next;
+    /* fs_read fills in w (and records the child) when the reply comes,
+       whichever thread reads it; if the server dies, it fails them all */
+    while (!w->done)
+        fs_wait();
+    pid = w->pid;
+    errno = w->err;
+    free(w);
+    return pid == 0 ? -1 : pid;
+}
+
+/* Like waitpid, for any of our children. options may be 0 or WNOHANG. */
+static pid_t sp_waitpid(pid_t pid, int *stat, int options)
+{
+    struct child *c;
+    siginfo_t info;
+    pid_t r;
+    sp_lock();
+    for (;;){
+        r = collect(pid, stat);
+        if (r != 0 || (options & WNOHANG)) break;
+        c = findchild(pid);
+        if (c && c->server){
+            if (fs_wait()){
+                r = -1;
+                break;
+            }
+        } else {
+            /* wait without reaping, so that the status is collected with
+               the lock held */
+            sp_unlock();
+            while (waitid(P_PID, (id_t) pid, &info, WEXITED | WNOWAIT) == -1 && errno == EINTR) ;
+            sp_lock();
         }
     }
-    /*lua_pop(L, 1);*/
+    sp_unlock();
+    return r;
+}
 
-    /* close_fds */
-    lua_getfield(L, 1, "close_fds");
-    close_fds = lua_toboolean(L, -1);
-    lua_pop(L, 1);
+/* Like wait, for any child belonging to the Lua state owner. Children
+   not started by this module are returned too, as wait would. */
+static pid_t sp_wait(const void *owner, int *stat)
+{
+    struct child *c;
+    siginfo_t info;
+    struct timespec ts;
+    size_t i, nlocal, nserver;
+    long delay = 1000000;
+    pid_t pid = -1;
 
-    /* binary */
-    lua_getfield(L, 1, "binary");
-    binary = lua_toboolean(L, -1);
-    lua_pop(L, 1);
+    sp_lock();
+    for (;;){
+        fs_poll();
+        /* look for a status that is already waiting for us, and count the
+           children still running */
+        nlocal = nserver = 0;
+        for (i=0; i<children_size; ++i){
+            c = &children[i];
+            if (!c->pid || c->owner != owner) continue;
+            if (c->exited){
+                pid = c->pid;
+                *stat = c->stat;
+                delchild(c);
+                goto done;
+            }
+            if (c->server) ++nserver;
+            else ++nlocal;
+        }
+        if (nlocal == 0 && nserver == 0){
+            errno = ECHILD;
+            pid = -1;
+            break;
+        }
+        if (nlocal == 0){
+            if (fs_wait()) break;
+            continue;
+        }
+        info.si_pid = 0;
+        if (nserver == 0 && !reaping){
+            /* block until any child exits. Only one thread does this at
+               a time, and keeps statuses for the others. */
+            reaping = 1;
+            sp_unlock();
+            while (waitid(P_ALL, 0, &info, WEXITED | WNOWAIT) == -1 && errno == EINTR) ;
+            sp_lock();
+            reaping = 0;
+            pthread_cond_broadcast(&sp_cond);
+        } else if (nserver == 0){
+            pthread_cond_wait(&sp_cond, &sp_mutex);
+            continue;
+        } else {
+            /* both kinds: poll for either */
+            if (waitid(P_ALL, 0, &info, WEXITED | WNOWAIT | WNOHANG) == -1)
+                info.si_pid = 0;
+            if (info.si_pid == 0){
+                sp_unlock();
+                ts.tv_sec = 0;
+                ts.tv_nsec = delay;
+                nanosleep(&ts, NULL);
+                if (delay < 50000000) delay *= 2;
+                sp_lock();
+                continue;
+            }
+        }
+        if (info.si_pid <= 0) continue;
+        pid = waitpid(info.si_pid, stat, WNOHANG);
+        if (pid <= 0) continue;     /* someone else got there first */
+        if (pid == fs_pid){
+            /* the fork server died; fs_read will notice */
+            fs_pid = 0;
+            continue;
+        }
+        c = findchild(pid);
+        if (!c || c->owner == owner){
+            if (c) delchild(c);
+            break;
+        }
+        /* keep it for its owner */
+        c->exited = 1;
+        c->stat = *stat;
+        if (!c->owner) forgetchild(c);
+        pthread_cond_broadcast(&sp_cond);
+    }
+done:
+    sp_unlock();
+    return pid;
+}
 
-    /* handle stdin/stdout/stderr */
+/* forkserver_start() */
+static int forkserver_start(lua_State *L)
+{
+    int sv[2], en, i;
+    pid_t pid;
+    sp_lock();
+    if (fs_wake[0] == -1){
+        if (pipe_cloexec(fs_wake) == -1) goto failure;
+        for (i=0; i<2; ++i)
+            fcntl(fs_wake[i], F_SETFL, O_NONBLOCK);
+    }
+    if (fs_sock == -1){
+        if (socketpair_cloexec(SOCK_STREAM, sv) == -1) goto failure;
+        pid = fork();
+        if (pid == -1){
+            en = errno;
+            closefds(sv, 2);
+            errno = en;
+            goto failure;
+        } else if (pid == 0){
+            close(sv[0]);
+            fs_main(sv[1]);
+        }
+        close(sv[1]);
+        fs_sock = sv[0];
+        fs_pid = pid;
+    }
+    sp_unlock();
+    lua_pushboolean(L, 1);
+    return 1;
+failure:
+    en = errno;
+    sp_unlock();
+    lua_pushnil(L);
+    lua_pushstring(L, strerror(en));
+    lua_pushinteger(L, en);
+    return 3;
+}
+#elif defined(OS_WINDOWS)
+/* forkserver_start() */
+static int forkserver_start(lua_State *L)
+{
+    /* CreateProcess doesn't copy the parent, so there is nothing to gain */
+    lua_pushnil(L);
+    lua_pushliteral(L, "fork server not supported on this platform");
+    return 2;
+}
+#endif
+
+#if defined(OS_POSIX)
+/* Files that many children are given are kept open, so that starting
+   another one doesn't open the same path again: the null device, files
+   opened with append=true and cwd directories. Only absolute paths are
+   kept. An entry is dropped once its file has no links left, which fstat
+   tells without looking the path up; a file renamed away (a rotated log)
+   is kept until clear_cache. Each child gets a dup, made with sp_mutex
+   held, so entries can be dropped at any time; nothing is opened with it
+   held, as opening a FIFO can block. */
+#define FILECACHE_SIZE 16
+
+static struct {
+    char *path;     /* malloc'd, or NULL if the entry is free */
+    int dir;        /* 1 for a directory */
+    int fd;
+} filecache[FILECACHE_SIZE];
+static int filecache_next;      /* entry to drop when all are taken */
+static int devnull_fd = -1;
+
+/* Find path in the file cache. Returns its index, or -1. Called with
+   sp_mutex held. */
+static int findcached(const char *path, int dir)
+{
+    int i;
+    for (i=0; i<FILECACHE_SIZE; ++i)
+        if (filecache[i].path && filecache[i].dir == dir && strcmp(filecache[i].path, path) == 0)
+            return i;
+    return -1;
+}
+
+/* Drop entry i of the file cache. Called with sp_mutex held. */
+static void dropcached(int i)
+{
+    free(filecache[i].path);
+    close(filecache[i].fd);
+    filecache[i].path = NULL;
+}
+
+/* Find path in the file cache, dropping it if its file has been removed.
+   Returns its index, or -1. Called with sp_mutex held. */
+static int findlive(const char *path, int dir)
+{
+    struct stat st;
+    int i = findcached(path, dir);
+    if (i != -1 && (fstat(filecache[i].fd, &st) == -1 || st.st_nlink == 0)){
+        dropcached(i);
+        i = -1;
+    }
+    return i;
+}
+
+/* Return 1 if path is in the file cache as a directory */
+static int cwdcached(const char *path)
+{
+    int i;
+    if (path[0] != '/') return 0;
+    sp_lock();
+    i = findlive(path, 1);
+    sp_unlock();
+    return i != -1;
+}
+
+/* Return a new close-on-exec fd for path, opened for appending, or as a
+   directory if dir is set, from the file cache if it is there. Returns -1
+   with errno set on failure. */
+static int cachedfd(const char *path, int dir)
+{
+    char *copy;
+    int i, fd = -1, en;
+
+    if (path[0] != '/') goto open;  /* depends on our cwd, which may change */
+    sp_lock();
+    if ((i = findlive(path, dir)) != -1)
+        fd = fcntl(filecache[i].fd, F_DUPFD_CLOEXEC, 0);
+    sp_unlock();
+    if (fd != -1) return fd;
+open:
+#ifdef O_PATH
+    /* only needs to be searchable, as for chdir */
+    fd = open(path, dir ? O_PATH | O_DIRECTORY | O_CLOEXEC : O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+#else
+    fd = open(path, dir ? O_RDONLY | O_DIRECTORY | O_CLOEXEC : O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+#endif
+    if (path[0] != '/') return fd;
+    en = errno;
+    copy = fd == -1 ? NULL : malloc(strlen(path) + 1);
+    sp_lock();
+    /* another thread may have opened it meanwhile */
+    if ((i = findcached(path, dir)) != -1) dropcached(i);
+    if (copy){
+        for (i=0; i<FILECACHE_SIZE && filecache[i].path; ++i) ;
+        if (i == FILECACHE_SIZE){
+            i = filecache_next;
+            filecache_next = (i + 1) % FILECACHE_SIZE;
+            dropcached(i);
+        }
+        if ((filecache[i].fd = fcntl(fd, F_DUPFD_CLOEXEC, 0)) == -1) free(copy);
+        else {
+            filecache[i].path = strcpy(copy, path);
+            filecache[i].dir = dir;
+        }
+    }
+    sp_unlock();
+    errno = en;
+    return fd;
+}
+
+/* Return a new close-on-exec fd for the null device, or -1 with errno
+   set */
+static int devnullfd(void)
+{
+    int fd = -1, en;
+    sp_lock();
+    if (devnull_fd != -1) fd = fcntl(devnull_fd, F_DUPFD_CLOEXEC, 0);
+    sp_unlock();
+    if (fd != -1) return fd;
+    if ((fd = open(DEVNULL_NAME, O_RDWR | O_CLOEXEC)) == -1) return -1;
+    en = errno;
+    sp_lock();
+    if (devnull_fd == -1) devnull_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    sp_unlock();
+    errno = en;
+    return fd;
+}
+#endif
+
+/* clear_cache() */
+static int clear_cache(lua_State *L)
+{
+#if defined(OS_POSIX)
+    int i;
+    sp_lock();
+    for (i=0; i<FILECACHE_SIZE; ++i)
+        if (filecache[i].path) dropcached(i);
+    sp_unlock();
+#endif
+    (void) L;
+    return 0;
+}
+
+struct spawnopts;
+
+/* Function for opening subprocesses. Returns 0 on success and -1 on failure.
+   On failure, errmsg_out shall contain a '\0'-terminated error message. */
+static int dopopen(const char *const *args,  /* program arguments with NULL sentinel */
+                   const char *executable,   /* actual executable */
+                   struct fdinfo fdinfo[3],  /* info for stdin/stdout/stderr */
+                   int close_fds,            /* 1 to close all fds */
+                   int binary,               /* 1 to use binary files */
+                   const char *cwd,          /* working directory for program */
+                   const void *owner,        /* Lua state that owns the child */
+                   struct proc *proc,        /* populated on success! */
+                   FILE *pipe_ends_out[3],   /* pipe ends are put here */
+                   int *sock_out,            /* our end of the socket (or -1) */
+                   const int (*pass)[2],     /* other fds for the child: {fd, number} */
+                   int npass,                /* how many */
+                   const struct spawnopts *opts, /* other settings (POSIX only) */
+                   char errmsg_out[],        /* written to on failure */
+                   size_t errmsg_len         /* length of errmsg_out (EXCLUDING sentinel) */
+                  )
+#if defined(OS_POSIX)
+{
+    struct spawnreq req;
+    int *fds = req.fds;
+    int i;
+    struct fdinfo *fdi;
+    int piperw[2];
+    int sockpair[2] = {-1, -1};
+    pid_t pid;
+
+    errmsg_out[errmsg_len] = '\0';
+
+    for (i=0; i<3; ++i)
+        pipe_ends_out[i] = NULL;
+    *sock_out = -1;
+
+    /* Manage stdin/stdout/stderr */
     for (i=0; i<3; ++i){
-        lua_getfield(L, 1, fd_names[i]);
-        if (lua_isnil(L, -1)){
-            fdinfo[i].mode = FDMODE_INHERIT;
-            lua_pop(L, 1);
-        } else if (lua_touserdata(L, -1) == &PIPE){
-            fdinfo[i].mode = FDMODE_PIPE;
-            lua_pop(L, 1);
-        } else if (lua_touserdata(L, -1) == &STDOUT){
-            if (i == STDERR_FILENO /*&& fdinfo[STDOUT_FILENO].mode == FDMODE_PIPE*/){
-                fdinfo[i].mode = FDMODE_STDOUT;
-            } else {
-                lua_pushliteral(L, "STDOUT must be used only for stderr"/* when stdout is set to PIPE"*/);
-files_failure:
-                /*for (j=0; j<i; ++j){
-                    if (fdinfo[j].mode == FDMODE_FILENAME)
-                        free(fdinfo[j].info.filename);
+        fdi = &fdinfo[i];
+        switch (fdi->mode){
+            case FDMODE_INHERIT:
+inherit:
+                fds[i] = dup_cloexec(i);
+                if (fds[i] == -1){
+fd_failure:
+                    snprintf(errmsg_out, errmsg_len + 1, "%s", strerror(errno));
+                    closefds(fds, i);
+                    closefiles(pipe_ends_out, i);
+                    closefds(sockpair, sockpair[0] == -1 ? 0 : 2);
+                    return -1;
                 }
-                free(executable);
-                freestrings(args, nargs);
-                free(args);*/
-                return lua_error(L);
-            }
-            lua_pop(L, 1);
-        } else if (lua_isstring(L, -1)){
-            /* open a file */
-            fdinfo[i].mode = FDMODE_FILENAME;
-            /*if ((fdinfo[i].info.filename = strdup(lua_tostring(L, -1))) == NULL){
-                lua_pushliteral(L, "out of memory");
-                goto files_failure;
-            } */
-            fdinfo[i].info.filename = lua_tostring(L, -1);
-            /* do not pop */
-        } else if (lua_isnumber(L, -1)){
-            /* use this fd */
-            fdinfo[i].mode = FDMODE_FILEDES;
-            fdinfo[i].info.filedes = (filedes_t) lua_tointeger(L, -1);
-            lua_pop(L, 1);
-        } else {
-            f = liolib_copy_tofile(L, -1);
-            if (f){
-                fdinfo[i].mode = FDMODE_FILEOBJ;
-                fdinfo[i].info.fileobj = f;
-            } else {
-                /* huh? */
-                lua_pushfstring(L, "unexpected value for %s", fd_names[i]);
-                goto files_failure;
+                break;
+            case FDMODE_FILENAME:
+                if (i == STDIN_FILENO){
+                    if ((fds[i] = open(fdi->info.filename, O_RDONLY | O_CLOEXEC)) == -1) goto fd_failure;
+                } else {
+                    if ((fds[i] = open(fdi->info.filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666)) == -1)
+                        goto fd_failure;
+                }
+                break;
+            case FDMODE_APPEND:
+                if ((fds[i] = cachedfd(fdi->info.filename, 0)) == -1) goto fd_failure;
+                break;
+            case FDMODE_DEVNULL:
+                if ((fds[i] = devnullfd()) == -1) goto fd_failure;
+                break;
+            case FDMODE_FILEDES:
+                if ((fds[i] = dup_cloexec(fdi->info.filedes)) == -1) goto fd_failure;
+                break;
+            case FDMODE_FILEOBJ:
+                if ((fds[i] = dup_cloexec(fileno(fdi->info.fileobj))) == -1) goto fd_failure;
+                break;
+            case FDMODE_PIPE:
+                /* our end must not be inherited by children, or they
+                   would keep the pipe open */
+                if (pipe_cloexec(piperw) == -1) goto fd_failure;
+                if (i == STDIN_FILENO){
+                    fds[i] = piperw[0]; /* give read end to process */
+                    if ((pipe_ends_out[i] = fdopen(piperw[1], "w")) == NULL) goto fd_failure;
+                } else {
+                    fds[i] = piperw[1]; /* give write end to process */
+                    if ((pipe_ends_out[i] = fdopen(piperw[0], "r")) == NULL) goto fd_failure;
+                }
+                break;
+            case FDMODE_STDOUT:
+                if (i == STDERR_FILENO){
+                    if ((fds[STDERR_FILENO] = dup_cloexec(fds[STDOUT_FILENO])) == -1) goto fd_failure;
+                } else goto inherit;
+                break;
+            case FDMODE_SOCKET:
+                if (sockpair[0] == -1){
+                    if (socketpair_cloexec(fdi->info.socktype, sockpair) == -1){
+                        sockpair[0] = -1;
+                        goto fd_failure;
+                    }
+                }
+                if ((fds[i] = dup_cloexec(sockpair[1])) == -1) goto fd_failure;
+                break;
+        }
+        /* every one of them is close-on-exec: the child gets its own copy
+           with dup2 */
+    }
+    
+    /* Find executable name */
+    if (!executable){
+        /* use first arg */
+        executable = args[0];
+    }
+    assert(executable != NULL);
+
+    req.args = args;
+    req.executable = executable;
+    req.cwd = cwd;
+    /* if it can't be opened, the child's chdir reports why */
+    req.cwdfd = cwd ? cachedfd(cwd, 1) : -1;
+    req.close_fds = close_fds;
+    req.opts = *opts;
+    req.npass = npass;
+    for (i=0; i<npass; ++i){
+        req.pass[i][0] = pass[i][0];
+        req.pass[i][1] = pass[i][1];
+    }
+    sp_lock();
+    if (fs_sock != -1){
+        pid = fs_spawn(&req, owner);
+        sp_unlock();
+    } else {
+        sp_unlock();
+        pid = spawnchild(&req, owner);
+    }
+
+    /* close unneeded fds */
+    i = errno;
+    closefds(fds, 3);
+    if (req.cwdfd != -1) close(req.cwdfd);
+    if (sockpair[1] != -1) close(sockpair[1]);
+    if (pid == -1){
+        snprintf(errmsg_out, errmsg_len + 1, "%s", strerror(i));
+        closefiles(pipe_ends_out, 3);
+        if (sockpair[0] != -1) close(sockpair[0]);
+        return -1;
+    }
+
+    /* Child is now running */
+    proc->done = 0;
+    proc->pid = pid;
+    proc->pgroup = opts->pgroup != 0;
+    *sock_out = sockpair[0];
+    return 0;
+}
+#elif defined(OS_WINDOWS)
+{
+    HANDLE hfiles[3], piper, pipew, hfile;
+    int i, fd;
+    struct fdinfo *fdi;
+    SECURITY_ATTRIBUTES secattr;
+    STARTUPINFO si;
+    PROCESS_INFORMATION pi;
+    char *cmdline;
+
+    errmsg_out[errmsg_len] = '\0';
+    /* no sockets or other fds to pass on Windows; superpopen rejects them */
+    *sock_out = -1;
+    (void) pass;
+    (void) npass;
+    (void) opts;
+
+    /* Create a SECURITY_ATTRIBUTES for inheritable handles */
+    secattr.nLength = sizeof secattr;
+    secattr.lpSecurityDescriptor = NULL;
+    secattr.bInheritHandle = TRUE;
+
+    for (i=0; i<3; ++i)
+        pipe_ends_out[i] = NULL;
+
+    /* Manage stdin/stdout/stderr */
+    for (i=0; i<3; ++i){
+        fdi = &fdinfo[i];
+        switch (fdi->mode){
+            case FDMODE_INHERIT:
+inherit:
+                /* XXX: duplicated file handles share the
+                   same object (and thus file cursor, etc.).
+                   CreateFile might be a better idea. */
+                hfile = getstdhandle(i);
+                if (hfile == INVALID_HANDLE_VALUE){
+fd_failure:
+                    copy_w32error(errmsg_out, errmsg_len, GetLastError());
+                    closefds(hfiles, i);
+                    closefiles(pipe_ends_out, i);
+                    return -1;
+                }
+dup_hfile:
+                if (DuplicateHandle(GetCurrentProcess(), hfile,
+                    GetCurrentProcess(), &hfiles[i], 0, TRUE,
+                    DUPLICATE_SAME_ACCESS) == 0)
+                {
+                    goto fd_failure;
+                }
+                break;
+            case FDMODE_FILENAME:
+                if (i == STDIN_FILENO){
+                    hfiles[i] = CreateFile(
+                        fdi->info.filename,
+                        GENERIC_READ,
+                        FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                        &secattr,
+                        OPEN_EXISTING,
+                        FILE_ATTRIBUTE_NORMAL,
+                        NULL);
+                } else {
+                    hfiles[i] = CreateFile(
+                        fdi->info.filename,
+                        GENERIC_WRITE,
+                        FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                        &secattr,
+                        CREATE_ALWAYS,
+                        FILE_ATTRIBUTE_NORMAL,
+                        NULL);
+                }
+                if (hfiles[i] == INVALID_HANDLE_VALUE){
+                    goto fd_failure;
+                }
+                break;
+            case FDMODE_APPEND:
+                /* no handle cache here; Windows has no fork to share it with */
+                hfiles[i] = CreateFile(
+                    fdi->info.filename,
+                    FILE_APPEND_DATA,
+                    FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                    &secattr,
+                    OPEN_ALWAYS,
+                    FILE_ATTRIBUTE_NORMAL,
+                    NULL);
+                if (hfiles[i] == INVALID_HANDLE_VALUE) goto fd_failure;
+                break;
+            case FDMODE_DEVNULL:
+                hfiles[i] = CreateFile(
+                    DEVNULL_NAME,
+                    GENERIC_READ | GENERIC_WRITE,
+                    FILE_SHARE_READ | FILE_SHARE_WRITE,
+                    &secattr,
+                    OPEN_EXISTING,
+                    FILE_ATTRIBUTE_NORMAL,
+                    NULL);
+                if (hfiles[i] == INVALID_HANDLE_VALUE) goto fd_failure;
+                break;
+            case FDMODE_FILEDES:
+                if (DuplicateHandle(GetCurrentProcess(), fdi->info.filedes,
+                    GetCurrentProcess(), &hfiles[i], 0, TRUE,
+                    DUPLICATE_SAME_ACCESS) == 0)
+                {
+                    goto fd_failure;
+                }
+                break;
+            case FDMODE_FILEOBJ:
+                fd = _fileno(fdi->info.fileobj);
+                if (fd == -1){
+get_osf_failure:
+                    strncpy(errmsg_out, strerror(errno), errmsg_len + 1);
+failure:
+                    closefds(hfiles, i);
+                    closefiles(pipe_ends_out, i);
+                    return -1;
+                }
+                hfile = (HANDLE) _get_osfhandle(fd);
+                if (hfile == INVALID_HANDLE_VALUE) goto get_osf_failure;
+                goto dup_hfile;
+            case FDMODE_PIPE:
+                if (CreatePipe(&piper, &pipew, &secattr, 0) == 0)
+                    goto fd_failure;
+                if (i == STDIN_FILENO){
+                    hfiles[i] = piper;
+                    fd = _open_osfhandle((long) pipew, binary ? 0 : _O_TEXT);
+                    if (fd == -1){
+                        strncpy(errmsg_out, "_open_osfhandle failed", errmsg_len + 1);
+                        goto failure;
+                    }
+                    pipe_ends_out[i] = _fdopen(fd, "w");
+                    if (pipe_ends_out[i] == 0){
+                        strncpy(errmsg_out, "_fdopen failed", errmsg_len + 1);
+                        goto failure;
+                    }
+                } else {
+                    hfiles[i] = pipew;
+                    fd = _open_osfhandle((long) piper, _O_RDONLY | (binary ? 0 : _O_TEXT));
+                    if (fd == -1){
+                        strncpy(errmsg_out, "_open_osfhandle failed", errmsg_len + 1);
+                        goto failure;
+                    }
+                    pipe_ends_out[i] = _fdopen(fd, "r");
+                    if (pipe_ends_out[i] == 0){
+                        strncpy(errmsg_out, "_fdopen failed", errmsg_len + 1);
+                        goto failure;
+                    }
+                }
+                break;
+            case FDMODE_STDOUT:
+                if (i == STDERR_FILENO){
+                    hfile = hfiles[STDOUT_FILENO];
+                    goto dup_hfile;
+                } else goto inherit;
+        }
+    }
+
+    /* Find executable name */
+    if (executable == NULL){
+        /* use first arg */
+        /*executable = args[0];*/
+    }
+
+    /* Compile command line into string. Yuck. */
+    cmdline = compile_cmdline(args);
+    if (!cmdline){
+        strncpy(errmsg_out, "memory full", errmsg_len + 1);
+        closefds(hfiles, 3);
+        closefiles(pipe_ends_out, 3);
+        return -1;
+    }
+    
+
+    si.cb = sizeof si;
+    si.lpReserved = NULL;
+    si.lpDesktop = NULL;
+    si.lpTitle = NULL;
+    si.dwFlags = STARTF_USESTDHANDLES;
+    si.cbReserved2 = 0;
+    si.lpReserved2 = NULL;
+    si.hStdInput = hfiles[0];
+    si.hStdOutput = hfiles[1];
+    si.hStdError = hfiles[2];
+
+    if (CreateProcess(
+        executable, /* lpApplicationName */
+        cmdline,    /* lpCommandLine */
+        NULL,       /* lpProcessAttributes */
+        NULL,       /* lpThreadAttributes */
+        TRUE,       /* bInheritHandles */
+        0,          /* dwCreationFlags */
+        NULL,       /* lpEnvironment */
+        cwd,        /* lpCurrentDirectory */
+        &si,        /* lpStartupInfo */
+        &pi)        /* lpProcessInformation */
+    == 0){
+        copy_w32error(errmsg_out, errmsg_len, GetLastError());
+        free(cmdline);
+        closefds(hfiles, 3);
+        closefiles(pipe_ends_out, 3);
+        return -1;
+    }
+    CloseHandle(pi.hThread); /* Don't want this handle */
+    free(cmdline);
+    closefds(hfiles, 3); /* XXX: is this correct? */
+    proc->done = 0;
+    proc->pid = pi.dwProcessId;
+    proc->hProcess = pi.hProcess;
+    return 0;
+}
+#endif
+
+/* Characters that mean something to the shell when they are not quoted */
+#define SHELL_SPECIAL "|&;<>()$`*?[\n"
+
+/* Words that mean something to the shell at the start of a command */
+static const char *const shell_words[] = {
+    "!", "{", "}", "case", "do", "done", "elif", "else", "esac",
+    "fi", "for", "if", "in", "then", "until", "while", NULL
+};
+
+static int needshell(lua_State *L, const char *found)
+{
+    return luaL_error(L, "command needs a shell (found `%s'); use shell=true", found);
+}
+
+static int needshell_char(lua_State *L, char ch)
+{
+    char found[2];
+    found[0] = ch;
+    found[1] = '\0';
+    return needshell(L, found);
+}
+
+/* Split the command string s into words using the quoting rules of the
+   POSIX shell, and put them in the table at index t.
+   No expansions are done, so an error is raised if the command uses
+   anything other than plain words and quotes. */
+static void split_command(lua_State *L, const char *s, int t)
+{
+    luaL_Buffer b;
+    const char *start, *p;
+    int nwords = 0;
+    int quoted; /* part of the word was quoted */
+    char ch;
+
+    for (;;){
+        while (*s == ' ' || *s == '\t') ++s;
+        if (!*s) break;
+        luaL_buffinit(L, &b);
+        start = s;
+        quoted = 0;
+        while (*s && *s != ' ' && *s != '\t'){
+            ch = *s++;
+            if (ch == '\''){
+                quoted = 1;
+                while (*s != '\''){
+                    if (!*s) luaL_error(L, "unterminated quote in command");
+                    luaL_addchar(&b, *s++);
+                }
+                ++s;
+            } else if (ch == '"'){
+                quoted = 1;
+                while (*s != '"'){
+                    if (!*s) luaL_error(L, "unterminated quote in command");
+                    if (*s == '$' || *s == '`') needshell_char(L, *s);
+                    if (*s == '\\' && s[1] && strchr("$`\"\\\n", s[1])){
+                        if (*++s == '\n'){
+                            ++s;
+                            continue;
+                        }
+                    }
+                    luaL_addchar(&b, *s++);
+                }
+                ++s;
+            } else if (ch == '\\'){
+                if (*s == '\n'){
+                    /* line continuation */
+                    ++s;
+                    continue;
+                }
+                quoted = 1;
+                luaL_addchar(&b, *s ? *s++ : '\\');
+            } else if (strchr(SHELL_SPECIAL, ch)
+                || ((ch == '~' || ch == '#') && s - 1 == start))
+            {
+                needshell_char(L, ch);
+            } else if (ch == '=' && nwords == 0 && !quoted && s - 1 != start){
+                /* NAME=value at the start is a variable assignment */
+                for (p = start; p < s - 1 && (*p == '_' || isalnum((unsigned char) *p)); ++p) ;
+                if (p == s - 1 && !isdigit((unsigned char) *start))
+                    needshell_char(L, ch);
+                luaL_addchar(&b, ch);
+            } else {
+                luaL_addchar(&b, ch);
+            }
+        }
+        luaL_pushresult(&b);
+        if (!quoted && lua_objlen(L, -1) == 0){
+            lua_pop(L, 1);
+            continue;
+        }
+        if (nwords == 0 && !quoted){
+            int i;
+            for (i=0; shell_words[i]; ++i)
+                if (!strcmp(lua_tostring(L, -1), shell_words[i]))
+                    needshell(L, shell_words[i]);
+        }
+        lua_rawseti(L, t, ++nwords);
+    }
+}
+
+/* Put the arguments of popen in their table form at index 1:
+   popen accepts either {arg1, arg2, ..., [options...]} or a command
+   string followed by an optional table of options. A command string is
+   split into words by split_command. With shell=true, the command is run
+   by the shell instead.
+   If copy is set, a new table is always made, so that the caller's table
+   is not modified. */
+static void checkargs(lua_State *L, int copy)
+{
+    int i, n, shell;
+    const char *cmd = NULL;
+
+    if (lua_type(L, 1) == LUA_TSTRING){
+        cmd = lua_tostring(L, 1);
+        if (!lua_isnoneornil(L, 2)) luaL_checktype(L, 2, LUA_TTABLE);
+        lua_settop(L, 2);
+        copy = 1;
+    } else {
+        luaL_checktype(L, 1, LUA_TTABLE);
+        lua_settop(L, 1);
+        lua_pushvalue(L, 1);
+    }
+    /* stack: cmd/args options */
+    shell = 0;
+    if (lua_istable(L, 2)){
+        lua_getfield(L, 2, "shell");
+        shell = lua_toboolean(L, -1);
+        lua_pop(L, 1);
+    }
+    if (!shell && !copy){
+        lua_settop(L, 1);
+        return;
+    }
+
+    n = cmd ? 0 : lua_objlen(L, 1);
+    lua_createtable(L, n + 2, 8);   /* stack: cmd/args options newargs */
+    if (lua_istable(L, 2)){
+        /* copy options */
+        lua_pushnil(L);
+        while (lua_next(L, 2)){
+            if (lua_type(L, -2) != LUA_TSTRING || !strcmp(lua_tostring(L, -2), "shell")){
+                lua_pop(L, 1);
+            } else {
+                lua_pushvalue(L, -2);
+                lua_insert(L, -2);
+                lua_rawset(L, 3);
+            }
+        }
+    }
+    i = 0;
+    if (shell){
+#if defined(OS_POSIX)
+        lua_pushliteral(L, "/bin/sh");
+        lua_rawseti(L, 3, ++i);
+        lua_pushliteral(L, "-c");
+        lua_rawseti(L, 3, ++i);
+#elif defined(OS_WINDOWS)
+        lua_pushstring(L, getenv("COMSPEC") ? getenv("COMSPEC") : "cmd.exe");
+        lua_rawseti(L, 3, ++i);
+        lua_pushliteral(L, "/c");
+        lua_rawseti(L, 3, ++i);
+#endif
+        if (cmd){
+            lua_pushvalue(L, 1);
+            lua_rawseti(L, 3, ++i);
+        }
+    } else if (cmd){
+        split_command(L, cmd, 3);
+    }
+    for (n=1; !cmd && n<=(int) lua_objlen(L, 1); ++n){
+        lua_rawgeti(L, 1, n);
+        lua_rawseti(L, 3, i + n);
+    }
+    lua_replace(L, 1);
+    lua_settop(L, 1);
+}
+
+/* Sinks: stdout or stderr consumed in C */
+
+/* Lua registry key for sink metatable */
+#define SP_SINK_META "subprocess_sink*"
+
+enum {
+    SINK_DISCARD,
+    SINK_COUNT,
+    SINK_HASH
+};
+
+#if defined(OS_POSIX)
+enum {
+    HASH_CRC32,
+    HASH_FNV64
+};
+
+static const char *const hash_names[] = {"crc32", "fnv64", NULL};
+
+/* A sink that reads a pipe in a thread of its own. The state is shared
+   with the thread, so whichever of the thread and the sink object
+   finishes last frees it (under sp_mutex). */
+struct sinkstate {
+    int kind;
+    int hash;
+    int fd;             /* the pipe, while the thread runs */
+    int started;        /* a thread was started for it */
+    int done;           /* the thread has finished */
+    int orphaned;       /* the sink object has been collected */
+    int err;            /* error number, if reading failed */
+    uint64_t bytes;
+    uint64_t lines;
+    uint64_t sum;       /* hash so far */
+};
+#else
+struct sinkstate {
+    int kind;
+};
+#endif
+
+/* The sink object, which is stored as Lua userdata */
+struct sink {
+    struct sinkstate *state;
+};
+
+/* Check to see if the object at index is a sink. Returns its state, or
+   NULL if it isn't. */
+static struct sinkstate *tosink(lua_State *L, int index)
+{
+    int eq;
+    if (lua_type(L, index) != LUA_TUSERDATA) return NULL;
+    lua_getmetatable(L, index);
+    luaL_getmetatable(L, SP_SINK_META);
+    eq = lua_equal(L, -2, -1);
+    lua_pop(L, 2);
+    if (!eq) return NULL;
+    return ((struct sink *) lua_touserdata(L, index))->state;
+}
+
+/* Push a new sink of kind */
+static struct sinkstate *newsink(lua_State *L, int kind)
+{
+    struct sink *sink = lua_newuserdata(L, sizeof *sink);
+    sink->state = NULL;
+    luaL_getmetatable(L, SP_SINK_META);
+    lua_setmetatable(L, -2);
+    if ((sink->state = malloc(sizeof *sink->state)) == NULL)
+        luaL_error(L, "memory full");
+    memset(sink->state, 0, sizeof *sink->state);
+    sink->state->kind = kind;
+    return sink->state;
+}
+
+#if defined(OS_POSIX)
+/* CRC-32 (as zlib's), eight bytes at a time */
+static uint32_t crc_table[8][256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void crc_init(void)
+{
+    uint32_t c;
+    int i, j;
+    for (i=0; i<256; ++i){
+        c = i;
+        for (j=0; j<8; ++j)
+            c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+        crc_table[0][i] = c;
+    }
+    for (i=0; i<256; ++i){
+        c = crc_table[0][i];
+        for (j=1; j<8; ++j){
+            c = crc_table[0][c & 0xff] ^ (c >> 8);
+            crc_table[j][i] = c;
+        }
+    }
+}
+
+static uint32_t crc32_update(uint32_t crc, const unsigned char *p, size_t n)
+{
+    uint32_t a, b;
+    crc = ~crc;
+    for (; n >= 8; p += 8, n -= 8){
+        a = crc ^ (p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24);
+        b = p[4] | p[5] << 8 | p[6] << 16 | (uint32_t) p[7] << 24;
+        crc = crc_table[7][a & 0xff] ^ crc_table[6][(a >> 8) & 0xff]
+            ^ crc_table[5][(a >> 16) & 0xff] ^ crc_table[4][a >> 24]
+            ^ crc_table[3][b & 0xff] ^ crc_table[2][(b >> 8) & 0xff]
+            ^ crc_table[1][(b >> 16) & 0xff] ^ crc_table[0][b >> 24];
+    }
+    for (; n > 0; --n)
+        crc = crc_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+/* FNV-1a, 64 bit */
+#define FNV64_BASIS 0xcbf29ce484222325ULL
+#define FNV64_PRIME 0x100000001b3ULL
+
+static uint64_t fnv64_update(uint64_t h, const unsigned char *p, size_t n)
+{
+    for (; n > 0; --n){
+        h ^= *p++;
+        h *= FNV64_PRIME;
+    }
+    return h;
+}
+
+/* Size of the buffer a sink thread reads into */
+#define SINK_CHUNK 65536
+
+/* The thread that reads a sink's pipe until end of file */
+static void *sink_main(void *arg)
+{
+    struct sinkstate *s = arg;
+    unsigned char buf[SINK_CHUNK];
+    const unsigned char *p, *end;
+    ssize_t n;
+    int orphaned;
+
+    for (;;){
+        n = read(s->fd, buf, sizeof buf);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0){
+            if (n == -1) s->err = errno;
+            break;
+        }
+        s->bytes += n;
+        if (s->kind == SINK_COUNT){
+            end = buf + n;
+            for (p = buf; (p = memchr(p, '\n', end - p)) != NULL; ++p)
+                ++s->lines;
+        } else if (s->hash == HASH_CRC32){
+            s->sum = crc32_update((uint32_t) s->sum, buf, n);
+        } else {
+            s->sum = fnv64_update(s->sum, buf, n);
+        }
+    }
+    close(s->fd);
+    s->fd = -1;
+    sp_lock();
+    s->done = 1;
+    orphaned = s->orphaned;
+    pthread_cond_broadcast(&sp_cond);
+    sp_unlock();
+    if (orphaned) free(s);
+    return NULL;
+}
+
+#if defined(__linux__) && defined(RTLD_NODELETE)
+static pthread_once_t pin_once = PTHREAD_ONCE_INIT;
+
+/* Keep this library loaded until the process exits: closing the Lua state
+   unloads it, and sink threads may still be running its code */
+static void pin_module(void)
+{
+    Dl_info info;
+    if (dladdr(&pin_once, &info) && info.dli_fname)
+        dlopen(info.dli_fname, RTLD_NOW | RTLD_NOLOAD | RTLD_NODELETE);
+}
+#endif
+
+/* Start reading the pipe fp (which the sink takes over) in a thread */
+static void sink_start(struct sinkstate *s, FILE *fp)
+{
+    pthread_attr_t attr;
+    pthread_t thread;
+    sigset_t all, old;
+    int r;
+
+#if defined(__linux__) && defined(RTLD_NODELETE)
+    pthread_once(&pin_once, pin_module);
+#endif
+
+    s->fd = fcntl(fileno(fp), F_DUPFD_CLOEXEC, 0);
+    fclose(fp);
+    s->started = 1;
+    if (s->fd == -1){
+        s->err = errno;
+        s->done = 1;
+        return;
+    }
+    /* signals are for the thread running Lua */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    r = pthread_create(&thread, &attr, sink_main, s);
+    pthread_attr_destroy(&attr);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (r != 0){
+        close(s->fd);
+        s->fd = -1;
+        s->err = r;
+        s->done = 1;
+    }
+}
+
+/* sink.count() */
+static int sink_count(lua_State *L)
+{
+    newsink(L, SINK_COUNT);
+    return 1;
+}
+
+/* sink.hash(name) */
+static int sink_hash(lua_State *L)
+{
+    int hash = luaL_checkoption(L, 1, NULL, hash_names);
+    struct sinkstate *s = newsink(L, SINK_HASH);
+    s->hash = hash;
+    s->sum = hash == HASH_CRC32 ? 0 : FNV64_BASIS;
+    if (hash == HASH_CRC32) pthread_once(&crc_once, crc_init);
+    return 1;
+}
+#endif
+
+/* sink.discard() */
+static int sink_discard_new(lua_State *L)
+{
+    newsink(L, SINK_DISCARD);
+    return 1;
+}
+
+/* sink:result() */
+static int sink_result(lua_State *L)
+{
+    struct sinkstate *s = tosink(L, 1);
+#if defined(OS_POSIX)
+    char digest[17];
+#endif
+    luaL_argcheck(L, s != NULL, 1, "sink expected");
+    if (s->kind == SINK_DISCARD) return 0;
+#if defined(OS_POSIX)
+    /* wait for the end of the stream */
+    sp_lock();
+    while (s->started && !s->done)
+        pthread_cond_wait(&sp_cond, &sp_mutex);
+    sp_unlock();
+    if (s->err){
+        lua_pushnil(L);
+        lua_pushfstring(L, "sink: %s", strerror(s->err));
+        return 2;
+    }
+    if (s->kind == SINK_COUNT){
+        lua_pushnumber(L, (lua_Number) s->bytes);
+        lua_pushnumber(L, (lua_Number) s->lines);
+        return 2;
+    }
+    if (s->hash == HASH_CRC32) sprintf(digest, "%08lx", (unsigned long) s->sum);
+    else sprintf(digest, "%016llx", (unsigned long long) s->sum);
+    lua_pushstring(L, digest);
+    lua_pushnumber(L, (lua_Number) s->bytes);
+    return 2;
+#else
+    return 0;
+#endif
+}
+
+/* __gc */
+static int sink_gc(lua_State *L)
+{
+    struct sink *sink = luaL_checkudata(L, 1, SP_SINK_META);
+    struct sinkstate *s = sink->state;
+    if (!s) return 0;
+    sink->state = NULL;
+#if defined(OS_POSIX)
+    sp_lock();
+    if (s->started && !s->done){
+        /* the thread frees it */
+        s->orphaned = 1;
+        s = NULL;
+    }
+    sp_unlock();
+#endif
+    free(s);
+    return 0;
+}
+
+static const luaL_Reg sink_meta[] = {
+    {"__gc", sink_gc},
+    {NULL, NULL}
+};
+
+static const luaL_Reg sink_methods[] = {
+    {"result", sink_result},
+    {NULL, NULL}
+};
+
+static const luaL_Reg sink_funcs[] = {
+    {"discard", sink_discard_new},
+#if defined(OS_POSIX)
+    {"count", sink_count},
+    {"hash", sink_hash},
+#endif
+    {NULL, NULL}
+};
+
+#if defined(OS_POSIX)
+/* Channels: the parent's end of a socket used for stdin/stdout/stderr */
+
+/* Lua registry key for channel metatable */
+#define SP_CHANNEL_META "subprocess_channel*"
+
+/* The channel object, which is stored as Lua userdata */
+struct channel {
+    int fd;             /* -1 if closed */
+    int type;           /* SOCK_STREAM or SOCK_SEQPACKET */
+};
+
+#define checkchannel(L, index) ((struct channel *) luaL_checkudata((L), (index), SP_CHANNEL_META))
+
+/* Push a new, closed channel */
+static struct channel *newchannel(lua_State *L, int type)
+{
+    struct channel *chan = lua_newuserdata(L, sizeof *chan);
+    chan->fd = -1;
+    chan->type = type;
+    luaL_getmetatable(L, SP_CHANNEL_META);
+    lua_setmetatable(L, -2);
+    return chan;
+}
+
+static struct channel *openchannel(lua_State *L)
+{
+    struct channel *chan = checkchannel(L, 1);
+    if (chan->fd == -1) luaL_error(L, "attempt to use a closed channel");
+    return chan;
+}
+
+/* channel:send(data) */
+static int channel_send(lua_State *L)
+{
+    struct channel *chan = openchannel(L);
+    size_t len, sent = 0;
+    const char *data = luaL_checklstring(L, 2, &len);
+    ssize_t n;
+    int en;
+
+    /* the other end would take it for the end of the channel */
+    luaL_argcheck(L, len > 0 || chan->type != SOCK_SEQPACKET, 2, "empty message");
+    /* a message goes in one send; a stream may need several */
+    do {
+        n = send(chan->fd, data + sent, len - sent, MSG_NOSIGNAL);
+        if (n == -1){
+            if (errno == EINTR) continue;
+            en = errno;
+            lua_pushnil(L);
+            lua_pushstring(L, strerror(en));
+            lua_pushinteger(L, en);
+            return 3;
+        }
+        sent += n;
+    } while (chan->type == SOCK_STREAM && sent < len);
+    lua_pushinteger(L, (lua_Integer) sent);
+    return 1;
+}
+
+/* Return 1 if the other end of socket fd has closed or shut down for
+   writing. An empty message that arrived before then looks the same. */
+static int hungup(int fd)
+{
+    struct pollfd pfd;
+    pfd.fd = fd;
+#ifdef POLLRDHUP
+    pfd.events = POLLRDHUP;
+#else
+    pfd.events = 0;
+#endif
+    while (poll(&pfd, 1, 0) == -1)
+        if (errno != EINTR) return 1;
+    return (pfd.revents & ~POLLIN) != 0;
+}
+
+/* channel:recv([max]) */
+static int channel_recv(lua_State *L)
+{
+    struct channel *chan = openchannel(L);
+    lua_Integer imax = luaL_optinteger(L, 2, 65536);
+    size_t max;
+    char small[4096], *buf;
+    ssize_t n;
+    int en;
+
+    luaL_argcheck(L, imax >= 0, 2, "negative size");
+    max = (size_t) imax;
+    if (chan->type == SOCK_SEQPACKET){
+        /* the length of the next message, which stays queued if it's
+           longer than max */
+        do {
+            n = recv(chan->fd, small, 1, MSG_PEEK | MSG_TRUNC);
+        } while (n == -1 && errno == EINTR);
+        if (n == -1) goto failure;
+        if (!lua_isnoneornil(L, 2) && (size_t) n > max){
+            errno = EMSGSIZE;
+            goto failure;
+        }
+        max = n == 0 ? 1 : (size_t) n;
+    } else if (max == 0){
+        lua_pushliteral(L, "");
+        return 1;
+    }
+    buf = max <= sizeof small ? small : lua_newuserdata(L, max);
+    do {
+        n = recv(chan->fd, buf, max, 0);
+    } while (n == -1 && errno == EINTR);
+    if (n == -1) goto failure;
+    if (n == 0 && (chan->type != SOCK_SEQPACKET || hungup(chan->fd)))
+        return 0;   /* the other end is closed */
+    lua_pushlstring(L, buf, n);
+    return 1;
+failure:
+    en = errno;
+    lua_pushnil(L);
+    lua_pushstring(L, strerror(en));
+    lua_pushinteger(L, en);
+    return 3;
+}
+
+/* channel:shutdown([how]) */
+static int channel_shutdown(lua_State *L)
+{
+    static const char *const names[] = {"r", "w", "rw", NULL};
+    static const int hows[] = {SHUT_RD, SHUT_WR, SHUT_RDWR};
+    struct channel *chan = openchannel(L);
+    int how = luaL_checkoption(L, 2, "w", names);
+    int en;
+    if (shutdown(chan->fd, hows[how]) == 0){
+        lua_pushboolean(L, 1);
+        return 1;
+    }
+    en = errno;
+    lua_pushnil(L);
+    lua_pushstring(L, strerror(en));
+    lua_pushinteger(L, en);
+    return 3;
+}
+
+/* channel:close(), and __gc */
+static int channel_close(lua_State *L)
+{
+    struct channel *chan = checkchannel(L, 1);
+    if (chan->fd != -1){
+        close(chan->fd);
+        chan->fd = -1;
+    }
+    return 0;
+}
+
+static int channel_tostring(lua_State *L)
+{
+    struct channel *chan = checkchannel(L, 1);
+    if (chan->fd == -1) lua_pushliteral(L, "channel (closed)");
+    else lua_pushfstring(L, "channel (%d)", chan->fd);
+    return 1;
+}
+
+static const luaL_Reg channel_meta[] = {
+    {"__gc", channel_close},
+    {"__tostring", channel_tostring},
+    {NULL, NULL}
+};
+
+static const luaL_Reg channel_methods[] = {
+    {"send", channel_send},
+    {"recv", channel_recv},
+    {"shutdown", channel_shutdown},
+    {"close", channel_close},
+    {NULL, NULL}
+};
+#endif
+
+#ifdef HAVE_SHMRING
+/* Shared memory rings (see shmring.h) */
+
+/* Lua registry key for ring metatable */
+#define SP_RING_META "subprocess_shmring*"
+
+/* The ring object, which is stored as Lua userdata. hdr is NULL once it
+   has been closed. */
+struct luaring {
+    struct shmring r;
+};
+
+static struct shmring *toring(lua_State *L, int index)
+{
+    int eq;
+    if (lua_type(L, index) != LUA_TUSERDATA) return NULL;
+    lua_getmetatable(L, index);
+    luaL_getmetatable(L, SP_RING_META);
+    eq = lua_equal(L, -2, -1);
+    lua_pop(L, 2);
+    if (!eq) return NULL;
+    return &((struct luaring *) lua_touserdata(L, index))->r;
+}
+
+static struct shmring *openring(lua_State *L)
+{
+    struct shmring *r = &((struct luaring *) luaL_checkudata(L, 1, SP_RING_META))->r;
+    if (!r->hdr) luaL_error(L, "attempt to use a closed ring");
+    return r;
+}
+
+/* timeout in seconds at index, as milliseconds for shmring.h */
+static int ringtimeout(lua_State *L, int index)
+{
+    lua_Number t = luaL_optnumber(L, index, -1);
+    if (t < 0) return -1;
+    if (t > 2000000) return 2000000000;
+    return (int) (t * 1000);
+}
+
+static int ringfailure(lua_State *L)
+{
+    int en = errno;
+    lua_pushnil(L);
+    lua_pushstring(L, strerror(en));
+    lua_pushinteger(L, en);
+    return 3;
+}
+
+/* subprocess.shmring([size]) */
+static int shmring_new(lua_State *L)
+{
+    lua_Integer want = luaL_optinteger(L, 1, 1 << 20);
+    size_t size = (size_t) sysconf(_SC_PAGESIZE);
+    struct luaring *lr;
+
+    while ((lua_Integer) size < want && size < ((size_t) 1 << 30)) size *= 2;
+    if (want > (lua_Integer) size) return luaL_error(L, "ring size too large");
+    lr = lua_newuserdata(L, sizeof *lr);
+    lr->r.hdr = NULL;
+    lr->r.fd = lr->r.pushfd = lr->r.popfd = -1;
+    luaL_getmetatable(L, SP_RING_META);
+    lua_setmetatable(L, -2);
+    if ((lr->r.fd = syscall(SYS_memfd_create, "subprocess-shmring", MFD_CLOEXEC)) == -1
+            || (lr->r.pushfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) == -1
+            || (lr->r.popfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) == -1
+            || shmring_init(lr->r.fd, size) == -1
+            || shmring_map(&lr->r, lr->r.fd, lr->r.pushfd, lr->r.popfd) == -1)
+        return ringfailure(L);  /* the fds are closed by __gc */
+    return 1;
+}
+
+/* ring:push(data, [timeout]) */
+static int ring_push(lua_State *L)
+{
+    struct shmring *r = openring(L);
+    size_t len;
+    const char *data = luaL_checklstring(L, 2, &len);
+    if (shmring_push(r, data, len, ringtimeout(L, 3)) == -1) return ringfailure(L);
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/* ring:pop([timeout]) */
+static int ring_pop(lua_State *L)
+{
+    struct shmring *r = openring(L);
+    size_t len;
+    const void *p = shmring_peek(r, &len, ringtimeout(L, 2));
+    if (!p){
+        if (errno == 0) return 0;   /* the end */
+        return ringfailure(L);
+    }
+    lua_pushlstring(L, (const char *) p, len);
+    shmring_release(r);
+    return 1;
+}
+
+/* ring:shutdown() */
+static int ring_shutdown(lua_State *L)
+{
+    shmring_shutdown(openring(L));
+    return 0;
+}
+
+/* ring:maxsize() */
+static int ring_maxsize(lua_State *L)
+{
+    lua_pushinteger(L, (lua_Integer) shmring_maxrecord(openring(L)));
+    return 1;
+}
+
+/* ring:close(), and __gc */
+static int ring_close(lua_State *L)
+{
+    struct shmring *r = &((struct luaring *) luaL_checkudata(L, 1, SP_RING_META))->r;
+    int fds[3];
+    shmring_detach(r);
+    fds[0] = r->fd;
+    fds[1] = r->pushfd;
+    fds[2] = r->popfd;
+    closefds(fds, 3);
+    r->fd = r->pushfd = r->popfd = -1;
+    return 0;
+}
+
+static int ring_tostring(lua_State *L)
+{
+    struct shmring *r = &((struct luaring *) luaL_checkudata(L, 1, SP_RING_META))->r;
+    if (!r->hdr) lua_pushliteral(L, "shmring (closed)");
+    else lua_pushfstring(L, "shmring (%d)", (int) (r->mask + 1));
+    return 1;
+}
+
+static const luaL_Reg ring_meta[] = {
+    {"__gc", ring_close},
+    {"__tostring", ring_tostring},
+    {NULL, NULL}
+};
+
+static const luaL_Reg ring_methods[] = {
+    {"push", ring_push},
+    {"pop", ring_pop},
+    {"shutdown", ring_shutdown},
+    {"maxsize", ring_maxsize},
+    {"close", ring_close},
+    {NULL, NULL}
+};
+#else
+/* subprocess.shmring([size]) */
+static int shmring_new(lua_State *L)
+{
+    lua_pushnil(L);
+    lua_pushliteral(L, "shmring not supported on this platform");
+    return 2;
+}
+#endif
+
+/* Get the popen option key from the table at index 1, which must be nil
+   or one of names. Returns its index in names, or -1 if it is nil. */
+static int getoption(lua_State *L, const char *key, const char *const names[])
+{
+    const char *s;
+    int i;
+    lua_getfield(L, 1, key);
+    if (lua_isnil(L, -1)){
+        lua_pop(L, 1);
+        return -1;
+    }
+    s = lua_tostring(L, -1);
+    for (i=0; s && names[i]; ++i){
+        if (strcmp(s, names[i]) == 0){
+            lua_pop(L, 1);
+            return i;
+        }
+    }
+    return luaL_error(L, "invalid value for %s", key);
+}
+
+/* Get the popen option key as an integer from min to max, or dflt if nil */
+static int getintoption(lua_State *L, const char *key, int min, int max, int dflt)
+{
+    lua_Number n;
+    lua_getfield(L, 1, key);
+    if (lua_isnil(L, -1)){
+        lua_pop(L, 1);
+        return dflt;
+    }
+    n = lua_tonumber(L, -1);
+    if (!lua_isnumber(L, -1) || n < min || n > max || n != (int) n)
+        return luaL_error(L, "%s must be an integer from %d to %d", key, min, max);
+    lua_pop(L, 1);
+    return (int) n;
+}
+
+#if defined(OS_WINDOWS)
+/* popen options that only do anything on POSIX */
+static const char *const posix_only[] = {"cpus", "nice", "ioprio", "sched_policy", "limits",
+                                         "new_process_group", "setsid", NULL};
+#endif
+
+#if defined(OS_POSIX)
+/* Names of the resource limits for the limits option */
+static const struct {
+    const char *name;
+    int resource;
+} limit_names[] = {
+    {"as", RLIMIT_AS},
+    {"core", RLIMIT_CORE},
+    {"cpu", RLIMIT_CPU},
+    {"data", RLIMIT_DATA},
+    {"fsize", RLIMIT_FSIZE},
+    {"nofile", RLIMIT_NOFILE},
+    {"stack", RLIMIT_STACK},
+#ifdef RLIMIT_NPROC
+    {"nproc", RLIMIT_NPROC},
+#endif
+#ifdef RLIMIT_MEMLOCK
+    {"memlock", RLIMIT_MEMLOCK},
+#endif
+#ifdef RLIMIT_RSS
+    {"rss", RLIMIT_RSS},
+#endif
+    {NULL, 0}
+};
+
+/* A limit from the value at the top of the stack: a number, math.huge or
+   "unlimited" */
+static rlim_t getlimit(lua_State *L, const char *name)
+{
+    lua_Number n;
+    if (lua_type(L, -1) == LUA_TSTRING && strcmp(lua_tostring(L, -1), "unlimited") == 0)
+        return RLIM_INFINITY;
+    if (lua_type(L, -1) != LUA_TNUMBER || (n = lua_tonumber(L, -1)) < 0)
+        return luaL_error(L, "invalid value for limit %s", name);
+    if (n >= (lua_Number) RLIM_INFINITY) return RLIM_INFINITY;
+    return (rlim_t) n;
+}
+
+/* Get the popen options that go in struct spawnopts */
+static void getspawnopts(lua_State *L, struct spawnopts *opts)
+{
+#ifdef __linux__
+    static const char *const policy_names[] = {"other", "batch", "idle", "fifo", "rr", NULL};
+    static const int policies[] = {SCHED_OTHER, SCHED_BATCH, SCHED_IDLE, SCHED_FIFO, SCHED_RR};
+    static const char *const class_names[] = {"realtime", "best-effort", "idle", NULL};
+    size_t i, n;
+    int cpu;
+#endif
+    int k;
+
+    memset(opts, 0, sizeof *opts);
+    opts->ioprio = -1;
+    opts->policy = -1;
+
+    /* new_process_group and setsid */
+    lua_getfield(L, 1, "new_process_group");
+    lua_getfield(L, 1, "setsid");
+    opts->pgroup = lua_toboolean(L, -1) ? 2 : lua_toboolean(L, -2) ? 1 : 0;
+    lua_pop(L, 2);
+
+    /* cpus */
+    lua_getfield(L, 1, "cpus");
+    if (!lua_isnil(L, -1)){
+#ifdef __linux__
+        if (!lua_istable(L, -1) || (n = lua_objlen(L, -1)) == 0)
+            luaL_error(L, "cpus must be a list of CPU numbers");
+        for (i=1; i<=n; ++i){
+            lua_rawgeti(L, -1, (int) i);
+            cpu = (int) lua_tointeger(L, -1);
+            if (!lua_isnumber(L, -1) || cpu < 0 || cpu >= SP_MAXCPUS)
+                luaL_error(L, "invalid CPU number in cpus");
+            lua_pop(L, 1);
+            opts->cpus[cpu / (8 * sizeof(unsigned long))] |= 1UL << (cpu % (8 * sizeof(unsigned long)));
+        }
+        opts->setcpus = 1;
+#else
+        luaL_error(L, "cpus is not supported on this platform");
+#endif
+    }
+    lua_pop(L, 1);
+
+    /* nice */
+    lua_getfield(L, 1, "nice");
+    opts->setnice = !lua_isnil(L, -1);
+    lua_pop(L, 1);
+    opts->nice = getintoption(L, "nice", -20, 19, 0);
+
+#ifdef __linux__
+    /* ioprio and ioprio_level: the class goes in the top bits, and the
+       level (which the idle class doesn't have) in the bottom 13 */
+    k = getoption(L, "ioprio", class_names);
+    if (k != -1)
+        opts->ioprio = ((k + 1) << 13) | (k == 2 ? 0 : getintoption(L, "ioprio_level", 0, 7, 4));
+
+    /* sched_policy and sched_priority */
+    k = getoption(L, "sched_policy", policy_names);
+    if (k != -1){
+        opts->policy = policies[k];
+        opts->priority = opts->policy == SCHED_FIFO || opts->policy == SCHED_RR ?
+                         getintoption(L, "sched_priority", 1, 99, 1) : 0;
+    }
+#else
+    for (k=0; k<2; ++k){
+        lua_getfield(L, 1, k == 0 ? "ioprio" : "sched_policy");
+        if (!lua_isnil(L, -1))
+            luaL_error(L, "%s is not supported on this platform", k == 0 ? "ioprio" : "sched_policy");
+        lua_pop(L, 1);
+    }
+#endif
+
+    /* limits: {name=limit} or {name={soft, hard}} */
+    lua_getfield(L, 1, "limits");
+    if (!lua_isnil(L, -1)){
+        if (!lua_istable(L, -1)) luaL_error(L, "limits must be a table");
+        lua_pushnil(L);
+        while (lua_next(L, -2)){
+            /* stack: limits name value */
+            const char *name = lua_type(L, -2) == LUA_TSTRING ? lua_tostring(L, -2) : NULL;
+            for (k=0; name && limit_names[k].name; ++k)
+                if (strcmp(name, limit_names[k].name) == 0) break;
+            if (!name || !limit_names[k].name)
+                luaL_error(L, "unknown limit %s", name ? name : "(not a string)");
+            opts->limits[opts->nlimits].resource = limit_names[k].resource;
+            if (lua_istable(L, -1)){
+                lua_rawgeti(L, -1, 1);
+                opts->limits[opts->nlimits].rl.rlim_cur = getlimit(L, name);
+                lua_pop(L, 1);
+                lua_rawgeti(L, -1, 2);
+                opts->limits[opts->nlimits].rl.rlim_max = getlimit(L, name);
+                lua_pop(L, 1);
+                if (opts->limits[opts->nlimits].rl.rlim_cur > opts->limits[opts->nlimits].rl.rlim_max)
+                    luaL_error(L, "soft limit is above hard limit for %s", name);
+            } else {
+                opts->limits[opts->nlimits].rl.rlim_cur = getlimit(L, name);
+                opts->limits[opts->nlimits].rl.rlim_max = opts->limits[opts->nlimits].rl.rlim_cur;
+            }
+            opts->nlimits++;
+            lua_pop(L, 1);
+        }
+    }
+    lua_pop(L, 1);
+}
+#endif
+
+/* Start a child process, as described by the arguments of popen, and
+   push its proc object. If detach is set, the child is left to itself
+   instead (see spawnchild), and just its pid is pushed. */
+static int spawn(lua_State *L, int detach)
+{
+    struct proc *proc = NULL;
+
+    /* List of arguments (malloc'd NULL-terminated array of C strings.
+       The C strings are owned by Lua) */
+    int nargs = 0;
+    const char **args = NULL;
+    /* Command to run (owned by Lua) */
+    const char *executable = NULL;
+    /* Directory to run it in (owned by Lua) */
+    const char *cwd = NULL;
+    /* File options */
+    struct fdinfo fdinfo[3];
+    /* Close fds? */
+    int close_fds = 0;
+    /* Use binary mode for files? */
+    int binary = 0;
+    /* Append to output files? */
+    int append = 0;
+
+    FILE *pipe_ends[3] = {NULL, NULL, NULL};
+    /* Sinks that will read stdout/stderr */
+    struct sinkstate *sinks[3] = {NULL, NULL, NULL};
+    /* Our end of the socket, if one is used */
+    int sock = -1;
+    /* Other fds for the child, {fd, number} */
+    int pass[SP_MAXPASS][2];
+    int npass = 0;
+#if defined(OS_POSIX)
+    /* Other settings for the child */
+    struct spawnopts opts;
+#endif
+#if defined(OS_POSIX)
+    struct channel *chan = NULL;
+    int chanidx = 0;
+    int socktype = SOCK_SEQPACKET;
+#endif
+    int i, result;
+    FILE *f;
+    const char *s;
+
+    char errmsg_buf[256];
+
+    /* a detached child never adds to the list that prune goes through */
+    if (!detach) prune(L);
+
+    checkargs(L, 0);
+
+    proc = newproc(L);
+
+    /* Stack: kwargs proc <strings etc....>
+       Lua strings are left on the stack while they are needed,
+       and Lua can garbage-collect them later. */
+    
+    /* get arguments */
+    nargs = lua_objlen(L, 1);
+    if (nargs == 0) return luaL_error(L, "no arguments specified");
+    args = lua_newuserdata(L, (nargs + 1) * sizeof *args); /*alloc((nargs + 1) * sizeof *args);*/
+    if (!args) return luaL_error(L, "memory full");
+    for (i=0; i<=nargs; ++i) args[i] = NULL;
+    for (i=1; i<=nargs; ++i){
+        lua_rawgeti(L, 1, i);
+        if (lua_type(L, -1) == LUA_TSTRING){
+            /* the table keeps it alive, so don't use up stack space
+               (there may be more arguments than the stack can hold) */
+            args[i-1] = lua_tostring(L, -1);
+            lua_pop(L, 1);
+            continue;
+        }
+        luaL_checkstack(L, 1, "cannot grow stack");
+        s = lua_tostring(L, -1);
+        if (!s){
+            /*freestrings(args, nargs);
+            free(args);*/
+            return luaL_error(L, "popen argument %d not a string", (int) i);
+
+        }
+        args[i-1] = s; /*strdup(s);*/
+        /*if (args[i-1] == NULL){
+strings_failure:
+            freestrings(args, nargs);
+            free(args);
+            return luaL_error(L, "memory full");
+        } */
+        /*lua_pop(L, 1);*/
+    }
+
+    luaL_checkstack(L, 12, "cannot grow stack");
+    
+    /* get executable string */
+    lua_getfield(L, 1, "executable");
+    s = lua_tostring(L, -1);
+    if (s){
+        executable = s; /*strdup(s);*/
+        /*if (executable == NULL) goto strings_failure;*/
+    } else lua_pop(L, 1);
+    /*lua_pop(L, 1); */ /* to match lua_getfield */
+
+    /* get directory name */
+    lua_getfield(L, 1, "cwd");
+    cwd = lua_tostring(L, -1);
+    if (cwd == NULL) lua_pop(L, 1);
+    else {
+    /*if (lua_isstring(L, -1)){
+        cwd = lua_tostring(L, -1);*/ /*strdup(lua_tostring(L, -1));
+        if (!cwd){
+            free(executable);
+            freestrings(args, nargs);
+            free(args);
+            return luaL_error(L, "memory full");
+        }                            */
+        /* make sure the cwd exists; if it's kept open, a failed fchdir
+           reports it */
+#if defined(OS_POSIX)
+        if (!cwdcached(cwd) && !direxists(cwd)){
+#else
+        if (!direxists(cwd)){
+#endif
+            /*free(executable);
+            freestrings(args, nargs);*/
+            /*free(args);*/
+            return luaL_error(L, "directory `%s' does not exist", cwd);
+        }
+    }
+    /*lua_pop(L, 1);*/
+
+    /* close_fds */
+    lua_getfield(L, 1, "close_fds");
+    close_fds = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+
+    /* binary */
+    lua_getfield(L, 1, "binary");
+    binary = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+
+    /* append */
+    lua_getfield(L, 1, "append");
+    append = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+
+    /* shmring and shmring_fd */
+    lua_getfield(L, 1, "shmring");
+    if (!lua_isnil(L, -1)){
+#ifdef HAVE_SHMRING
+        /* a ring, or a list of two */
+        struct shmring *rings[2] = {NULL, NULL};
+        int nrings = 1;
+        if (lua_istable(L, -1)){
+            nrings = (int) lua_objlen(L, -1);
+            if (nrings < 1 || nrings > 2) return luaL_error(L, "shmring must be a ring or a list of two");
+            for (i=0; i<nrings; ++i){
+                lua_rawgeti(L, -1, i + 1);
+                rings[i] = toring(L, -1);
+                lua_pop(L, 1);  /* the list keeps it */
+            }
+        } else rings[0] = toring(L, -1);
+        lua_getfield(L, 1, "shmring_fd");
+        result = lua_isnil(L, -1) ? 3 : (int) lua_tointeger(L, -1);
+        lua_pop(L, 1);
+        if (result < 3) return luaL_error(L, "shmring_fd must be 3 or more");
+        for (i=0; i<nrings; ++i){
+            if (!rings[i]) return luaL_error(L, "shmring must be a ring made by subprocess.shmring");
+            if (!rings[i]->hdr) return luaL_error(L, "attempt to use a closed ring");
+            pass[npass++][0] = rings[i]->fd;
+            pass[npass++][0] = rings[i]->pushfd;
+            pass[npass++][0] = rings[i]->popfd;
+        }
+        for (i=0; i<npass; ++i)
+            pass[i][1] = result + i;
+#else
+        return luaL_error(L, "shmring is not supported on this platform");
+#endif
+    }
+    lua_pop(L, 1);
+
+#if defined(OS_POSIX)
+    /* cpus, nice, ioprio etc. */
+    getspawnopts(L, &opts);
+    opts.detach = detach;
+#else
+    for (i=0; posix_only[i]; ++i){
+        lua_getfield(L, 1, posix_only[i]);
+        if (!lua_isnil(L, -1))
+            return luaL_error(L, "%s is not supported on this platform", posix_only[i]);
+        lua_pop(L, 1);
+    }
+#endif
+
+#if defined(OS_POSIX)
+    /* socket_type */
+    lua_getfield(L, 1, "socket_type");
+    if (!lua_isnil(L, -1)){
+        s = lua_tostring(L, -1);
+        if (s && strcmp(s, "stream") == 0) socktype = SOCK_STREAM;
+        else if (!s || strcmp(s, "seqpacket") != 0)
+            return luaL_error(L, "socket_type must be \"stream\" or \"seqpacket\"");
+    }
+    lua_pop(L, 1);
+#endif
+
+    /* handle stdin/stdout/stderr */
+    for (i=0; i<3; ++i){
+        lua_getfield(L, 1, fd_names[i]);
+        if (lua_isnil(L, -1)){
+            fdinfo[i].mode = FDMODE_INHERIT;
+            lua_pop(L, 1);
+        } else if (lua_touserdata(L, -1) == &PIPE){
+            fdinfo[i].mode = FDMODE_PIPE;
+            lua_pop(L, 1);
+        } else if (lua_touserdata(L, -1) == &DEVNULL){
+            fdinfo[i].mode = FDMODE_DEVNULL;
+            lua_pop(L, 1);
+        } else if (lua_touserdata(L, -1) == &SOCKET){
+#if defined(OS_POSIX)
+            fdinfo[i].mode = FDMODE_SOCKET;
+            fdinfo[i].info.socktype = socktype;
+            lua_pop(L, 1);
+            if (!chan){
+                /* made now, so that nothing can fail once the socket exists */
+                chan = newchannel(L, socktype);
+                chanidx = lua_gettop(L);
+            }
+#else
+            lua_pushliteral(L, "SOCKET is not supported on this platform");
+            goto files_failure;
+#endif
+        } else if (lua_touserdata(L, -1) == &STDOUT){
+            if (i == STDERR_FILENO /*&& fdinfo[STDOUT_FILENO].mode == FDMODE_PIPE*/){
+                fdinfo[i].mode = FDMODE_STDOUT;
+            } else {
+                lua_pushliteral(L, "STDOUT must be used only for stderr"/* when stdout is set to PIPE"*/);
+files_failure:
+                /*for (j=0; j<i; ++j){
+                    if (fdinfo[j].mode == FDMODE_FILENAME)
+                        free(fdinfo[j].info.filename);
+                }
+                free(executable);
+                freestrings(args, nargs);
+                free(args);*/
+                return lua_error(L);
+            }
+            lua_pop(L, 1);
+        } else if (lua_type(L, -1) == LUA_TNUMBER){
+            /* use this fd */
+            fdinfo[i].mode = FDMODE_FILEDES;
+            fdinfo[i].info.filedes = (filedes_t) lua_tointeger(L, -1);
+            lua_pop(L, 1);
+        } else if (lua_isstring(L, -1)){
+            /* open a file */
+            fdinfo[i].mode = append && i != STDIN_FILENO ? FDMODE_APPEND : FDMODE_FILENAME;
+            /*if ((fdinfo[i].info.filename = strdup(lua_tostring(L, -1))) == NULL){
+                lua_pushliteral(L, "out of memory");
+                goto files_failure;
+            } */
+            fdinfo[i].info.filename = lua_tostring(L, -1);
+            /* do not pop */
+        } else if ((sinks[i] = tosink(L, -1)) != NULL){
+            if (i == STDIN_FILENO){
+                lua_pushliteral(L, "a sink can't be used for stdin");
+                goto files_failure;
+            }
+            if (sinks[i]->kind == SINK_DISCARD){
+                /* nothing to read: the child writes to the null device */
+                fdinfo[i].mode = FDMODE_DEVNULL;
+            } else {
+#if defined(OS_POSIX)
+                if (sinks[i]->started || (i == STDERR_FILENO && sinks[i] == sinks[STDOUT_FILENO])){
+                    lua_pushliteral(L, "sink is already in use");
+                    goto files_failure;
+                }
+#endif
+                fdinfo[i].mode = FDMODE_PIPE;
+            }
+            lua_pop(L, 1);
+        } else {
+            f = liolib_copy_tofile(L, -1);
+            if (f){
+                fdinfo[i].mode = FDMODE_FILEOBJ;
+                fdinfo[i].info.fileobj = f;
+            } else {
+                /* huh? */
+                lua_pushfstring(L, "unexpected value for %s", fd_names[i]);
+                goto files_failure;
+            }
+            lua_pop(L, 1);
+        }
+        if (detach && (fdinfo[i].mode == FDMODE_PIPE || fdinfo[i].mode == FDMODE_SOCKET))
+            return luaL_error(L, "%s can't be a pipe for a detached process", fd_names[i]);
+    }
+
+    result = dopopen(args, executable, fdinfo, close_fds, binary, cwd,
+                     lua_topointer(L, LUA_REGISTRYINDEX), proc, pipe_ends, &sock,
+                     (const int (*)[2]) pass, npass,
+#if defined(OS_POSIX)
+                     &opts,
+#else
+                     NULL,
+#endif
+                     errmsg_buf, 255);
+    /*for (i=0; i<3; ++i)
+        if (fdinfo[i].mode == FDMODE_FILENAME)
+            free(fdinfo[i].info.filename);
+    free(executable);
+    freestrings(args, nargs);
+    free(args);*/
+    if (result == -1){
+        /* failed */
+        return luaL_error(L, "popen failed: %s", errmsg_buf);
+    }
+
+    if (detach){
+        proc->done = 1;
+#if defined(OS_WINDOWS)
+        CloseHandle(proc->hProcess);
+#elif defined(PR_GET_CHILD_SUBREAPER)
+        /* if we are a subreaper, the child is given back to us when the
+           middle child exits, so reap it as an orphan */
+        if (prctl(PR_GET_CHILD_SUBREAPER, &i) == 0 && i){
+            sp_lock();
+            addorphan(proc->pid);
+            sp_unlock();
+        }
+#endif
+        lua_pushinteger(L, (lua_Integer) proc->pid);
+        return 1;
+    }
+
+    /* Keep pipe ends in the proc, apart from those that sinks read */
+    for (i=0; i<3; ++i){
+        if (sinks[i]){
+#if defined(OS_POSIX)
+            if (pipe_ends[i]) sink_start(sinks[i], pipe_ends[i]);
+#endif
+            lua_getfield(L, 1, fd_names[i]);
+            proc->objrefs[i] = luaL_ref(L, LUA_REGISTRYINDEX);
+        } else {
+            proc->pipes[i] = pipe_ends[i];
+        }
+    }
+#if defined(OS_POSIX)
+    /* and the socket in its channel */
+    if (chan){
+        chan->fd = sock;
+        for (i=0; i<3; ++i){
+            if (fdinfo[i].mode != FDMODE_SOCKET) continue;
+            lua_pushvalue(L, chanidx);
+            proc->objrefs[i] = luaL_ref(L, LUA_REGISTRYINDEX);
+        }
+    }
+#else
+    (void) sock;
+#endif
+
+    /* Put proc object in SP_LIST table */
+    luaL_getmetatable(L, SP_LIST);
+    if (lua_isnil(L, -1)){
+        fputs("subprocess.c: XXX: SP_LIST IS NIL\n", stderr);
+    } else {
+        lua_pushinteger(L, proc->pid); /* stack: list pid */
+        lua_pushvalue(L, 2);           /* stack: list pid proc */
+        lua_settable(L, -3);           /* stack: list */
+    }
+    lua_pop(L, 1);
+        
+    /* Return the proc */
+    lua_settop(L, 2);
+    return 1;
+}
+
+/* popen {arg0, arg1, arg2, ..., [executable=...]}
+   popen(command, [options]) */
+static int superpopen(lua_State *L)
+{
+    return spawn(L, 0);
+}
+
+/* spawn_detached {arg0, arg1, arg2, ..., [executable=...]}
+   spawn_detached(command, [options]) */
+static int spawn_detached(lua_State *L)
+{
+    return spawn(L, 1);
+}
+
+/* __gc */
+static int proc_gc(lua_State *L)
+{
+    struct proc *proc = checkproc(L, 1);
+    int i;
+    for (i=0; i<3; ++i){
+        if (proc->pipes[i]){
+            fclose(proc->pipes[i]);
+            proc->pipes[i] = NULL;
+        }
+        luaL_unref(L, LUA_REGISTRYINDEX, proc->piperefs[i]);
+        proc->piperefs[i] = LUA_NOREF;
+        luaL_unref(L, LUA_REGISTRYINDEX, proc->objrefs[i]);
+        proc->objrefs[i] = LUA_NOREF;
+    }
+    if (!proc->done){
+#if defined(OS_POSIX)
+        /* Try to wait for process to avoid leaving zombie.
+           If the process hasn't finished yet, it becomes an orphan,
+           to be reaped later by prune. */
+        int stat;
+        sp_lock();
+        if (collect(proc->pid, &stat) == 0)
+            addorphan(proc->pid);
+        sp_unlock();
+#elif defined(OS_WINDOWS)
+        CloseHandle(proc->hProcess);
+#endif
+        doneproc(L, 1);
+    }
+    return 0;
+}
+
+/* Fields of proc objects. The __index function has an upvalue that maps
+   each method name to its function and each field name to one of these,
+   so a lookup is a single table access. */
+enum {
+    PROC_PID = 1,
+    PROC_EXITCODE,
+    PROC_STDIN,
+    PROC_STDOUT,
+    PROC_STDERR
+};
+
+static const char *const proc_fields[] = {
+    "pid", "exitcode", "stdin", "stdout", "stderr", NULL
+};
+
+/* __index */
+static int proc_index(lua_State *L)
+{
+    /* __index is only reachable through the metatable (which is hidden
+       by __metatable), so the object must be a proc */
+    struct proc *proc = lua_touserdata(L, 1);
+    lua_settop(L, 2);
+    lua_rawget(L, lua_upvalueindex(1));
+    if (lua_type(L, 2) != LUA_TNUMBER) return 1; /* a method, or nil */
+    switch (lua_tointeger(L, 2)){
+        case PROC_PID:
+            lua_pushinteger(L, proc->pid);
+            return 1;
+        case PROC_EXITCODE:
+            if (!proc->done) return 0;
+            lua_pushinteger(L, proc->exitcode);
+            return 1;
+        case PROC_STDIN:
+        case PROC_STDOUT:
+        case PROC_STDERR:
+            pushpipe(L, proc, lua_tointeger(L, 2) - PROC_STDIN);
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+/* Push string representation of process on stack */
+static int proc_tostring(lua_State *L)
+{
+    struct proc *proc = checkproc(L, 1);
+    if (proc->done)
+        lua_pushliteral(L, "(finished process)");
+    else
+        lua_pushfstring(L, "process (%d)", (int) proc->pid);
+    return 1;
+}
+
+#if defined(OS_POSIX)
+/* Get exitcode from wait's 'stat' value */
+static int getexitcode(int stat)
+{
+    if (WIFEXITED(stat))
+        return WEXITSTATUS(stat);
+    else if (WIFSIGNALED(stat))
+        return -WTERMSIG(stat);
+    else if (WIFSTOPPED(stat))
+        return -WSTOPSIG(stat);
+    else {
+        fputs("child disappeared into black hole\n", stderr);
+        return -1;
+    }
+}
+#endif
+
+/* Wait for, or poll, a process */
+static int do_waitpid(lua_State *L, struct proc *proc, int wait)
+#if defined(OS_POSIX)
+{
+    int stat, options;
+
+    if (proc->done){
+        lua_pushinteger(L, proc->exitcode);
+        return 1;
+    }
+
+    if (wait) options = 0;
+    else options = WNOHANG;
+    switch (sp_waitpid(proc->pid, &stat, options)){
+        case -1:
+            return luaL_error(L, strerror(errno));
+        case 0:
+            /* child still running */
+            lua_pushnil(L);
+            return 1;
+        default:
+            proc->exitcode = getexitcode(stat);
+            doneproc(L, 1);
+            lua_pushinteger(L, proc->exitcode);
+            return 1;
+    }
+}
+#elif defined(OS_WINDOWS)
+{
+    DWORD dwMilliseconds, retval, exitcode;
+
+    if (proc->done){
+        lua_pushinteger(L, proc->exitcode);
+        return 1;
+    }
+    if (wait) dwMilliseconds = INFINITE;
+    else dwMilliseconds = 0;
+    retval = WaitForSingleObject(proc->hProcess, dwMilliseconds);
+    switch (retval){
+        case WAIT_FAILED:
+failure:
+            push_w32error(L, GetLastError());
+            return lua_error(L);
+        case WAIT_OBJECT_0:
+            /* child finished */
+            if (GetExitCodeProcess(proc->hProcess, &exitcode) == 0){
+                goto failure;
+            }
+            CloseHandle(proc->hProcess);
+            proc->exitcode = exitcode;
+            doneproc(L, 1);
+            lua_pushinteger(L, proc->exitcode);
+            return 1;
+        case WAIT_TIMEOUT:
+        default:
+            /* child still running */
+            lua_pushnil(L);
+            return 1;
+    }
+}
+#endif
+
+static int proc_poll(lua_State *L)
+{
+    return do_waitpid(L, checkproc(L, 1), 0);
+}
+
+static int proc_wait(lua_State *L)
+{
+    return do_waitpid(L, checkproc(L, 1), 1);
+}
+
+#if defined(OS_POSIX)
+static int proc_send_signal(lua_State *L)
+{
+    struct proc *proc = checkproc(L, 1);
+    int sig = luaL_checkinteger(L, 2);
+    /* it isn't done until it has been waited for: it may not even die,
+       and if it does, wait (or __gc, if it never is) reaps it */
+    if (!proc->done && kill(proc->pid, sig))
+        return luaL_error(L, "kill: %s", strerror(errno));
+    return 0;
+}
+
+static int proc_terminate(lua_State *L)
+{
+    lua_settop(L, 1);
+    lua_pushinteger(L, SIGTERM);
+    return proc_send_signal(L);
+}
+
+static int proc_kill(lua_State *L)
+{
+    lua_settop(L, 1);
+    lua_pushinteger(L, SIGKILL);
+    return proc_send_signal(L);
+}
+
+/* proc:kill_group([sig]) */
+static int proc_kill_group(lua_State *L)
+{
+    struct proc *proc = checkproc(L, 1);
+    int sig = luaL_optinteger(L, 2, SIGTERM);
+    int en;
+    if (!proc->pgroup)
+        return luaL_error(L, "process was not started with new_process_group or setsid");
+    /* the group can outlive the process, so this is allowed once it's done */
+    if (kill(-proc->pid, sig) == 0){
+        lua_pushboolean(L, 1);
+        return 1;
+    }
+    en = errno;
+    lua_pushnil(L);
+    lua_pushstring(L, strerror(en));
+    lua_pushinteger(L, en);
+    return 3;
+}
+#elif defined(OS_WINDOWS)
+static int proc_terminate(lua_State *L)
+{
+    struct proc *proc = checkproc(L, 1);
+    if (!proc->done){
+        if (TerminateProcess(proc->hProcess, -9) == 0){
+            push_w32error(L, GetLastError());
+            return lua_error(L);
+        }
+        CloseHandle(proc->hProcess);
+        proc->exitcode = -9;
+        doneproc(L, 1);
+    }
+    return 0;
+}
+#endif
+
+/* Return a monotonic time in seconds */
+static double monotime(void)
+#if defined(OS_POSIX)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+#elif defined(OS_WINDOWS)
+{
+    return GetTickCount() / 1000.0;
+}
+#endif
+
+/* Multiplexed pipe I/O
+   pump reads from and writes to any number of pipes at once, until every
+   one of them reaches end of file (or has been written in full), so that
+   a child can never block on one pipe while we wait on another. On Linux
+   it uses io_uring when there are many pipes, which takes one system call
+   per batch of reads and writes instead of a poll and a read or write for
+   each; otherwise it uses poll. */
+
+/* A growable buffer */
+struct membuf {
+    char *data;
+    size_t len, size;
+};
+
+/* Make room for at least n more bytes. Returns -1 if out of memory. */
+static int membuf_reserve(struct membuf *b, size_t n)
+{
+    size_t size;
+    char *newp;
+    if (b->size - b->len >= n) return 0;
+    size = b->size ? b->size : 4096;
+    while (size - b->len < n) size *= 2;
+    if ((newp = realloc(b->data, size)) == NULL) return -1;
+    b->data = newp;
+    b->size = size;
+    return 0;
+}
+
+/* Kinds of stream handled by pump */
+enum {
+    PS_READ,    /* read until end of file */
+    PS_WRITE,   /* write data, then close */
+    PS_EXIT     /* wait for a process to exit (pidfd or process handle) */
+};
+
+struct pstream {
+    int kind;
+    filedes_t fd;
+    FILE **fp;          /* file to close when done, or NULL */
+    int fpobj;          /* 1 if fp is kept in a Lua file object */
+    struct membuf buf;  /* PS_READ: data read */
+    size_t max;         /* PS_READ: keep at most this much (0 for no limit) */
+    size_t chunk;       /* PS_READ: read at most this much at once (0 for no limit) */
+    /* PS_READ: if not NULL, called after each read (and with done set at
+       the end) to consume buf. Returns -1 to stop all the streams. */
+    int (*sink)(struct pstream *ps);
+    void *ud;           /* for sink */
+    const char *wdata;  /* PS_WRITE: data to write */
+    size_t wlen, wpos;
+    int fl;             /* PS_WRITE: file status flags to restore */
+    int done;
+    int err;            /* error number, if it failed */
+    int busy;           /* an io_uring operation is in flight */
+};
+
+/* Amount of buffer space offered to each read */
+#define PUMP_CHUNK 65536
+
+/* Reads beyond a stream's limit go here, and are thrown away */
+static char pump_discard[PUMP_CHUNK];
+
+/* Use io_uring when there are at least this many streams */
+#define URING_MIN_STREAMS 8
+
+/* subprocess.io_engine setting */
+enum { ENGINE_AUTO, ENGINE_POLL, ENGINE_URING };
+static const char *const engine_names[] = {"auto", "poll", "uring", NULL};
+static int io_engine = ENGINE_AUTO;
+
+static void pump_finish(struct pstream *ps)
+{
+    if (ps->fp && ps->fpobj){
+        liolib_copy_close(ps->fp);
+    } else if (ps->fp && *ps->fp){
+        fclose(*ps->fp);
+        *ps->fp = NULL;
+    }
+    ps->done = 1;
+}
+
+/* Finish every stream, after a sink has asked to stop */
+static void pump_abort(struct pstream *ps, int n)
+{
+    int i;
+    for (i=0; i<n; ++i)
+        if (!ps[i].done) pump_finish(&ps[i]);
+}
+
+/* Handle the result of a read, write or poll on a stream: a count, or
+   minus an error number. Returns -1 if the stream's sink wants to stop. */
+static int pump_result(struct pstream *ps, long res)
+{
+    if (res == -EINTR || res == -EAGAIN) return 0;
+    if (ps->kind == PS_READ && res > 0){
+        if (!ps->max || ps->buf.len < ps->max) ps->buf.len += res;
+        return ps->sink ? ps->sink(ps) : 0;
+    } else if (ps->kind == PS_WRITE && res > 0){
+        ps->wpos += res;
+        if (ps->wpos < ps->wlen) return 0;
+    } else if (ps->kind == PS_WRITE && res == -EPIPE){
+        res = 0;    /* the child doesn't want the rest */
+    }
+    if (res < 0) ps->err = (int) -res;
+    pump_finish(ps);
+    return ps->sink ? ps->sink(ps) : 0;
+}
+
+/* Return where the next read from a stream should go, and how much it
+   may read. Returns NULL if out of memory. */
+static char *pump_readbuf(struct pstream *ps, size_t *len)
+{
+    if (ps->max && ps->buf.len >= ps->max){
+        /* keep draining, so that the child doesn't block */
+        *len = sizeof pump_discard;
+        return pump_discard;
+    }
+    if (membuf_reserve(&ps->buf, PUMP_CHUNK)){
+        ps->err = ENOMEM;
+        pump_finish(ps);
+        return NULL;
+    }
+    *len = ps->buf.size - ps->buf.len;
+    if (ps->max && *len > ps->max - ps->buf.len) *len = ps->max - ps->buf.len;
+    if (ps->chunk && *len > ps->chunk) *len = ps->chunk;
+    return ps->buf.data + ps->buf.len;
+}
+
+#if defined(OS_POSIX)
+/* Do one read or write on a stream that poll says is ready. Returns -1
+   to stop. */
+static int pump_step(struct pstream *ps)
+{
+    ssize_t res = 0;
+    size_t len;
+    char *buf;
+    if (ps->kind == PS_READ){
+        if ((buf = pump_readbuf(ps, &len)) == NULL) return 0;
+        res = read(ps->fd, buf, len);
+    } else if (ps->kind == PS_WRITE){
+        res = write(ps->fd, ps->wdata + ps->wpos, ps->wlen - ps->wpos);
+    } else {
+        res = 0;    /* PS_EXIT: it's done */
+    }
+    return pump_result(ps, res == -1 ? -errno : (long) res);
+}
+
+static int pump_poll(struct pstream *ps, int n, double timeout)
+{
+    struct pollfd *pfds;
+    int *map;
+    int i, m, count, ms = -1, r = 0;
+    double deadline = monotime() + timeout;
+
+    pfds = malloc(n * sizeof *pfds);
+    map = malloc(n * sizeof *map);
+    if (!pfds || !map){
+        free(pfds);
+        free(map);
+        return -1;
+    }
+    /* writes must not block, in case the pipe has less room than we
+       have data (until we return: the pipe may still be used after a
+       timeout) */
+    for (i=0; i<n; ++i){
+        if (ps[i].kind == PS_WRITE && !ps[i].done){
+            ps[i].fl = fcntl(ps[i].fd, F_GETFL);
+            fcntl(ps[i].fd, F_SETFL, ps[i].fl | O_NONBLOCK);
+        }
+    }
+    for (;;){
+        for (i=m=0; i<n; ++i){
+            if (ps[i].done) continue;
+            pfds[m].fd = ps[i].fd;
+            pfds[m].events = ps[i].kind == PS_WRITE ? POLLOUT : POLLIN;
+            map[m++] = i;
+        }
+        if (m == 0) break;
+        if (timeout >= 0){
+            ms = (int) ((deadline - monotime()) * 1000 + 0.999);
+            if (ms <= 0){
+                r = 1;
+                break;
+            }
+        }
+        count = poll(pfds, m, ms);
+        if (count == -1 && errno != EINTR){
+            for (i=0; i<m; ++i){
+                ps[map[i]].err = errno;
+                pump_finish(&ps[map[i]]);
+            }
+        }
+        for (i=0; i<m && count > 0; ++i){
+            if (!pfds[i].revents) continue;
+            --count;
+            if (pump_step(&ps[map[i]])){
+                pump_abort(ps, n);
+                break;
+            }
+        }
+    }
+    for (i=0; i<n; ++i)
+        if (ps[i].kind == PS_WRITE && !ps[i].done)
+            fcntl(ps[i].fd, F_SETFL, ps[i].fl);
+    free(pfds);
+    free(map);
+    return r;
+}
+
+#ifdef HAVE_URING
+/* A minimal io_uring, driven with the raw system calls */
+struct uring {
+    int fd;
+    unsigned *sqhead, *sqtail, *sqmask, *sqarray;
+    unsigned *cqhead, *cqtail, *cqmask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sqring, *cqring;
+    size_t sqringsize, cqringsize, sqessize;
+    unsigned tail;      /* our copy of *sqtail */
+};
+
+static void uring_close(struct uring *u)
+{
+    if (u->sqes != MAP_FAILED) munmap(u->sqes, u->sqessize);
+    if (u->cqring != MAP_FAILED && u->cqring != u->sqring) munmap(u->cqring, u->cqringsize);
+    if (u->sqring != MAP_FAILED) munmap(u->sqring, u->sqringsize);
+    close(u->fd);
+}
+
+/* Returns -1 if io_uring (or a feature we need) isn't available */
+static int uring_open(struct uring *u, unsigned entries)
+{
+    struct io_uring_params p;
+    char *sq, *cq;
+
+    memset(&p, 0, sizeof p);
+    u->sqring = u->cqring = u->sqes = MAP_FAILED;
+#if defined(IORING_SETUP_DEFER_TASKRUN)
+    /* only this thread uses the ring, and completions are only needed
+       when we ask for them (6.1) */
+    p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    u->fd = syscall(SYS_io_uring_setup, entries, &p);
+    if (u->fd == -1){
+        memset(&p, 0, sizeof p);
+        u->fd = syscall(SYS_io_uring_setup, entries, &p);
+    }
+#else
+    u->fd = syscall(SYS_io_uring_setup, entries, &p);
+#endif
+    if (u->fd == -1) return -1;
+    /* reads and writes at the current position (5.6) */
+    if (!(p.features & IORING_FEAT_RW_CUR_POS)) goto failure;
+    u->sqringsize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cqringsize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP){
+        if (u->cqringsize > u->sqringsize) u->sqringsize = u->cqringsize;
+        u->cqringsize = u->sqringsize;
+    }
+    u->sqring = mmap(NULL, u->sqringsize, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if (u->sqring == MAP_FAILED) goto failure;
+    if (p.features & IORING_FEAT_SINGLE_MMAP){
+        u->cqring = u->sqring;
+    } else {
+        u->cqring = mmap(NULL, u->cqringsize, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+        if (u->cqring == MAP_FAILED) goto failure;
+    }
+    u->sqessize = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqessize, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) goto failure;
+
+    sq = u->sqring;
+    cq = u->cqring;
+    u->sqhead = (unsigned *) (sq + p.sq_off.head);
+    u->sqtail = (unsigned *) (sq + p.sq_off.tail);
+    u->sqmask = (unsigned *) (sq + p.sq_off.ring_mask);
+    u->sqarray = (unsigned *) (sq + p.sq_off.array);
+    u->cqhead = (unsigned *) (cq + p.cq_off.head);
+    u->cqtail = (unsigned *) (cq + p.cq_off.tail);
+    u->cqmask = (unsigned *) (cq + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+    u->tail = *u->sqtail;
+    return 0;
+failure:
+    uring_close(u);
+    return -1;
+}
+
+/* Queue the next operation on stream i */
+static void uring_queue(struct uring *u, struct pstream *ps, int i)
+{
+    struct io_uring_sqe *sqe;
+    unsigned index;
+    size_t len = 0;
+    char *buf = NULL;
+
+    ps += i;
+    if (ps->kind == PS_READ && (buf = pump_readbuf(ps, &len)) == NULL) return;
+    index = u->tail & *u->sqmask;
+    sqe = &u->sqes[index];
+    memset(sqe, 0, sizeof *sqe);
+    sqe->fd = ps->fd;
+    sqe->user_data = (unsigned) i;
+    switch (ps->kind){
+        case PS_READ:
+            sqe->opcode = IORING_OP_READ;
+            sqe->addr = (unsigned long) buf;
+            sqe->len = len;
+            sqe->off = (__u64) -1;
+            break;
+        case PS_WRITE:
+            sqe->opcode = IORING_OP_WRITE;
+            sqe->addr = (unsigned long) (ps->wdata + ps->wpos);
+            sqe->len = ps->wlen - ps->wpos > 0x40000000 ? 0x40000000 : ps->wlen - ps->wpos;
+            sqe->off = (__u64) -1;
+            break;
+        case PS_EXIT:
+            sqe->opcode = IORING_OP_POLL_ADD;
+            sqe->poll32_events = POLLIN;
+            break;
+    }
+    u->sqarray[index] = index;
+    ++u->tail;
+    ps->busy = 1;
+}
+
+/* user_data of cancel requests */
+#define URING_CANCEL ((__u64) -1)
+
+/* Cancel whatever is still in flight, and wait until the kernel has
+   finished with it (and so with our buffers) */
+static void uring_cancel(struct uring *u, struct pstream *ps, int n, int inflight)
+{
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe *cqe;
+    unsigned head, tail, index;
+    int i, submit;
+
+    for (i=0; i<n; ++i){
+        if (!ps[i].busy) continue;
+        index = u->tail & *u->sqmask;
+        sqe = &u->sqes[index];
+        memset(sqe, 0, sizeof *sqe);
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = (unsigned) i;
+        sqe->user_data = URING_CANCEL;
+        u->sqarray[index] = index;
+        ++u->tail;
+    }
+    while (inflight > 0){
+        __atomic_store_n(u->sqtail, u->tail, __ATOMIC_RELEASE);
+        submit = (int) (u->tail - __atomic_load_n(u->sqhead, __ATOMIC_ACQUIRE));
+        if (syscall(SYS_io_uring_enter, u->fd, submit, 1, IORING_ENTER_GETEVENTS, NULL, 0) == -1
+            && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+            break;
+        head = *u->cqhead;
+        tail = __atomic_load_n(u->cqtail, __ATOMIC_ACQUIRE);
+        for (; head != tail; ++head){
+            cqe = &u->cqes[head & *u->cqmask];
+            if (cqe->user_data == URING_CANCEL) continue;
+            ps[cqe->user_data].busy = 0;
+            --inflight;
+        }
+        __atomic_store_n(u->cqhead, head, __ATOMIC_RELEASE);
+    }
+}
+
+/* Returns -1 if io_uring can't be used, in which case nothing has been
+   done yet */
+static int pump_uring(struct pstream *ps, int n)
+{
+    struct uring u;
+    struct io_uring_cqe *cqe;
+    unsigned head, tail, entries;
+    int i, inflight = 0, submit, stop = 0;
+
+    for (entries = 8; entries < (unsigned) n; entries *= 2) ;
+    if (entries > 32768 || uring_open(&u, entries)) return -1;
+
+    for (i=0; i<n; ++i){
+        if (ps[i].done) continue;
+        uring_queue(&u, ps, i);
+        if (!ps[i].done) ++inflight;
+    }
+    while (inflight > 0){
+        __atomic_store_n(u.sqtail, u.tail, __ATOMIC_RELEASE);
+        submit = (int) (u.tail - __atomic_load_n(u.sqhead, __ATOMIC_ACQUIRE));
+        if (syscall(SYS_io_uring_enter, u.fd, submit, 1, IORING_ENTER_GETEVENTS, NULL, 0) == -1
+            && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+        {
+            /* give up on whatever is still going */
+            for (i=0; i<n; ++i){
+                if (ps[i].done) continue;
+                ps[i].err = errno;
+            }
+            stop = 1;
+        }
+        head = *u.cqhead;
+        tail = __atomic_load_n(u.cqtail, __ATOMIC_ACQUIRE);
+        for (; head != tail && !stop; ++head){
+            cqe = &u.cqes[head & *u.cqmask];
+            i = (int) cqe->user_data;
+            ps[i].busy = 0;
+            --inflight;
+            if (pump_result(&ps[i], ps[i].kind == PS_EXIT && cqe->res > 0 ? 0 : cqe->res)){
+                stop = 1;
+            } else if (!ps[i].done){
+                uring_queue(&u, ps, i);
+                if (!ps[i].done) ++inflight;
+            }
+        }
+        __atomic_store_n(u.cqhead, head, __ATOMIC_RELEASE);
+        if (stop){
+            uring_cancel(&u, ps, n, inflight);
+            pump_abort(ps, n);
+            break;
+        }
+    }
+    uring_close(&u);
+    return 0;
+}
+#endif /* HAVE_URING */
+
+/* Run streams until they are all done, or for at most timeout seconds
+   if timeout isn't negative. Errors are left in each stream. Returns -1 if
+   out of memory, or 1 if the time ran out, in which case the streams that
+   aren't done can be pumped again. */
+static int pump(struct pstream *ps, int n, double timeout)
+{
+    sigset_t set, oldset, pending;
+    int waspending, sig, done = 0, r = 0;
+#ifdef HAVE_URING
+    int engine;
+#endif
+
+    /* a child that exits without reading its input would otherwise kill
+       us with SIGPIPE */
+    sigemptyset(&set);
+    sigaddset(&set, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &set, &oldset);
+    sigpending(&pending);
+    waspending = sigismember(&pending, SIGPIPE);
+
+#ifdef HAVE_URING
+    sp_lock();
+    engine = io_engine;
+    sp_unlock();
+    /* (with a timeout, poll is used: the streams of one proc are few) */
+    if (timeout < 0 && (engine == ENGINE_URING || (engine == ENGINE_AUTO && n >= URING_MIN_STREAMS)))
+        done = pump_uring(ps, n) == 0;
+#endif
+    if (!done) r = pump_poll(ps, n, timeout);
+
+    if (!waspending){
+        sigpending(&pending);
+        if (sigismember(&pending, SIGPIPE)) sigwait(&set, &sig);
+    }
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+    return r;
+}
+
+#elif defined(OS_WINDOWS)
+/* Anonymous pipes can't be waited on, so the pipes are polled, sleeping
+   for a while when nothing happens. */
+static int pump(struct pstream *ps, int n, double timeout)
+{
+    double deadline = monotime() + timeout;
+    DWORD avail, count, delay = 1;
+    size_t len;
+    char *buf;
+    int i, busy, left, stop = 0;
+
+    for (;;){
+        busy = left = 0;
+        for (i=0; i<n; ++i){
+            if (ps[i].done) continue;
+            ++left;
+            switch (ps[i].kind){
+                case PS_READ:
+                    if (!PeekNamedPipe(ps[i].fd, NULL, 0, NULL, &avail, NULL)){
+                        /* broken pipe means end of file */
+                        stop = pump_result(&ps[i], GetLastError() == ERROR_BROKEN_PIPE ? 0 : -EIO);
+                        break;
+                    }
+                    if (avail == 0 || (buf = pump_readbuf(&ps[i], &len)) == NULL) break;
+                    if (avail > len) avail = (DWORD) len;
+                    if (!ReadFile(ps[i].fd, buf, avail, &count, NULL))
+                        stop = pump_result(&ps[i], GetLastError() == ERROR_BROKEN_PIPE ? 0 : -EIO);
+                    else
+                        stop = pump_result(&ps[i], (long) count);
+                    busy = 1;
+                    break;
+                case PS_WRITE:
+                    /* small writes, so that we get back to reading soon */
+                    count = ps[i].wlen - ps[i].wpos > 4096 ? 4096 : (DWORD) (ps[i].wlen - ps[i].wpos);
+                    if (!WriteFile(ps[i].fd, ps[i].wdata + ps[i].wpos, count, &count, NULL))
+                        stop = pump_result(&ps[i], GetLastError() == ERROR_NO_DATA ? -EPIPE : -EIO);
+                    else
+                        stop = pump_result(&ps[i], (long) count);
+                    busy = 1;
+                    break;
+                case PS_EXIT:
+                    if (WaitForSingleObject(ps[i].fd, 0) == WAIT_OBJECT_0){
+                        pump_finish(&ps[i]);
+                        busy = 1;
+                    }
+                    break;
+            }
+            if (stop){
+                pump_abort(ps, n);
+                return 0;
+            }
+        }
+        if (left == 0) break;
+        if (timeout >= 0 && monotime() >= deadline) return 1;
+        if (busy){
+            delay = 1;
+        } else {
+            Sleep(delay);
+            if (delay < 50) delay *= 2;
+        }
+    }
+    return 0;
+}
+#endif
+
+/* Return where the FILE * of pipe i is kept: in the proc, or in its file
+   object if one has been made */
+static FILE **getpipe(lua_State *L, struct proc *proc, int i)
+{
+    FILE **pf;
+    if (proc->piperefs[i] == LUA_NOREF) return &proc->pipes[i];
+    lua_rawgeti(L, LUA_REGISTRYINDEX, proc->piperefs[i]);
+    pf = lua_touserdata(L, -1);
+    lua_pop(L, 1);  /* still referenced by the registry */
+    return pf;
+}
+
+/* Set up the streams for communicating with proc: input (if not NULL) is
+   written to its stdin, which is then closed, and stdout and stderr are
+   read. Returns the number of streams used (at most 4); ps[1] and ps[2]
+   are always stdout and stderr (with fp NULL if not a pipe). */
+static int addstreams(lua_State *L, struct proc *proc, const char *input, size_t inlen, struct pstream *ps, int *pidfd)
+{
+    FILE **pf;
+    int i, n = 3;
+
+    memset(ps, 0, 4 * sizeof *ps);
+    *pidfd = -1;
+    for (i=0; i<3; ++i){
+        pf = getpipe(L, proc, i);
+        ps[i].kind = i == STDIN_FILENO ? PS_WRITE : PS_READ;
+        if (!*pf){
+            ps[i].done = 1;
+            continue;
+        }
+        ps[i].fp = pf;
+        ps[i].fpobj = proc->piperefs[i] != LUA_NOREF;
+        if (i == STDIN_FILENO) fflush(*pf);
+#if defined(OS_POSIX)
+        ps[i].fd = fileno(*pf);
+#elif defined(OS_WINDOWS)
+        ps[i].fd = (HANDLE) _get_osfhandle(_fileno(*pf));
+#endif
+    }
+    if (input && !ps[0].fp)
+        luaL_error(L, "cannot write input: stdin is not a pipe");
+    ps[0].wdata = input;
+    ps[0].wlen = inlen;
+    if (ps[0].fp && inlen == 0) pump_finish(&ps[0]);
+    if (proc->done) return n;
+    /* watch for the process exiting too, so that the wait afterwards
+       doesn't block */
+#if defined(OS_POSIX) && defined(HAVE_PIDFD)
+    *pidfd = syscall(SYS_pidfd_open, proc->pid, 0);
+    if (*pidfd == -1) return n;
+    ps[n].fd = *pidfd;
+#elif defined(OS_WINDOWS)
+    ps[n].fd = proc->hProcess;
+#else
+    return n;
+#endif
+    ps[n].kind = PS_EXIT;
+    return n + 1;
+}
+
+/* Push the output collected in ps[1] and ps[2] (or nil for a stream
+   that wasn't a pipe), and free the buffers. Returns the error number of
+   a stream that failed, or 0. */
+static int pushoutput(lua_State *L, struct pstream *ps)
+{
+    int i, err = 0;
+    for (i=1; i<3; ++i){
+        if (ps[i].err) err = ps[i].err;
+        if (ps[i].fp) lua_pushlstring(L, ps[i].buf.data ? ps[i].buf.data : "", ps[i].buf.len);
+        else lua_pushnil(L);
+        free(ps[i].buf.data);
+        ps[i].buf.data = NULL;
+    }
+    return err ? err : ps[0].err;
+}
+
+/* Wait for the proc at index */
+static void waitat(lua_State *L, int index)
+{
+    if (index < 0) index = lua_gettop(L) + index + 1;
+    lua_pushcfunction(L, proc_wait);
+    lua_pushvalue(L, index);
+    lua_call(L, 1, 1);
+}
+
+/* How docommunicate keeps the output of stdout or stderr */
+struct keep {
+    size_t max;                         /* at most this much (0 for no limit) */
+    int (*sink)(struct pstream *ps);    /* or, if not NULL, hand it to this */
+    void *ud;                           /* for sink */
+};
+
+/* Seconds between SIGTERM and SIGKILL after a timeout, by default */
+#define KILL_GRACE 1.0
+
+static void waitany(lua_State *L, int t, double timeout, int r);
+
+/* Wait at most timeout seconds for the proc at index to finish. Returns 1
+   if it has. */
+static int waitfor(lua_State *L, int index, double timeout)
+{
+    struct proc *proc = checkproc(L, index);
+    if (proc->done) return 1;
+    if (index < 0) index = lua_gettop(L) + index + 1;
+    lua_createtable(L, 1, 0);
+    lua_pushvalue(L, index);
+    lua_rawseti(L, -2, 1);
+    lua_createtable(L, 1, 0);
+    waitany(L, lua_gettop(L) - 1, timeout > 0 ? timeout : 0, lua_gettop(L));
+    lua_pop(L, 2);
+    return proc->done;
+}
+
+/* Stop a proc that has run out of time: stage 0 asks it to (SIGTERM),
+   stage 1 makes it (SIGKILL). If it leads a process group, the whole group
+   is signalled, as its children may be holding its pipes open. */
+static void killproc(struct proc *proc, int stage)
+#if defined(OS_POSIX)
+{
+    int sig = stage == 0 ? SIGTERM : SIGKILL;
+    if (proc->pgroup) kill(-proc->pid, sig);
+    else if (!proc->done) kill(proc->pid, sig);
+}
+#elif defined(OS_WINDOWS)
+{
+    /* there's no asking on Windows */
+    if (stage == 0 && !proc->done) TerminateProcess(proc->hProcess, -9);
+}
+#endif
+
+/* Pump the n streams in ps for the proc at index, then wait for it to
+   exit, all within timeout seconds if timeout isn't negative. If it runs
+   out of time, it is stopped with killproc, allowing grace seconds between
+   the two stages; the streams are pumped meanwhile, so that output written
+   as it exits is kept. Returns 1 if it ran out of time, 0 if not, or -1 if
+   out of memory. The proc still has to be waited for. */
+static int pumpwait(lua_State *L, int index, struct pstream *ps, int n, double timeout, double grace)
+{
+    struct proc *proc = checkproc(L, index);
+    double deadline = monotime() + timeout;
+    int r = n > 0 ? pump(ps, n, timeout) : 0;
+
+    if (r == 1 || (r == 0 && timeout >= 0 && !waitfor(L, index, deadline - monotime()))){
+        killproc(proc, 0);
+        deadline = monotime() + grace;
+        if (r == 1) r = pump(ps, n, grace);
+        if (r == 1 || !waitfor(L, index, deadline - monotime())){
+            killproc(proc, 1);
+            /* anything else that has the pipes open doesn't matter */
+            if (r == 1) pump_abort(ps, n);
+        }
+        return r == -1 ? -1 : 1;
+    }
+    return r;
+}
+
+/* Get the timeout and grace options (in seconds) from the table at index 1.
+   timeout is -1 if not given. */
+static void gettimeout(lua_State *L, double *timeout, double *grace)
+{
+    lua_getfield(L, 1, "timeout");
+    lua_getfield(L, 1, "grace");
+    if ((!lua_isnil(L, -2) && (!lua_isnumber(L, -2) || lua_tonumber(L, -2) < 0))
+            || (!lua_isnil(L, -1) && (!lua_isnumber(L, -1) || lua_tonumber(L, -1) < 0)))
+        luaL_error(L, "timeout and grace must be numbers of seconds");
+    *timeout = lua_isnil(L, -2) ? -1 : lua_tonumber(L, -2);
+    *grace = lua_isnil(L, -1) ? KILL_GRACE : lua_tonumber(L, -1);
+    lua_pop(L, 2);
+}
+
+/* Replace the n results at the top of the stack, the first of which is an
+   exitcode, with nil, "timeout" and the rest. Returns n + 1. */
+static int pushtimeout(lua_State *L, int n)
+{
+    lua_pushnil(L);
+    lua_replace(L, -n - 1);
+    lua_pushliteral(L, "timeout");
+    lua_insert(L, -n);
+    return n + 1;
+}
+
+/* Communicate with the proc at index, keeping stdout and stderr as
+   keep[0] and keep[1] say, and stopping it if it runs out of time (see
+   pumpwait). Pushes exitcode, stdout and stderr. Returns 1 if it ran out
+   of time. */
+static int docommunicate(lua_State *L, int index, const char *input, size_t inlen, const struct keep keep[2],
+                         double timeout, double grace)
+{
+    struct proc *proc = checkproc(L, index);
+    struct pstream ps[4];
+    int i, n, pidfd, r, timedout;
+
+    n = addstreams(L, proc, input, inlen, ps, &pidfd);
+    for (i=0; i<2; ++i){
+        ps[i+1].max = keep[i].max;
+        ps[i+1].sink = keep[i].sink;
+        ps[i+1].ud = keep[i].ud;
+    }
+    r = pumpwait(L, index, ps, n, timeout, grace);
+#if defined(OS_POSIX)
+    if (pidfd != -1) close(pidfd);
+#endif
+    if (r == -1){
+        free(ps[1].buf.data);
+        free(ps[2].buf.data);
+        luaL_error(L, "memory full");
+    }
+    timedout = r;
+    waitat(L, index);
+    if ((r = pushoutput(L, ps)) != 0)
+        luaL_error(L, "communicate: %s", strerror(r));
+    return timedout;
+}
+
+/* proc:communicate([input], [timeout], [grace]) */
+static int proc_communicate(lua_State *L)
+{
+    static const struct keep keep[2];
+    size_t inlen = 0;
+    const char *input = luaL_optlstring(L, 2, NULL, &inlen);
+    double timeout = luaL_optnumber(L, 3, -1);
+    double grace = luaL_optnumber(L, 4, KILL_GRACE);
+    if (docommunicate(L, 1, input, inlen, keep, timeout, grace))
+        return pushtimeout(L, 3);
+    return 3;
+}
+
+/* communicate(procs, [inputs]) */
+static int communicate(lua_State *L)
+{
+    struct pstream *ps;
+    struct proc *proc;
+    const char *input;
+    size_t inlen;
+    int *pidfds;
+    int i, j, n, nstreams = 0, r, err = 0;
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+    if (!lua_isnoneornil(L, 2)) luaL_checktype(L, 2, LUA_TTABLE);
+    lua_settop(L, 2);
+    n = lua_objlen(L, 1);
+    /* check everything first, as nothing can be raised once the streams
+       have been set up */
+    for (i=1; i<=n; ++i){
+        lua_rawgeti(L, 1, i);
+        if ((proc = toproc(L, -1)) == NULL)
+            return luaL_error(L, "communicate: item %d is not a proc", i);
+        lua_pop(L, 1);
+        if (lua_isnil(L, 2)) continue;
+        lua_rawgeti(L, 2, i);
+        if (!lua_isnil(L, -1) && !*getpipe(L, proc, STDIN_FILENO))
+            return luaL_error(L, "communicate: item %d: cannot write input: stdin is not a pipe", i);
+        lua_pop(L, 1);
+    }
+    /* 3 and 4: Lua's, so that they can't leak */
+    ps = lua_newuserdata(L, (n > 0 ? n : 1) * 4 * sizeof *ps);
+    pidfds = lua_newuserdata(L, (n > 0 ? n : 1) * sizeof *pidfds);
+    for (i=1; i<=n; ++i){
+        lua_rawgeti(L, 1, i);
+        proc = toproc(L, -1);
+        input = NULL;
+        inlen = 0;
+        if (!lua_isnil(L, 2)){
+            lua_rawgeti(L, 2, i);
+            input = lua_tolstring(L, -1, &inlen);
+            lua_pop(L, 1);  /* still referenced by inputs */
+        }
+        lua_pop(L, 1);
+        /* every proc gets 4 slots, so that its stdout is at 4*(i-1)+1 */
+        j = addstreams(L, proc, input, inlen, &ps[nstreams], &pidfds[i-1]);
+        for (; j<4; ++j)
+            ps[nstreams + j].done = 1;
+        nstreams += 4;
+    }
+    r = pump(ps, nstreams, -1);
+#if defined(OS_POSIX)
+    for (i=0; i<n; ++i)
+        if (pidfds[i] != -1) close(pidfds[i]);
+#endif
+    if (r){
+        for (i=0; i<nstreams; ++i)
+            free(ps[i].buf.data);
+        return luaL_error(L, "memory full");
+    }
+    lua_createtable(L, n, 0);   /* 5: exit codes */
+    lua_createtable(L, n, 0);   /* 6: stdout */
+    lua_createtable(L, n, 0);   /* 7: stderr */
+    /* the output first, which frees the buffers, then the waits */
+    for (i=1; i<=n; ++i){
+        j = pushoutput(L, &ps[4*(i-1)]);
+        if (!err) err = j;
+        lua_rawseti(L, 7, i);
+        lua_rawseti(L, 6, i);
+    }
+    for (i=1; i<=n; ++i){
+        lua_rawgeti(L, 1, i);
+        waitat(L, -1);
+        lua_rawseti(L, 5, i);
+        lua_pop(L, 1);
+    }
+    if (err) return luaL_error(L, "communicate: %s", strerror(err));
+    return 3;
+}
+
+/* io_engine([name]) */
+static int superio_engine(lua_State *L)
+{
+    int engine = -1;
+    if (!lua_isnoneornil(L, 1)){
+        engine = luaL_checkoption(L, 1, NULL, engine_names);
+#ifndef HAVE_URING
+        if (engine == ENGINE_URING)
+            return luaL_error(L, "io_uring is not supported on this platform");
+#endif
+    }
+#if defined(OS_POSIX)
+    sp_lock();
+#endif
+    lua_pushstring(L, engine_names[io_engine]);
+    if (engine != -1) io_engine = engine;
+#if defined(OS_POSIX)
+    sp_unlock();
+#endif
+    return 1;
+}
+
+/* Live resource usage, read from /proc (Linux only). Once a proc has
+   been sampled, its /proc directory is kept open, so each sample costs an
+   openat and a single read per file, and a pid that is reused later can't
+   be mistaken for it. */
+#ifdef __linux__
+struct sample {
+    char state;
+    unsigned long long utime, stime;    /* clock ticks */
+    long threads;
+    unsigned long long vsize, rss, shared;  /* bytes */
+    long long rchar, wchar;             /* bytes read and written, or -1 */
+    long long read_bytes, write_bytes;  /* the same, for storage only */
+    long processes;
+};
+
+/* A process found by scanprocs */
+struct pentry {
+    pid_t pid, ppid;
+    struct sample s;
+};
+
+/* Read the file name in the directory dirfd into buf, '\0'-terminated,
+   with one read. Returns its length, or -1 with errno set. */
+static ssize_t readat(int dirfd, const char *name, char *buf, size_t size)
+{
+    ssize_t n;
+    int fd, en;
+    if ((fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC)) == -1) return -1;
+    n = read(fd, buf, size - 1);
+    en = errno;
+    close(fd);
+    if (n == -1){
+        errno = en;
+        return -1;
+    }
+    buf[n] = '\0';
+    return n;
+}
+
+/* Parse a stat file into s and *ppid. Returns 0, or -1 if it isn't one. */
+static int parsestat(const char *buf, struct sample *s, pid_t *ppid)
+{
+    const char *p = strrchr(buf, ')');    /* the name may contain anything */
+    int pp;
+    long rss;
+    if (!p || sscanf(p + 1, " %c %d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu %*d %*d %*d %*d %ld %*d %*u %llu %ld",
+                     &s->state, &pp, &s->utime, &s->stime, &s->threads, &s->vsize, &rss) != 7)
+        return -1;
+    s->rss = (unsigned long long) rss * sysconf(_SC_PAGESIZE);
+    s->shared = 0;
+    s->rchar = s->wchar = s->read_bytes = s->write_bytes = -1;
+    s->processes = 1;
+    *ppid = pp;
+    return 0;
+}
+
+/* Read the I/O counters in the directory dirfd into s, if they can be read */
+static void readio(int dirfd, const char *name, struct sample *s)
+{
+    char buf[512];
+    if (readat(dirfd, name, buf, sizeof buf) == -1) return;
+    if (sscanf(buf, "rchar: %lld wchar: %lld syscr: %*d syscw: %*d read_bytes: %lld write_bytes: %lld",
+               &s->rchar, &s->wchar, &s->read_bytes, &s->write_bytes) != 4)
+        s->rchar = s->wchar = s->read_bytes = s->write_bytes = -1;
+}
+
+/* Sample the process whose /proc directory is dirfd. Returns 0, or -1
+   with errno set. */
+static int readsample(int dirfd, struct sample *s)
+{
+    unsigned long long size, resident, shared;
+    long pagesize = sysconf(_SC_PAGESIZE);
+    char buf[1024];
+    pid_t ppid;
+
+    if (readat(dirfd, "stat", buf, sizeof buf) == -1) return -1;
+    if (parsestat(buf, s, &ppid)){
+        errno = EINVAL;
+        return -1;
+    }
+    if (readat(dirfd, "statm", buf, sizeof buf) != -1
+            && sscanf(buf, "%llu %llu %llu", &size, &resident, &shared) == 3){
+        s->vsize = size * pagesize;
+        s->rss = resident * pagesize;
+        s->shared = shared * pagesize;
+    }
+    readio(dirfd, "io", s);
+    return 0;
+}
+
+static int cmpppid(const void *a, const void *b)
+{
+    pid_t x = ((const struct pentry *) a)->ppid, y = ((const struct pentry *) b)->ppid;
+    return x < y ? -1 : x > y;
+}
+
+/* Read the stat of every process, to find descendants. Not every kernel
+   has /proc/<pid>/task/<tid>/children, so all of /proc is looked at, once
+   for all of the procs being sampled. Sets *out to a malloc'd array sorted
+   by ppid, and returns its length, or -1 with errno set. */
+static long scanprocs(struct pentry **out)
+{
+    struct pentry *ents = NULL, *newp;
+    struct dirent *de;
+    char name[64], buf[1024];
+    long n = 0, size = 0;
+    DIR *dir;
+    int en;
+
+    if ((dir = opendir("/proc")) == NULL) return -1;
+    while ((de = readdir(dir)) != NULL){
+        if (!isdigit((unsigned char) de->d_name[0])) continue;
+        if (n == size){
+            size = size ? size * 2 : 256;
+            if ((newp = realloc(ents, size * sizeof *ents)) == NULL){
+                en = errno;
+                free(ents);
+                closedir(dir);
+                errno = en;
+                return -1;
+            }
+            ents = newp;
+        }
+        sprintf(name, "%.20s/stat", de->d_name);
+        /* it may have gone in the meantime */
+        if (readat(dirfd(dir), name, buf, sizeof buf) == -1
+                || parsestat(buf, &ents[n].s, &ents[n].ppid))
+            continue;
+        ents[n++].pid = (pid_t) atol(de->d_name);
+    }
+    closedir(dir);
+    qsort(ents, n, sizeof *ents, cmpppid);
+    *out = ents;
+    return n;
+}
+
+/* Add the usage of every descendant of pid, found in ents (from
+   scanprocs), to s. queue must have room for n + 1 pids: pid, and at
+   most every entry once. */
+static void adddescendants(const struct pentry *ents, long n, pid_t pid, struct sample *s, pid_t *queue)
+{
+    struct sample io;
+    char name[64];
+    long head = 0, tail = 0, lo, hi, mid;
+
+    queue[tail++] = pid;
+    while (head < tail){
+        pid = queue[head++];
+        /* the first entry with this ppid */
+        for (lo = 0, hi = n; lo < hi; ){
+            mid = lo + (hi - lo) / 2;
+            if (ents[mid].ppid < pid) lo = mid + 1;
+            else hi = mid;
+        }
+        for (; lo < n && ents[lo].ppid == pid && tail <= n; ++lo){
+            s->utime += ents[lo].s.utime;
+            s->stime += ents[lo].s.stime;
+            s->threads += ents[lo].s.threads;
+            s->vsize += ents[lo].s.vsize;
+            s->rss += ents[lo].s.rss;
+            s->processes++;
+            sprintf(name, "/proc/%ld/io", (long) ents[lo].pid);
+            io.rchar = -1;
+            readio(AT_FDCWD, name, &io);
+            if (io.rchar != -1 && s->rchar != -1){
+                s->rchar += io.rchar;
+                s->wchar += io.wchar;
+                s->read_bytes += io.read_bytes;
+                s->write_bytes += io.write_bytes;
+            }
+            queue[tail++] = ents[lo].pid;
+        }
+    }
+}
+
+/* Push a table of what is in s */
+static void pushsample(lua_State *L, const struct sample *s)
+{
+    double tick = (double) sysconf(_SC_CLK_TCK);
+    lua_createtable(L, 0, 13);
+    lua_pushnumber(L, (s->utime + s->stime) / tick);
+    lua_setfield(L, -2, "cpu");
+    lua_pushnumber(L, s->utime / tick);
+    lua_setfield(L, -2, "utime");
+    lua_pushnumber(L, s->stime / tick);
+    lua_setfield(L, -2, "stime");
+    lua_pushnumber(L, (lua_Number) s->rss);
+    lua_setfield(L, -2, "rss");
+    lua_pushnumber(L, (lua_Number) s->vsize);
+    lua_setfield(L, -2, "vsize");
+    lua_pushnumber(L, (lua_Number) s->shared);
+    lua_setfield(L, -2, "shared");
+    lua_pushinteger(L, s->threads);
+    lua_setfield(L, -2, "threads");
+    lua_pushinteger(L, s->processes);
+    lua_setfield(L, -2, "processes");
+    lua_pushlstring(L, &s->state, 1);
+    lua_setfield(L, -2, "state");
+    if (s->rchar != -1){
+        lua_pushnumber(L, (lua_Number) s->rchar);
+        lua_setfield(L, -2, "rchar");
+        lua_pushnumber(L, (lua_Number) s->wchar);
+        lua_setfield(L, -2, "wchar");
+        lua_pushnumber(L, (lua_Number) s->read_bytes);
+        lua_setfield(L, -2, "read_bytes");
+        lua_pushnumber(L, (lua_Number) s->write_bytes);
+        lua_setfield(L, -2, "write_bytes");
+    }
+}
+
+/* Sample proc, adding its descendants from ents if ents isn't NULL.
+   Pushes the sample and returns 0, or returns an errno. */
+static int sampleproc(lua_State *L, struct proc *proc, const struct pentry *ents, long n, pid_t *queue)
+{
+    struct sample s;
+    char name[64];
+    if (proc->done) return ESRCH;
+    if (proc->procfd == -1){
+        sprintf(name, "/proc/%ld", (long) proc->pid);
+        if ((proc->procfd = open(name, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1)
+            return errno;
+    }
+    if (readsample(proc->procfd, &s)) return errno;
+    if (ents) adddescendants(ents, n, proc->pid, &s, queue);
+    pushsample(L, &s);
+    return 0;
+}
+
+/* Find the descendants of every process, if descendants is set. Pushes
+   an array of the entries and a queue for adddescendants (as userdata, so
+   that they are freed on error), or two nils. */
+static long pushdescendants(lua_State *L, int descendants, struct pentry **ents, pid_t **queue)
+{
+    struct pentry *p;
+    long n = 0;
+    *ents = NULL;
+    *queue = NULL;
+    if (descendants && (n = scanprocs(&p)) != -1){
+        *ents = lua_newuserdata(L, n * sizeof *p + 1);
+        memcpy(*ents, p, n * sizeof *p);
+        free(p);
+        *queue = lua_newuserdata(L, (n + 1) * sizeof **queue);
+    } else {
+        lua_pushnil(L);
+        lua_pushnil(L);
+    }
+    return n;
+}
+#endif
+
+/* proc:sample([descendants]) */
+static int proc_sample(lua_State *L)
+#ifdef __linux__
+{
+    struct proc *proc = checkproc(L, 1);
+    struct pentry *ents;
+    pid_t *queue;
+    long n;
+    int en;
+
+    n = pushdescendants(L, lua_toboolean(L, 2), &ents, &queue);
+    if ((en = sampleproc(L, proc, ents, n, queue)) == 0) return 1;
+    lua_pushnil(L);
+    lua_pushstring(L, en == ESRCH ? "process has finished" : strerror(en));
+    lua_pushinteger(L, en);
+    return 3;
+}
+#else
+{
+    checkproc(L, 1);
+    lua_pushnil(L);
+    lua_pushliteral(L, "sample is not supported on this platform");
+    return 2;
+}
+#endif
+
+/* sample_all([descendants]) */
+static int sample_all(lua_State *L)
+#ifdef __linux__
+{
+    struct pentry *ents;
+    struct proc *proc;
+    pid_t *queue;
+    long n;
+
+    n = pushdescendants(L, lua_toboolean(L, 1), &ents, &queue);
+    lua_newtable(L);                    /* stack: ents queue result */
+    luaL_getmetatable(L, SP_LIST);      /* stack: ents queue result list */
+    if (lua_isnil(L, -1)) return luaL_error(L, "SP_LIST is nil");
+    lua_pushnil(L);
+    while (lua_next(L, -2)){            /* stack: ents queue result list pid proc */
+        proc = toproc(L, -1);
+        if (proc && sampleproc(L, proc, ents, n, queue) == 0){
+            lua_pushvalue(L, -2);
+            lua_insert(L, -2);          /* stack: ... pid proc proc sample */
+            lua_rawset(L, -6);
+        }
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+    return 1;
+}
+#else
+{
+    lua_pushnil(L);
+    lua_pushliteral(L, "sample_all is not supported on this platform");
+    return 2;
+}
+#endif
+
+static const luaL_Reg proc_meta[] = {
+    {"__tostring", proc_tostring},
+    {"__gc", proc_gc},
+    {NULL, NULL}
+};
+
+static const luaL_Reg proc_methods[] = {
+    {"poll", proc_poll},
+    {"wait", proc_wait},
+    {"communicate", proc_communicate},
+    {"sample", proc_sample},
+#if defined(OS_POSIX)
+    {"send_signal", proc_send_signal},
+    {"terminate", proc_terminate},
+    {"kill", proc_kill},
+    {"kill_group", proc_kill_group},
+#elif defined(OS_WINDOWS)
+    {"terminate", proc_terminate},
+    {"kill", proc_terminate},
+#endif
+    {NULL, NULL}
+};
+
+/* convenience functions */
+static int call(lua_State *L)
+{
+    double timeout, grace;
+    int r;
+    checkargs(L, 0);
+    gettimeout(L, &timeout, &grace);
+    r = superpopen(L);
+    if (r != 1){
+        return r;
+    }
+    lua_replace(L, 1);
+    lua_settop(L, 1);
+    if (timeout >= 0 && pumpwait(L, 1, NULL, 0, timeout, grace)){
+        proc_wait(L);
+        return pushtimeout(L, 1);
+    }
+    return proc_wait(L);
+}
+
+/* Output kept by capture={head=N, tail=N}: the first head bytes, and the
+   last tail bytes in a ring */
+struct ring {
+    char *data;             /* headmax bytes, then tailmax bytes */
+    size_t headmax, tailmax;
+    size_t headlen;
+    size_t tailpos;         /* where the next byte of the tail goes */
+    size_t taillen;
+    size_t total;           /* bytes seen */
+    const char *path;       /* file to open for file */
+    FILE *file;             /* if not NULL, everything is written here too */
+    int err;                /* error number, if writing to file failed */
+};
+
+/* pstream sink that keeps what has been read in a ring */
+static int sink_ring(struct pstream *ps)
+{
+    struct ring *r = ps->ud;
+    const char *p = ps->buf.data;
+    size_t len = ps->buf.len, n;
+    char *tail;
+
+    ps->buf.len = 0;
+    if (len == 0) return 0;
+    r->total += len;
+    if (r->file && !r->err && fwrite(p, 1, len, r->file) != len)
+        r->err = errno ? errno : EIO;
+    n = r->headmax - r->headlen;
+    if (n > len) n = len;
+    memcpy(r->data + r->headlen, p, n);
+    r->headlen += n;
+    p += n;
+    len -= n;
+    if (len == 0 || r->tailmax == 0) return 0;
+    tail = r->data + r->headmax;
+    if (len >= r->tailmax){
+        memcpy(tail, p + len - r->tailmax, r->tailmax);
+        r->tailpos = 0;
+        r->taillen = r->tailmax;
+        return 0;
+    }
+    n = r->tailmax - r->tailpos;
+    if (n > len) n = len;
+    memcpy(tail + r->tailpos, p, n);
+    memcpy(tail, p + n, len - n);
+    r->tailpos = (r->tailpos + len) % r->tailmax;
+    r->taillen = r->taillen + len > r->tailmax ? r->tailmax : r->taillen + len;
+    return 0;
+}
+
+/* Read the option name (a capture table) from the args at 1 into r.
+   Returns 0 if it is not set. */
+static int getcapture(lua_State *L, const char *name, struct ring *r)
+{
+    lua_Integer head, tail;
+
+    memset(r, 0, sizeof *r);
+    lua_getfield(L, 1, name);
+    if (lua_isnil(L, -1)){
+        lua_pop(L, 1);
+        return 0;
+    }
+    if (!lua_istable(L, -1)) return luaL_error(L, "%s must be a table", name);
+    lua_getfield(L, -1, "head");
+    head = lua_tointeger(L, -1);
+    lua_getfield(L, -2, "tail");
+    tail = lua_tointeger(L, -1);
+    if (head < 0 || tail < 0)
+        return luaL_error(L, "%s: head and tail must not be negative", name);
+    r->headmax = (size_t) head;
+    r->tailmax = (size_t) tail;
+    lua_getfield(L, -3, "file");
+    if (lua_type(L, -1) == LUA_TSTRING){
+        r->path = lua_tostring(L, -1);  /* still referenced by args */
+    } else if (!lua_isnil(L, -1)){
+        r->file = liolib_copy_tofile(L, -1);
+        if (!r->file) return luaL_error(L, "%s: file must be a file or a file name", name);
+    }
+    lua_pop(L, 4);
+    return 1;
+}
+
+/* Push the table for what r kept: {head=..., tail=..., total=...} */
+static void pushring(lua_State *L, struct ring *r)
+{
+    char *tail = r->data + r->headmax;
+    lua_createtable(L, 0, 3);
+    lua_pushlstring(L, r->data, r->headlen);
+    lua_setfield(L, -2, "head");
+    if (r->taillen < r->tailmax){
+        lua_pushlstring(L, tail, r->taillen);
+    } else {
+        lua_pushlstring(L, tail + r->tailpos, r->tailmax - r->tailpos);
+        lua_pushlstring(L, tail, r->tailpos);
+        lua_concat(L, 2);
+    }
+    lua_setfield(L, -2, "tail");
+    lua_pushnumber(L, (lua_Number) r->total);
+    lua_setfield(L, -2, "total");
+}
+
+/* Finish writing the file of r, if it has one */
+static void closering(struct ring *r)
+{
+    if (!r->file) return;
+    if (fflush(r->file) != 0 && !r->err) r->err = errno;
+    if (r->path) fclose(r->file);
+    r->file = NULL;
+}
+
+#if defined(OS_POSIX)
+/* Lua registry key for capture object metatable */
+#define SP_CAPTURE_META "subprocess_capture*"
+
+/* Output kept by spill_threshold=N: in memory while there is at most N
+   bytes of it, then in an unlinked temporary file */
+struct capture {
+    char *data;         /* the output, if it is in memory (malloc'd) */
+    size_t len;         /* bytes of output */
+    size_t threshold;
+    int fd;             /* the temporary file, or -1 */
+    char *path;         /* its name, if it has one to unlink (malloc'd) */
+    void *map;          /* the file mapped, or NULL */
+    size_t maplen;
+    int err;            /* error number, if spilling failed */
+};
+
+#define checkcapture(L, index) ((struct capture *) luaL_checkudata((L), (index), SP_CAPTURE_META))
+
+/* Push a new, empty capture object */
+static struct capture *newcapture(lua_State *L, size_t threshold)
+{
+    struct capture *c = lua_newuserdata(L, sizeof *c);
+    memset(c, 0, sizeof *c);
+    c->threshold = threshold;
+    c->fd = -1;
+    luaL_getmetatable(L, SP_CAPTURE_META);
+    lua_setmetatable(L, -2);
+    return c;
+}
+
+/* Make the temporary file of c. Returns -1 (with errno set) on failure. */
+static int capture_open(struct capture *c)
+{
+    const char *dir = getenv("TMPDIR");
+    if (!dir || !*dir) dir = "/tmp";
+#ifdef O_TMPFILE
+    c->fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (c->fd != -1) return 0;
+    /* not every file system can do that */
+#endif
+    if ((c->path = malloc(strlen(dir) + sizeof "/luasubprocessXXXXXX")) == NULL){
+        errno = ENOMEM;
+        return -1;
+    }
+    sprintf(c->path, "%s/luasubprocessXXXXXX", dir);
+#ifdef __linux__
+    c->fd = mkostemp(c->path, O_CLOEXEC);
+#else
+    if ((c->fd = mkstemp(c->path)) != -1) fcntl(c->fd, F_SETFD, FD_CLOEXEC);
+#endif
+    if (c->fd == -1){
+        free(c->path);
+        c->path = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+/* pstream sink that keeps what has been read in a capture, moving it to
+   the file once it's over the threshold */
+static int sink_spill(struct pstream *ps)
+{
+    struct capture *c = ps->ud;
+    int spilled = 0;
+
+    if (c->err){
+        ps->buf.len = 0;
+        return 0;
+    }
+    if (c->fd == -1){
+        if (ps->buf.len <= c->threshold){
+            if (ps->done){
+                /* it all fitted: keep the buffer */
+                c->data = ps->buf.data;
+                c->len = ps->buf.len;
+                memset(&ps->buf, 0, sizeof ps->buf);
             }
-            lua_pop(L, 1);
+            return 0;
+        }
+        if (capture_open(c) == -1){
+            c->err = errno;
+            ps->buf.len = 0;
+            return 0;
         }
+        spilled = 1;
+    }
+    if (writeall(c->fd, ps->buf.data, ps->buf.len) == -1) c->err = errno;
+    c->len += ps->buf.len;
+    ps->buf.len = 0;
+    if (spilled){
+        /* from now on it only has to hold one read */
+        free(ps->buf.data);
+        memset(&ps->buf, 0, sizeof ps->buf);
     }
+    return 0;
+}
 
-    result = dopopen(args, executable, fdinfo, close_fds, binary, cwd, proc, pipe_ends, errmsg_buf, 255);
-    /*for (i=0; i<3; ++i)
-        if (fdinfo[i].mode == FDMODE_FILENAME)
-            free(fdinfo[i].info.filename);
-    free(executable);
-    freestrings(args, nargs);
-    free(args);*/
-    if (result == -1){
-        /* failed */
-        return luaL_error(L, "popen failed: %s", errmsg_buf);
+/* Return the data of c, mapping the file if needed. Returns NULL (with
+   errno set) if it can't be mapped. */
+static const char *capture_data(struct capture *c)
+{
+    void *p;
+    if (c->fd == -1 || c->len == 0) return c->data ? c->data : "";
+    if (!c->map){
+        p = mmap(NULL, c->len, PROT_READ, MAP_SHARED, c->fd, 0);
+        if (p == MAP_FAILED) return NULL;
+        c->map = p;
+        c->maplen = c->len;
     }
+    return c->map;
+}
 
-    /* Put pipe objects in proc userdata's environment */
-    lua_getfenv(L, 2);
-    for (i=0; i<3; ++i){
-        if (pipe_ends[i]){
-            *liolib_copy_newfile(L) = pipe_ends[i];
-            lua_setfield(L, -2, fd_names[i]);
-        }
+/* capture:size() */
+static int capture_size(lua_State *L)
+{
+    struct capture *c = checkcapture(L, 1);
+    lua_pushnumber(L, (lua_Number) c->len);
+    return 1;
+}
+
+/* capture:spilled() */
+static int capture_spilled(lua_State *L)
+{
+    struct capture *c = checkcapture(L, 1);
+    lua_pushboolean(L, c->fd != -1);
+    return 1;
+}
+
+/* capture:string() */
+static int capture_string(lua_State *L)
+{
+    struct capture *c = checkcapture(L, 1);
+    const char *data = capture_data(c);
+    if (!data) return luaL_error(L, "capture: %s", strerror(errno));
+    lua_pushlstring(L, data, c->len);
+    return 1;
+}
+
+/* capture:sub(i, [j]), like string.sub */
+static int capture_sub(lua_State *L)
+{
+    struct capture *c = checkcapture(L, 1);
+    lua_Number len = (lua_Number) c->len;
+    lua_Number i = luaL_checknumber(L, 2);
+    lua_Number j = luaL_optnumber(L, 3, -1);
+    const char *data;
+
+    if (i < 0) i += len + 1;
+    if (j < 0) j += len + 1;
+    if (i < 1) i = 1;
+    if (j > len) j = len;
+    if (i > j){
+        lua_pushliteral(L, "");
+        return 1;
     }
-    lua_pop(L, 1);
+    if ((data = capture_data(c)) == NULL)
+        return luaL_error(L, "capture: %s", strerror(errno));
+    lua_pushlstring(L, data + (size_t) i - 1, (size_t) (j - i) + 1);
+    return 1;
+}
 
-    /* Put proc object in SP_LIST table */
-    luaL_getmetatable(L, SP_LIST);
-    if (lua_isnil(L, -1)){
-        fputs("subprocess.c: XXX: SP_LIST IS NIL\n", stderr);
-    } else {
-        lua_pushinteger(L, proc->pid); /* stack: list pid */
-        lua_pushvalue(L, 2);           /* stack: list pid proc */
-        lua_settable(L, -3);           /* stack: list */
+/* capture:path() */
+static int capture_path(lua_State *L)
+{
+    struct capture *c = checkcapture(L, 1);
+    if (c->fd == -1) lua_pushnil(L);
+    else if (c->path) lua_pushstring(L, c->path);
+    else lua_pushfstring(L, "/proc/%d/fd/%d", (int) getpid(), c->fd);
+    return 1;
+}
+
+/* capture:file() */
+static int capture_file(lua_State *L)
+{
+    struct capture *c = checkcapture(L, 1);
+    char name[64];
+    FILE **pf;
+    int fd;
+
+    if (c->fd == -1){
+        lua_pushnil(L);
+        return 1;
+    }
+    pf = liolib_copy_newfile(L);
+    /* a descriptor of its own, so that it has its own position */
+    if (!c->path) sprintf(name, "/proc/self/fd/%d", c->fd);
+    fd = open(c->path ? c->path : name, O_RDONLY | O_CLOEXEC);
+    if (fd == -1 || (*pf = fdopen(fd, "rb")) == NULL){
+        if (fd != -1) close(fd);
+        lua_pushnil(L);
+        lua_pushfstring(L, "capture: %s", strerror(errno));
+        return 2;
     }
-    lua_pop(L, 1);
-        
-    /* Return the proc */
-    lua_settop(L, 2);
     return 1;
 }
 
-/* __gc */
-static int proc_gc(lua_State *L)
+/* capture:close(), and __gc */
+static int capture_close(lua_State *L)
 {
-    struct proc *proc = checkproc(L, 1);
-    if (!proc->done){
-#if defined(OS_POSIX)
-        /* Try to wait for process to avoid leaving zombie.
-           If the process hasn't finished yet, we'll end up leaving a zombie. */
-        int stat;
-        waitpid(proc->pid, &stat, WNOHANG);
-#elif defined(OS_WINDOWS)
-        CloseHandle(proc->hProcess);
+    struct capture *c = checkcapture(L, 1);
+    free(c->data);
+    c->data = NULL;
+    if (c->map) munmap(c->map, c->maplen);
+    c->map = NULL;
+    if (c->fd != -1) close(c->fd);
+    c->fd = -1;
+    if (c->path){
+        unlink(c->path);
+        free(c->path);
+        c->path = NULL;
+    }
+    c->len = 0;
+    return 0;
+}
+
+static const luaL_Reg capture_meta[] = {
+    {"__len", capture_size},
+    {"__gc", capture_close},
+    {NULL, NULL}
+};
+
+static const luaL_Reg capture_methods[] = {
+    {"size", capture_size},
+    {"spilled", capture_spilled},
+    {"string", capture_string},
+    {"sub", capture_sub},
+    {"path", capture_path},
+    {"file", capture_file},
+    {"close", capture_close},
+    {NULL, NULL}
+};
 #endif
-        doneproc(L, 1);
+
+/* Lines kept by filter=patterns: the lines that match are moved down to
+   the start of the stream's buffer as they are found */
+struct filter {
+    struct liolib_copy_pats pats;
+    int invert;
+    size_t kept;        /* bytes of matching lines at the start of buf */
+    size_t seen;        /* bytes of buf already looked at for a newline */
+};
+
+/* pstream sink that only keeps the lines that match a filter */
+static int sink_filter(struct pstream *ps)
+{
+    struct filter *fl = ps->ud;
+    char *data = ps->buf.data;
+    size_t len = ps->buf.len, complete, pos, out, n;
+    const char *line;
+
+    /* only what has just been read can finish a line */
+    complete = len;
+    if (!ps->done){
+        while (complete > fl->seen && data[complete-1] != '\n') --complete;
+        if (complete <= fl->seen){
+            fl->seen = len;
+            return 0;
+        }
     }
+    liolib_copy_resetpats(&fl->pats);
+    pos = out = fl->kept;
+    while ((line = liolib_copy_nextmatch(&fl->pats, data, complete, &pos, fl->invert, NULL, &n)) != NULL){
+        memmove(data + out, line, n);
+        out += n;
+        if (line + n < data + complete) data[out++] = '\n';
+    }
+    memmove(data + out, data + complete, len - complete);
+    ps->buf.len = out + len - complete;
+    fl->kept = out;
+    fl->seen = ps->buf.len;
     return 0;
 }
 
-/* __index */
-static int proc_index(lua_State *L)
+/* Output kept by timeline=...: each line (or chunk) of stdout and stderr,
+   with the time it was read and the stream it came from, in the order
+   they were read. The text of all of them is kept together in text. */
+struct tlentry {
+    double t;           /* seconds since start */
+    int stream;         /* 1 for stdout, 2 for stderr */
+    size_t off, len;    /* in text */
+};
+
+struct timeline;
+
+/* What each stream's sink gets as ud */
+struct tlstream {
+    struct timeline *tl;
+    int stream;
+};
+
+#define SP_TIMELINE_META "subprocess_timeline*"
+
+struct timeline {
+    double start;
+    int lines;                  /* split into lines, rather than chunks */
+    struct tlentry *ents;
+    size_t n, size;
+    struct membuf text;
+    struct tlstream streams[2];
+    int err;                    /* ENOMEM, if something was dropped */
+};
+
+/* Record len bytes at data as read from stream at time t */
+static void timeline_add(struct timeline *tl, int stream, double t, const char *data, size_t len)
 {
-    struct proc *proc;
-    const char *s;
-    lua_settop(L, 2);
-    proc = checkproc(L, 1);
-    /* first check environment table */
-    lua_getfenv(L, 1);
-    lua_pushvalue(L, 2);
-    lua_gettable(L, 3);
-    if (!lua_isnil(L, 4)) return 1;
-    lua_pop(L, 2);
-    /* next check metatable */
-    lua_getmetatable(L, 1);
-    lua_pushvalue(L, 2);
-    lua_gettable(L, 3);
-    if (!lua_isnil(L, 4)) return 1;
-    lua_pop(L, 2);
-    /* lastly, fixed fields */
-    s = lua_tostring(L, 2);
-    if (!strcmp(s, "pid")){
-        lua_pushinteger(L, proc->pid);
-        return 1;
-    } else if (!strcmp(s, "exitcode") && proc->done){
-        lua_pushinteger(L, proc->exitcode);
-        return 1;
-    } else {
+    struct tlentry *newp;
+    size_t size;
+    if (tl->err) return;
+    if (tl->n == tl->size){
+        size = tl->size ? tl->size * 2 : 256;
+        if ((newp = realloc(tl->ents, size * sizeof *newp)) == NULL){
+            tl->err = ENOMEM;
+            return;
+        }
+        tl->ents = newp;
+        tl->size = size;
+    }
+    if (membuf_reserve(&tl->text, len)){
+        tl->err = ENOMEM;
+        return;
+    }
+    memcpy(tl->text.data + tl->text.len, data, len);
+    tl->ents[tl->n].t = t;
+    tl->ents[tl->n].stream = stream;
+    tl->ents[tl->n].off = tl->text.len;
+    tl->ents[tl->n].len = len;
+    tl->text.len += len;
+    ++tl->n;
+}
+
+/* pstream sink that records what has been read in a timeline, as chunks
+   or as lines (without their newlines). A line's time is when its newline
+   was read. */
+static int sink_timeline(struct pstream *ps)
+{
+    struct tlstream *ts = ps->ud;
+    struct timeline *tl = ts->tl;
+    char *data = ps->buf.data, *nl;
+    size_t len = ps->buf.len, start = 0;
+    double t;
+
+    if (len == 0) return 0;
+    t = monotime() - tl->start;
+    if (!tl->lines){
+        timeline_add(tl, ts->stream, t, data, len);
+        ps->buf.len = 0;
         return 0;
     }
+    while ((nl = memchr(data + start, '\n', len - start)) != NULL){
+        timeline_add(tl, ts->stream, t, data + start, nl - (data + start));
+        start = nl - data + 1;
+    }
+    /* an unterminated last line */
+    if (ps->done && start < len){
+        timeline_add(tl, ts->stream, t, data + start, len - start);
+        start = len;
+    }
+    memmove(data, data + start, len - start);
+    ps->buf.len = len - start;
+    return 0;
 }
 
-/* Push string representation of process on stack */
-static int proc_tostring(lua_State *L)
+/* __gc */
+static int timeline_gc(lua_State *L)
 {
-    struct proc *proc = checkproc(L, 1);
-    if (proc->done)
-        lua_pushliteral(L, "(finished process)");
-    else
-        lua_pushfstring(L, "process (%d)", (int) proc->pid);
-    return 1;
+    struct timeline *tl = luaL_checkudata(L, 1, SP_TIMELINE_META);
+    free(tl->ents);
+    free(tl->text.data);
+    tl->ents = NULL;
+    tl->text.data = NULL;
+    tl->n = tl->size = 0;
+    return 0;
 }
 
-#if defined(OS_POSIX)
-/* Get exitcode from wait's 'stat' value */
-static int getexitcode(int stat)
+static int cmpdouble(const void *a, const void *b)
 {
-    if (WIFEXITED(stat))
-        return WEXITSTATUS(stat);
-    else if (WIFSIGNALED(stat))
-        return -WTERMSIG(stat);
-    else if (WIFSTOPPED(stat))
-        return -WSTOPSIG(stat);
-    else {
-        fputs("child disappeared into black hole\n", stderr);
-        return -1;
+    double x = *(const double *) a, y = *(const double *) b;
+    return x < y ? -1 : x > y;
+}
+
+/* Latencies of one stream's entries: the time from the one before (or
+   from the start, for the first) */
+struct tlstats {
+    size_t count;
+    double first, last, total, min, max, p50, p90, p99;
+};
+
+/* Work out the stats of stream's entries. Returns -1 if out of memory. */
+static int timeline_stats(const struct timeline *tl, int stream, struct tlstats *st)
+{
+    double *gaps, prev = 0;
+    size_t i, n = 0;
+
+    memset(st, 0, sizeof *st);
+    if ((gaps = malloc((tl->n ? tl->n : 1) * sizeof *gaps)) == NULL) return -1;
+    for (i=0; i<tl->n; ++i){
+        if (tl->ents[i].stream != stream) continue;
+        if (n == 0) st->first = tl->ents[i].t;
+        gaps[n++] = tl->ents[i].t - prev;
+        st->last = prev = tl->ents[i].t;
     }
+    st->count = n;
+    if (n > 0){
+        qsort(gaps, n, sizeof *gaps, cmpdouble);
+        for (i=0; i<n; ++i) st->total += gaps[i];
+        st->min = gaps[0];
+        st->max = gaps[n-1];
+        /* nearest rank */
+        st->p50 = gaps[(n * 50 + 99) / 100 - 1];
+        st->p90 = gaps[(n * 90 + 99) / 100 - 1];
+        st->p99 = gaps[(n * 99 + 99) / 100 - 1];
+    }
+    free(gaps);
+    return 0;
 }
-#endif
 
-/* Wait for, or poll, a process */
-static int do_waitpid(lua_State *L, struct proc *proc, int wait)
-#if defined(OS_POSIX)
+/* Push a timeline as {time={...}, stream={...}, text={...}, [stats=...]} */
+static void pushtimeline(lua_State *L, const struct timeline *tl, int stats)
 {
-    int stat, options;
+    static const char *const names[2] = {"stdout", "stderr"};
+    struct tlstats st[2];
+    size_t i;
+    int j;
 
-    if (proc->done){
-        lua_pushinteger(L, proc->exitcode);
-        return 1;
+    for (j=0; j<2 && stats; ++j)
+        if (timeline_stats(tl, j + 1, &st[j])) luaL_error(L, "memory full");
+    lua_createtable(L, 0, 4);
+    lua_createtable(L, (int) tl->n, 0);
+    for (i=0; i<tl->n; ++i){
+        lua_pushnumber(L, tl->ents[i].t);
+        lua_rawseti(L, -2, (int) i + 1);
+    }
+    lua_setfield(L, -2, "time");
+    lua_createtable(L, (int) tl->n, 0);
+    for (i=0; i<tl->n; ++i){
+        lua_pushinteger(L, tl->ents[i].stream);
+        lua_rawseti(L, -2, (int) i + 1);
+    }
+    lua_setfield(L, -2, "stream");
+    lua_createtable(L, (int) tl->n, 0);
+    for (i=0; i<tl->n; ++i){
+        lua_pushlstring(L, tl->text.data + tl->ents[i].off, tl->ents[i].len);
+        lua_rawseti(L, -2, (int) i + 1);
+    }
+    lua_setfield(L, -2, "text");
+    if (!stats) return;
+    lua_createtable(L, 0, 2);
+    for (j=0; j<2; ++j){
+        lua_createtable(L, 0, 9);
+        lua_pushinteger(L, (lua_Integer) st[j].count);
+        lua_setfield(L, -2, "count");
+        if (st[j].count > 0){
+            lua_pushnumber(L, st[j].first);
+            lua_setfield(L, -2, "first");
+            lua_pushnumber(L, st[j].last);
+            lua_setfield(L, -2, "last");
+            lua_pushnumber(L, st[j].min);
+            lua_setfield(L, -2, "min");
+            lua_pushnumber(L, st[j].max);
+            lua_setfield(L, -2, "max");
+            lua_pushnumber(L, st[j].total / st[j].count);
+            lua_setfield(L, -2, "mean");
+            lua_pushnumber(L, st[j].p50);
+            lua_setfield(L, -2, "p50");
+            lua_pushnumber(L, st[j].p90);
+            lua_setfield(L, -2, "p90");
+            lua_pushnumber(L, st[j].p99);
+            lua_setfield(L, -2, "p99");
+        }
+        lua_setfield(L, -2, names[j]);
     }
+    lua_setfield(L, -2, "stats");
+}
 
-    if (wait) options = 0;
-    else options = WNOHANG;
-    switch (waitpid(proc->pid, &stat, options)){
-        case -1:
-            return luaL_error(L, strerror(errno));
-        case 0:
-            /* child still running */
+static int call_capture(lua_State *L)
+{
+    static const char *const names[2] = {"capture", "capture_stderr"};
+    struct keep keep[2];
+    struct ring rings[2];
+    struct filter filter;
+    struct timeline *tl = NULL;
+    lua_Integer spill;
+    double timeout, grace, start = 0;
+    int i, r, errpipe, filtered, timedout, lines = 0, timelined, stats = 0, err = 0;
+#if defined(OS_POSIX)
+    struct capture *caps[2] = {NULL, NULL};
+#endif
+    checkargs(L, 1);    /* our own copy, so we can change stdout */
+    gettimeout(L, &timeout, &grace);
+    memset(keep, 0, sizeof keep);
+    lua_getfield(L, 1, "max_stdout");
+    keep[0].max = (size_t) lua_tointeger(L, -1);
+    lua_getfield(L, 1, "max_stderr");
+    keep[1].max = (size_t) lua_tointeger(L, -1);
+    lua_getfield(L, 1, "timeline");
+    if (lua_isboolean(L, -1) || (lua_isstring(L, -1) && !strcmp(lua_tostring(L, -1), "lines")))
+        lines = lua_toboolean(L, -1);
+    else if (!lua_isnil(L, -1) && (!lua_isstring(L, -1) || strcmp(lua_tostring(L, -1), "chunks")))
+        return luaL_error(L, "timeline must be true, \"lines\" or \"chunks\"");
+    timelined = lines || (!lua_isnil(L, -1) && !lua_isboolean(L, -1));
+    lua_getfield(L, 1, "timeline_stats");
+    stats = lua_toboolean(L, -1);
+    lua_getfield(L, 1, "stderr");
+    if (timelined && lua_isnil(L, -1)){
+        /* both streams, by default */
+        lua_pushlightuserdata(L, &PIPE);
+        lua_setfield(L, 1, "stderr");
+    }
+    lua_pop(L, 3);
+    lua_getfield(L, 1, "stderr");
+    errpipe = lua_touserdata(L, -1) == &PIPE;
+    lua_getfield(L, 1, "spill_threshold");
+    spill = lua_isnil(L, -1) ? -1 : lua_tointeger(L, -1);
+    lua_getfield(L, 1, "filter");
+    if ((filtered = !lua_isnil(L, -1)) != 0){
+        /* check the patterns now, rather than once the child is running */
+        liolib_copy_getpats(L, -1, &filter.pats);
+        lua_pop(L, 1);
+        lua_getfield(L, 1, "capture");
+        if (spill != -1 || !lua_isnil(L, -1))
+            return luaL_error(L, "filter can't be used with capture or spill_threshold");
+    }
+    lua_pop(L, 5);
+    if (spill != -1){
+#if defined(OS_POSIX)
+        if (spill < 0) return luaL_error(L, "spill_threshold must not be negative");
+        lua_getfield(L, 1, "capture");
+        lua_getfield(L, 1, "capture_stderr");
+        if (keep[0].max || keep[1].max || !lua_isnil(L, -1) || !lua_isnil(L, -2))
+            return luaL_error(L, "spill_threshold can't be used with max_stdout, max_stderr or capture");
+        lua_pop(L, 2);
+#else
+        return luaL_error(L, "spill_threshold is not supported on this platform");
+#endif
+    }
+    if (timelined){
+        lua_getfield(L, 1, "capture");
+        lua_getfield(L, 1, "capture_stderr");
+        if (keep[0].max || keep[1].max || filtered || spill != -1 || !lua_isnil(L, -1) || !lua_isnil(L, -2))
+            return luaL_error(L, "timeline can't be used with max_stdout, max_stderr, capture, filter or spill_threshold");
+        lua_pop(L, 2);
+    }
+    for (i=0; i<2; ++i){
+        if (!getcapture(L, names[i], &rings[i])) continue;
+        if (i == 1 && !errpipe)
+            return luaL_error(L, "capture_stderr needs stderr to be subprocess.PIPE");
+        keep[i].sink = sink_ring;
+        keep[i].ud = &rings[i];
+    }
+    for (i=0; i<2; ++i){
+        if (!keep[i].sink || !rings[i].path) continue;
+        if ((rings[i].file = fopen(rings[i].path, "wb")) == NULL){
+            err = errno;
+            if (i == 1) closering(&rings[0]);
             lua_pushnil(L);
-            return 1;
-        default:
-            proc->exitcode = getexitcode(stat);
-            doneproc(L, 1);
-            lua_pushinteger(L, proc->exitcode);
-            return 1;
+            lua_pushfstring(L, "%s: %s", rings[i].path, strerror(err));
+            lua_pushinteger(L, err);
+            return 3;
+        }
+    }
+    lua_pushlightuserdata(L, &PIPE);
+    lua_setfield(L, 1, "stdout");
+    start = monotime();
+    r = superpopen(L);
+    if (r != 1){
+        for (i=0; i<2; ++i)
+            if (keep[i].sink) closering(&rings[i]);
+        return r;
+    }
+    /* stack: args sp */
+    /* the rings' memory belongs to Lua, so that an error can't leak it */
+    for (i=0; i<2; ++i)
+        if (keep[i].sink)
+            rings[i].data = lua_newuserdata(L, rings[i].headmax + rings[i].tailmax);
+    if (filtered){
+        lua_getfield(L, 1, "filter");
+        liolib_copy_getpats(L, -1, &filter.pats);
+        lua_getfield(L, 1, "filter_invert");
+        filter.invert = lua_toboolean(L, -1);
+        lua_pop(L, 1);
+        filter.kept = filter.seen = 0;
+        keep[0].sink = sink_filter;
+        keep[0].ud = &filter;
+    }
+    if (timelined){
+        /* freed by __gc, whatever happens */
+        tl = lua_newuserdata(L, sizeof *tl);
+        memset(tl, 0, sizeof *tl);
+        luaL_getmetatable(L, SP_TIMELINE_META);
+        lua_setmetatable(L, -2);
+        tl->start = start;
+        tl->lines = lines;
+        for (i=0; i<2; ++i){
+            tl->streams[i].tl = tl;
+            tl->streams[i].stream = i + 1;
+            keep[i].sink = sink_timeline;
+            keep[i].ud = &tl->streams[i];
+        }
+    }
+#if defined(OS_POSIX)
+    /* the same for captures, which have to be Lua's to return anyway */
+    for (i=0; i<2 && spill != -1; ++i){
+        if (i == 1 && !errpipe) break;
+        caps[i] = newcapture(L, (size_t) spill);
+        keep[i].sink = sink_spill;
+        keep[i].ud = caps[i];
+    }
+#endif
+    /* read both pipes together and wait for the child */
+    timedout = docommunicate(L, 2, NULL, 0, keep, timeout, grace);
+    if (tl){
+        /* return exitcode, timeline, or nil, "timeout", timeline */
+        if (tl->err) return luaL_error(L, "capture: %s", strerror(tl->err));
+        lua_pop(L, 2);
+        pushtimeline(L, tl, stats);
+        return timedout ? pushtimeout(L, 2) : 2;
+    }
+    /* replace what was captured with rings or captures */
+    for (i=0; i<2; ++i){
+        if (!keep[i].sink || keep[i].sink == sink_filter) continue;
+#if defined(OS_POSIX)
+        if (caps[i]){
+            if (caps[i]->err) err = caps[i]->err;
+            lua_pushvalue(L, 3 + i);
+            lua_replace(L, i == 0 ? -3 : -2);
+            continue;
+        }
+#endif
+        closering(&rings[i]);
+        if (rings[i].err) err = rings[i].err;
+        pushring(L, &rings[i]);
+        lua_replace(L, i == 0 ? -3 : -2);
     }
+    if (err) return luaL_error(L, "capture: %s", strerror(err));
+    /* return exitcode, content[, errcontent], or nil, "timeout", ... */
+    if (!errpipe) lua_pop(L, 1);
+    if (timedout) return pushtimeout(L, errpipe ? 3 : 2);
+    return errpipe ? 3 : 2;
 }
-#elif defined(OS_WINDOWS)
+
+/* State of a stream whose data run hands to a Lua function */
+struct luasink {
+    lua_State *L;
+    int fn;         /* stack index of the function */
+    int tramp;      /* stack index of luasink_tramp */
+    int lines;      /* pass whole lines rather than chunks */
+    int failed;     /* the function raised an error (left on the stack) */
+};
+
+/* Call the function at 1 with the len (3) bytes at data (2). Anything that
+   allocates is done in here, so that an error can't escape from pump. */
+static int luasink_tramp(lua_State *L)
 {
-    DWORD dwMilliseconds, retval, exitcode;
+    lua_pushlstring(L, lua_touserdata(L, 2), (size_t) lua_tonumber(L, 3));
+    lua_replace(L, 2);
+    lua_settop(L, 2);
+    lua_call(L, 1, 0);
+    return 0;
+}
 
-    if (proc->done){
-        lua_pushinteger(L, proc->exitcode);
-        return 1;
-    }
-    if (wait) dwMilliseconds = INFINITE;
-    else dwMilliseconds = 0;
-    retval = WaitForSingleObject(proc->hProcess, dwMilliseconds);
-    switch (retval){
-        case WAIT_FAILED:
-failure:
-            push_w32error(L, GetLastError());
-            return lua_error(L);
-        case WAIT_OBJECT_0:
-            /* child finished */
-            if (GetExitCodeProcess(proc->hProcess, &exitcode) == 0){
-                goto failure;
-            }
-            CloseHandle(proc->hProcess);
-            proc->exitcode = exitcode;
-            doneproc(L, 1);
-            lua_pushinteger(L, proc->exitcode);
-            return 1;
-        case WAIT_TIMEOUT:
-        default:
-            /* child still running */
-            lua_pushnil(L);
-            return 1;
+static int luasink_call(struct luasink *ls, const char *data, size_t len)
+{
+    lua_pushvalue(ls->L, ls->tramp);
+    lua_pushvalue(ls->L, ls->fn);
+    lua_pushlightuserdata(ls->L, (void *) data);
+    lua_pushnumber(ls->L, (lua_Number) len);
+    if (lua_pcall(ls->L, 3, 0, 0) == 0) return 0;
+    ls->failed = 1;
+    return -1;
+}
+
+/* pstream sink that hands what has been read to a Lua function, as it
+   is or split into lines (without their newlines) */
+static int sink_lua(struct pstream *ps)
+{
+    struct luasink *ls = ps->ud;
+    char *data = ps->buf.data, *nl;
+    size_t len = ps->buf.len, start = 0;
+
+    if (len == 0) return 0;
+    if (!ls->lines){
+        ps->buf.len = 0;
+        return luasink_call(ls, data, len);
+    }
+    while ((nl = memchr(data + start, '\n', len - start)) != NULL){
+        if (luasink_call(ls, data + start, nl - (data + start))) return -1;
+        start = nl - data + 1;
     }
+    /* an unterminated last line */
+    if (ps->done && start < len){
+        if (luasink_call(ls, data + start, len - start)) return -1;
+        start = len;
+    }
+    memmove(data, data + start, len - start);
+    ps->buf.len = len - start;
+    return 0;
 }
-#endif
 
-static int proc_poll(lua_State *L)
+/* pstream sink that throws away what has been read */
+static int sink_discard(struct pstream *ps)
 {
-    return do_waitpid(L, checkproc(L, 1), 0);
+    ps->buf.len = 0;
+    return 0;
 }
 
-static int proc_wait(lua_State *L)
+/* run{arg0, ..., [on_stdout=fn], [on_stderr=fn], [chunk_size=n], [lines=bool]} */
+static int run(lua_State *L)
 {
-    return do_waitpid(L, checkproc(L, 1), 1);
+    static const char *const streams[2] = {"stdout", "stderr"};
+    static const char *const callbacks[2] = {"on_stdout", "on_stderr"};
+    struct luasink sinks[2];
+    struct pstream ps[4];
+    struct proc *proc;
+    size_t chunk;
+    int i, n, pidfd, r, lines, err;
+
+    checkargs(L, 1);    /* our own copy, so we can change stdout/stderr */
+    lua_getfield(L, 1, "chunk_size");
+    chunk = (size_t) lua_tointeger(L, -1);
+    lua_getfield(L, 1, "lines");
+    lines = lua_toboolean(L, -1);
+    lua_pop(L, 2);
+    for (i=0; i<2; ++i){
+        lua_getfield(L, 1, callbacks[i]);
+        if (!lua_isnil(L, -1)){
+            if (!lua_isfunction(L, -1))
+                return luaL_error(L, "%s must be a function", callbacks[i]);
+            lua_pushlightuserdata(L, &PIPE);
+            lua_setfield(L, 1, streams[i]);
+        }
+        lua_pop(L, 1);
+    }
+    r = superpopen(L);
+    if (r != 1) return r;
+    lua_getfield(L, 1, callbacks[0]);
+    lua_getfield(L, 1, callbacks[1]);
+    lua_pushcfunction(L, luasink_tramp);
+    /* stack: args sp on_stdout on_stderr tramp */
+    /* room for luasink_call, so that it can't fail inside pump */
+    luaL_checkstack(L, 8, NULL);
+    proc = checkproc(L, 2);
+    n = addstreams(L, proc, NULL, 0, ps, &pidfd);
+    for (i=0; i<2; ++i){
+        if (!ps[i+1].fp) continue;
+        ps[i+1].chunk = chunk;
+        if (lua_isnil(L, 3 + i)){
+            ps[i+1].sink = sink_discard;
+            continue;
+        }
+        sinks[i].L = L;
+        sinks[i].fn = 3 + i;
+        sinks[i].tramp = 5;
+        sinks[i].lines = lines;
+        sinks[i].failed = 0;
+        ps[i+1].sink = sink_lua;
+        ps[i+1].ud = &sinks[i];
+    }
+    r = pump(ps, n, -1);
+#if defined(OS_POSIX)
+    if (pidfd != -1) close(pidfd);
+#endif
+    free(ps[1].buf.data);
+    free(ps[2].buf.data);
+    if (r) return luaL_error(L, "memory full");
+    /* a callback failed: its pipes are closed, and the process is left to
+       be reaped when the proc is collected */
+    for (i=0; i<2; ++i)
+        if (ps[i+1].ud && sinks[i].failed) return lua_error(L);
+    err = ps[1].err ? ps[1].err : ps[2].err;
+    if (err) return luaL_error(L, "run: %s", strerror(err));
+    waitat(L, 2);
+    return 1;
 }
 
+/* Waiting for a set of processes */
+
 #if defined(OS_POSIX)
-static int proc_send_signal(lua_State *L)
+/* Lua registry key for wait set metatable */
+#define SP_WAITSET_META "subprocess_waitset*"
+
+/* Lua registry key for the table of wait sets, which is keyed (weakly)
+   by the proc lists passed to wait_any */
+#define SP_WAITSETS "subprocess_waitsets"
+
+/* A wait set is an epoll instance watching the pidfds of the procs in a
+   list. It is kept for as long as the list exists, so that a call to
+   wait_any only has to add the procs that are new to the list, and the
+   work done when waking up depends only on how many procs finished. */
+struct waitset {
+    int epfd;
+    unsigned id;
+};
+
+static unsigned waitmark;   /* incremented by each waitany call */
+
+static int waitset_gc(lua_State *L)
 {
-    struct proc *proc = checkproc(L, 1);
-    int sig = luaL_checkinteger(L, 2);
-    if (!proc->done){
-        if (kill(proc->pid, sig)){
-            return luaL_error(L, "kill: %s", strerror(errno));
-        }
-        proc->exitcode = -sig;
-        doneproc(L, 1);
+    struct waitset *ws = luaL_checkudata(L, 1, SP_WAITSET_META);
+    if (ws->epfd != -1){
+        close(ws->epfd);
+        ws->epfd = -1;
     }
     return 0;
 }
 
-static int proc_terminate(lua_State *L)
+#ifdef HAVE_PIDFD
+/* Push the wait set for the list at index t, creating it if needed.
+   Returns NULL (and pushes nil) if epoll is not available. */
+static struct waitset *getwaitset(lua_State *L, int t)
 {
-    lua_settop(L, 1);
-    lua_pushinteger(L, SIGTERM);
-    return proc_send_signal(L);
+    static unsigned ids;
+    struct waitset *ws;
+    luaL_getmetatable(L, SP_WAITSETS);
+    lua_pushvalue(L, t);
+    lua_rawget(L, -2);
+    if (!lua_isnil(L, -1)){
+        lua_remove(L, -2);
+        return lua_touserdata(L, -1);
+    }
+    lua_pop(L, 1);
+    ws = lua_newuserdata(L, sizeof *ws);
+    ws->epfd = -1;
+    luaL_getmetatable(L, SP_WAITSET_META);
+    lua_setmetatable(L, -2);
+    ws->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (ws->epfd == -1){
+        lua_pop(L, 2);
+        lua_pushnil(L);
+        return NULL;
+    }
+    sp_lock();
+    ws->id = ++ids;
+    sp_unlock();
+    lua_pushvalue(L, t);
+    lua_pushvalue(L, -2);           /* stack: waitsets ws list ws */
+    lua_rawset(L, -4);
+    lua_remove(L, -2);
+    return ws;
 }
+#endif
 
-static int proc_kill(lua_State *L)
+/* Reap a proc (at index) if it has finished, without blocking.
+   Returns 1 if it was reaped. If exited is set, the process is known to
+   have exited, and we may wait for the fork server to tell us so. */
+static int reapproc(lua_State *L, int index, struct proc *proc, int exited)
 {
-    lua_settop(L, 1);
-    lua_pushinteger(L, SIGKILL);
-    return proc_send_signal(L);
+    int stat;
+    pid_t pid = sp_waitpid(proc->pid, &stat, exited ? 0 : WNOHANG);
+    if (pid == -1 && errno != EINTR)
+        return luaL_error(L, "waitpid: %s", strerror(errno));
+    if (pid <= 0) return 0;
+    proc->exitcode = getexitcode(stat);
+    doneproc(L, index);
+    return 1;
+}
+#endif
+
+/* Wait until at least one of the procs in the list at index t has
+   finished, or until timeout seconds have passed (no limit if timeout is
+   negative). Every proc that is found to have finished is appended to
+   the table at index r. */
+static void waitany(lua_State *L, int t, double timeout, int r)
+#if defined(OS_POSIX)
+{
+    struct proc *proc;
+    struct waitset *ws = NULL;
+#ifdef HAVE_PIDFD
+    struct epoll_event ev, events[64];
+    int count, j, ms;
+#endif
+    int i, n, nres = 0, polling = 0;
+    unsigned mark;
+    double deadline = monotime() + timeout, delay = 0.001, left;
+    struct timespec ts;
+
+    sp_lock();
+    mark = ++waitmark;
+    sp_unlock();
+    lua_checkstack(L, 6);
+    n = lua_objlen(L, t);
+#ifdef HAVE_PIDFD
+    ws = getwaitset(L, t);
+#else
+    lua_pushnil(L);
+#endif
+    if (!ws) polling = 1;
+
+    /* collect procs that have already finished, and make sure the rest
+       are being watched */
+    for (i=1; i<=n; ++i){
+        lua_rawgeti(L, t, i);
+        proc = toproc(L, -1);
+        if (!proc) luaL_error(L, "wait_any: item %d is not a proc", i);
+        if (proc->done){
+            lua_rawseti(L, r, ++nres);
+            continue;
+        }
+        proc->waitmark = mark;
+#ifdef HAVE_PIDFD
+        if (ws && proc->waitset != ws->id){
+            if (proc->pidfd == -1)
+                proc->pidfd = syscall(SYS_pidfd_open, proc->pid, 0);
+            ev.events = EPOLLIN;
+            ev.data.u64 = proc->pid;
+            if (proc->pidfd == -1
+                || (epoll_ctl(ws->epfd, EPOLL_CTL_ADD, proc->pidfd, &ev) && errno != EEXIST))
+            {
+                polling = 1;
+            } else {
+                proc->waitset = ws->id;
+            }
+        }
+#endif
+        lua_pop(L, 1);
+    }
+
+    for (;;){
+        left = timeout < 0 ? -1 : deadline - monotime();
+        if (nres > 0 || (timeout >= 0 && left < 0)) left = 0;
+#ifdef HAVE_PIDFD
+        if (!polling){
+            ms = left < 0 ? -1 : (int) (left * 1000 + 0.999);
+            count = epoll_wait(ws->epfd, events, sizeof events / sizeof *events, ms);
+            if (count == -1){
+                if (errno == EINTR) continue;
+                luaL_error(L, "epoll_wait: %s", strerror(errno));
+            }
+            for (j=0; j<count; ++j){
+                luaL_getmetatable(L, SP_LIST);
+                lua_pushinteger(L, (lua_Integer) events[j].data.u64);
+                lua_rawget(L, -2);
+                lua_remove(L, -2);
+                proc = toproc(L, -1);
+                if (proc && proc->waitmark != mark){
+                    /* no longer in this list */
+                    epoll_ctl(ws->epfd, EPOLL_CTL_DEL, proc->pidfd, &ev);
+                    proc->waitset = 0;
+                } else if (proc && !proc->done && reapproc(L, -1, proc, 1)){
+                    lua_rawseti(L, r, ++nres);
+                    continue;
+                }
+                lua_pop(L, 1);
+            }
+            if (count == sizeof events / sizeof *events) continue;
+            if (nres > 0 || left == 0) break;
+            continue;
+        }
+#endif
+        /* no pidfds: poll each proc in turn */
+        for (i=1; i<=n; ++i){
+            lua_rawgeti(L, t, i);
+            proc = toproc(L, -1);
+            if (!proc->done && proc->waitmark == mark && reapproc(L, -1, proc, 0)){
+                lua_rawseti(L, r, ++nres);
+                continue;
+            }
+            lua_pop(L, 1);
+        }
+        if (nres > 0 || left == 0) break;
+        if (left > 0 && delay > left) delay = left;
+        ts.tv_sec = (time_t) delay;
+        ts.tv_nsec = (long) ((delay - ts.tv_sec) * 1e9);
+        nanosleep(&ts, NULL);
+        if (delay < 0.05) delay *= 2;
+    }
+    lua_pop(L, 1);  /* wait set */
 }
 #elif defined(OS_WINDOWS)
-static int proc_terminate(lua_State *L)
 {
-    struct proc *proc = checkproc(L, 1);
-    if (!proc->done){
-        if (TerminateProcess(proc->hProcess, -9) == 0){
-            push_w32error(L, GetLastError());
-            return lua_error(L);
+    HANDLE handles[MAXIMUM_WAIT_OBJECTS];
+    struct proc *proc;
+    DWORD retval, exitcode;
+    int i, n, nwait = 0, nres = 0;
+
+    lua_checkstack(L, 4);
+    n = lua_objlen(L, t);
+    for (i=1; i<=n; ++i){
+        lua_rawgeti(L, t, i);
+        proc = toproc(L, -1);
+        if (!proc) luaL_error(L, "wait_any: item %d is not a proc", i);
+        if (proc->done){
+            lua_rawseti(L, r, ++nres);
+            continue;
         }
-        CloseHandle(proc->hProcess);
-        proc->exitcode = -9;
-        doneproc(L, 1);
+        if (nwait == MAXIMUM_WAIT_OBJECTS)
+            luaL_error(L, "too many wait objects: %d", n);
+        handles[nwait++] = proc->hProcess;
+        lua_pop(L, 1);
+    }
+    if (nwait == 0) return;
+    retval = WaitForMultipleObjects(nwait, handles, FALSE,
+        nres > 0 ? 0 : timeout < 0 ? INFINITE : (DWORD) (timeout * 1000));
+    if (retval == WAIT_FAILED){
+        push_w32error(L, GetLastError());
+        lua_error(L);
+    }
+    /* collect every proc that has finished, not just the first */
+    for (i=1; i<=n; ++i){
+        lua_rawgeti(L, t, i);
+        proc = toproc(L, -1);
+        if (!proc->done && WaitForSingleObject(proc->hProcess, 0) == WAIT_OBJECT_0){
+            if (GetExitCodeProcess(proc->hProcess, &exitcode) == 0)
+                exitcode = (DWORD) -1;
+            CloseHandle(proc->hProcess);
+            proc->exitcode = exitcode;
+            doneproc(L, -1);
+            lua_rawseti(L, r, ++nres);
+            continue;
+        }
+        lua_pop(L, 1);
     }
-    return 0;
 }
 #endif
 
-static const luaL_Reg proc_meta[] = {
-    {"__tostring", proc_tostring},
-    {"__gc", proc_gc},
-    {"__index", proc_index},
-    {"poll", proc_poll},
-    {"wait", proc_wait},
+/* wait_any(procs, [timeout]) */
+static int wait_any(lua_State *L)
+{
+    luaL_checktype(L, 1, LUA_TTABLE);
+    lua_settop(L, 2);
+    lua_newtable(L);
+    waitany(L, 1, luaL_optnumber(L, 2, -1), 3);
+    return 1;
+}
+
+/* Room left for arguments when exec'ing a child, and the amount of that
+   room taken up by one argument of length len. */
 #if defined(OS_POSIX)
-    {"send_signal", proc_send_signal},
-    {"terminate", proc_terminate},
-    {"kill", proc_kill},
+static size_t arg_space(void)
+{
+    long argmax = sysconf(_SC_ARG_MAX);
+    size_t used = 2048;  /* POSIX xargs leaves this much for the child */
+    char **env;
+    if (argmax <= 0) argmax = _POSIX_ARG_MAX;
+    for (env = environ; *env; ++env)
+        used += strlen(*env) + 1 + sizeof *env;
+    used += sizeof *env; /* NULL sentinel of argv and envp */
+    used += sizeof *env;
+    return (size_t) argmax > used ? (size_t) argmax - used : 0;
+}
+#define arg_cost(len) ((len) + 1 + sizeof(char *))
 #elif defined(OS_WINDOWS)
-    {"terminate", proc_terminate},
-    {"kill", proc_terminate},
+static size_t arg_space(void)
+{
+    return 32767; /* maximum length of a CreateProcess command line */
+}
+/* worst case: every character escaped by compile_cmdline, plus quotes */
+#define arg_cost(len) (2 * (len) + 3)
 #endif
-    {NULL, NULL}
-};
 
-/* convenience functions */
-static int call(lua_State *L)
+/* Options understood by xargs itself (not passed on to popen) */
+static const char *const xargs_opts[] = {"items", "parallel", "max_args", "capture", NULL};
+
+/* Wait for the batch in slot i of the running list to finish and record
+   its result. Stack: opts items running codes outputs procs */
+static void xargs_finish(lua_State *L, int i, int capture, int *status, int *firstbad)
 {
-    int r = superpopen(L);
-    if (r != 1){
-        return r;
+    int batchno, exitcode;
+    FILE **pf;
+    luaL_Buffer b;
+    size_t nr;
+
+    lua_rawgeti(L, 3, i);               /* stack: ... entry */
+    lua_rawgeti(L, -1, 2);
+    batchno = lua_tointeger(L, -1);
+    lua_pop(L, 1);
+    lua_rawgeti(L, -1, 1);              /* stack: ... entry proc */
+    lua_getfield(L, -1, "wait");
+    lua_insert(L, -2);
+    lua_call(L, 1, 1);                  /* stack: ... entry exitcode */
+    exitcode = lua_tointeger(L, -1);
+    lua_rawseti(L, 4, batchno);         /* stack: ... entry */
+    if (exitcode != 0 && batchno < *firstbad){
+        *firstbad = batchno;
+        *status = exitcode;
     }
-    lua_replace(L, 1);
-    lua_settop(L, 1);
-    return proc_wait(L);
+    if (capture){
+        lua_rawgeti(L, -1, 3);          /* stack: ... entry file */
+        pf = lua_touserdata(L, -1);
+        luaL_buffinit(L, &b);
+        rewind(*pf);
+        do {
+            nr = fread(luaL_prepbuffer(&b), 1, LUAL_BUFFERSIZE, *pf);
+            luaL_addsize(&b, nr);
+        } while (nr == LUAL_BUFFERSIZE);
+        liolib_copy_close(pf);
+        luaL_pushresult(&b);            /* stack: ... entry file output */
+        lua_rawseti(L, 5, batchno);
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
 }
 
-static int call_capture(lua_State *L)
+/* Wait for at least one running batch to finish, and record the results
+   of all batches that have finished. Returns the new number running. */
+static int xargs_reap(lua_State *L, int nrunning, int capture, int *status, int *firstbad)
 {
-    int r;
-    lua_settop(L, 1);
+    struct proc *proc;
+    int i;
+    lua_newtable(L);
+    waitany(L, 6, -1, lua_gettop(L));
+    lua_pop(L, 1);
+    for (i=nrunning; i>=1; --i){
+        lua_rawgeti(L, 6, i);
+        proc = toproc(L, -1);
+        lua_pop(L, 1);
+        if (!proc->done) continue;
+        xargs_finish(L, i, capture, status, firstbad);
+        /* move the last one into this slot */
+        lua_rawgeti(L, 3, nrunning);
+        lua_rawseti(L, 3, i);
+        lua_rawgeti(L, 6, nrunning);
+        lua_rawseti(L, 6, i);
+        lua_pushnil(L);
+        lua_rawseti(L, 3, nrunning);
+        lua_pushnil(L);
+        lua_rawseti(L, 6, nrunning);
+        --nrunning;
+    }
+    return nrunning;
+}
+
+/* xargs {arg1, ..., items={...}, [parallel=n], [max_args=n], [capture=bool], [options...]} */
+static int xargs(lua_State *L)
+{
+    int ncmd, nitems, parallel, max_args, capture;
+    int next = 1;        /* next item to be placed in a batch */
+    int nbatches = 0;
+    int nrunning = 0;
+    int status = 0, firstbad = 0;
+    int i, n;
+    size_t space, cmdcost, used, cost, len;
+    const char *s;
+    FILE **pf;
+#ifdef __linux__
+    size_t strmax = 32 * (size_t) sysconf(_SC_PAGESIZE); /* MAX_ARG_STRLEN */
+#endif
+
     luaL_checktype(L, 1, LUA_TTABLE);
-    lua_getfield(L, 1, "stdout");
-    lua_pushlightuserdata(L, &PIPE);
-    lua_setfield(L, 1, "stdout");
-    r = superpopen(L);
-    if (r != 1) return r;
-    /* stack: args oldstdout sp */
-    /* restore old stdout value in table */
-    lua_pushvalue(L, 2);
-    lua_setfield(L, 1, "stdout");
-    lua_replace(L, 1);
     lua_settop(L, 1);
-    /* stack: sp */
+    ncmd = lua_objlen(L, 1);
+    if (ncmd == 0) return luaL_error(L, "no arguments specified");
+    lua_getfield(L, 1, "items");
+    if (!lua_istable(L, 2)) return luaL_error(L, "items must be a table");
+    nitems = lua_objlen(L, 2);
+    lua_getfield(L, 1, "parallel");
+    parallel = lua_isnil(L, -1) ? 1 : lua_tointeger(L, -1);
+    lua_getfield(L, 1, "max_args");
+    max_args = lua_tointeger(L, -1);
+    lua_getfield(L, 1, "capture");
+    capture = lua_toboolean(L, -1);
     lua_getfield(L, 1, "stdout");
-    lua_getfield(L, 2, "read");
-    lua_pushvalue(L, 2);
-    lua_pushliteral(L, "*a");
-    lua_call(L, 2, 2);
-    /* stack: sp stdout a b */
-    /* close stdout, rather than relying on GC */
-    lua_getfield(L, 2, "close");
-    lua_pushvalue(L, 2);
-    lua_call(L, 1, 0);
-    /* wait for child (to avoid leaving a zombie) */
-    lua_getfield(L, 1, "wait");
-    lua_pushvalue(L, 1);
-    lua_call(L, 1, 1);
-    /* return exitcode, content */
-    lua_pushvalue(L, 3);
+    if (parallel < 1) return luaL_error(L, "parallel must be at least 1");
+    if (capture && !lua_isnil(L, -1))
+        return luaL_error(L, "capture cannot be used together with stdout");
+    lua_settop(L, 2);
+    lua_newtable(L);    /* 3: running batches: {proc, batchno, file} */
+    lua_newtable(L);    /* 4: exit codes */
+    lua_newtable(L);    /* 5: captured outputs */
+    lua_newtable(L);    /* 6: procs of running batches */
+    firstbad = nitems + 1;
+
+    space = arg_space();
+    cmdcost = 0;
+    for (i=1; i<=ncmd; ++i){
+        lua_rawgeti(L, 1, i);
+        if (!lua_tolstring(L, -1, &len))
+            return luaL_error(L, "popen argument %d not a string", i);
+        cmdcost += arg_cost(len);
+        lua_pop(L, 1);
+    }
+    /* check the items now, rather than with batches running */
+    for (i=1; i<=nitems; ++i){
+        lua_rawgeti(L, 2, i);
+        if (!lua_tolstring(L, -1, &len))
+            return luaL_error(L, "item %d not a string", i);
+#ifdef __linux__
+        if (len >= strmax) len = space;
+#endif
+        if (cmdcost + arg_cost(len) > space)
+            return luaL_error(L, "item %d is too long for the argument list", i);
+        lua_pop(L, 1);
+    }
+
+    while (next <= nitems || nrunning > 0){
+        if (next > nitems || nrunning >= parallel){
+            nrunning = xargs_reap(L, nrunning, capture, &status, &firstbad);
+            continue;
+        }
+
+        /* build arguments for the next batch */
+        lua_newtable(L);                /* stack: ... batch */
+        lua_pushnil(L);
+        while (lua_next(L, 1)){
+            if (lua_type(L, -2) == LUA_TSTRING){
+                s = lua_tostring(L, -2);
+                for (i=0; xargs_opts[i] && strcmp(s, xargs_opts[i]); ++i) ;
+                if (!xargs_opts[i]){
+                    lua_pushvalue(L, -2);
+                    lua_insert(L, -2);
+                    lua_rawset(L, -4);
+                    continue;
+                }
+            }
+            lua_pop(L, 1);
+        }
+        for (i=1; i<=ncmd; ++i){
+            lua_rawgeti(L, 1, i);
+            lua_rawseti(L, -2, i);
+        }
+        used = cmdcost;
+        for (n=0; next <= nitems && (max_args <= 0 || n < max_args); ++n, ++next){
+            lua_rawgeti(L, 2, next);
+            lua_tolstring(L, -1, &len);
+            cost = arg_cost(len);
+            /* (each item fits in a batch of its own, as checked above) */
+            if (used + cost > space){
+                lua_pop(L, 1);
+                break;
+            }
+            used += cost;
+            lua_rawseti(L, -2, ncmd + n + 1);
+        }
+
+        /* queue entry */
+        lua_createtable(L, 3, 0);       /* stack: ... batch entry */
+        lua_pushinteger(L, ++nbatches);
+        lua_rawseti(L, -2, 2);
+        if (capture){
+            pf = liolib_copy_newfile(L);
+            *pf = tmpfile();
+            if (*pf == NULL){
+                i = errno;
+                while (nrunning > 0)
+                    xargs_finish(L, nrunning--, capture, &status, &firstbad);
+                return luaL_error(L, "tmpfile: %s", strerror(i));
+            }
+            lua_rawseti(L, -2, 3);
+            lua_pushinteger(L, fileno(*pf));
+            lua_setfield(L, -3, "stdout");
+        }
+
+        /* start it */
+        lua_pushcfunction(L, superpopen);
+        lua_pushvalue(L, -3);
+        if (lua_pcall(L, 1, 1, 0)){
+            /* don't leave earlier batches running */
+            while (nrunning > 0)
+                xargs_finish(L, nrunning--, capture, &status, &firstbad);
+            return lua_error(L);
+        }
+        lua_pushvalue(L, -1);
+        lua_rawseti(L, 6, ++nrunning);
+        lua_rawseti(L, -2, 1);          /* stack: ... batch entry */
+        lua_rawseti(L, 3, nrunning);
+        lua_pop(L, 1);
+    }
+
+    lua_pushinteger(L, status);
+    lua_pushvalue(L, 4);
+    if (capture){
+        lua_pushvalue(L, 5);
+        return 3;
+    }
     return 2;
 }
 
@@ -1196,7 +6393,7 @@ static int superwait(lua_State *L)
     if (lua_isnil(L, -1))
         return luaL_error(L, "SP_LIST is nil");
 #if defined(OS_POSIX)
-    pid = wait(&stat);
+    pid = sp_wait(lua_topointer(L, LUA_REGISTRYINDEX), &stat);
     if (pid == -1){
         lua_pushnil(L);
         lua_pushstring(L, strerror(errno));
@@ -1301,17 +6498,35 @@ static int superwait(lua_State *L)
 static const luaL_Reg subprocess[] = {
     /* {"pipe", superpipe}, */
     {"popen", superpopen},
+    {"spawn_detached", spawn_detached},
+    {"clear_cache", clear_cache},
     {"call", call},
     {"call_capture", call_capture},
+    {"run", run},
+    {"xargs", xargs},
     {"wait", superwait},
+    {"wait_any", wait_any},
+    {"communicate", communicate},
+    {"io_engine", superio_engine},
     {"prune", prune},
+    {"orphans", superorphans},
+    {"sample_all", sample_all},
+    {"forkserver_start", forkserver_start},
+    {"shmring", shmring_new},
     {NULL, NULL}
 };
 
 LUALIB_API int luaopen_subprocess(lua_State *L)
 {
-    /* create environment table for C functions */
+    int i;
+
+    /* create environment table for C functions. It is weak, so that
+       procs nobody refers to can be collected (and become orphans). */
     lua_newtable(L);
+    lua_createtable(L, 0, 1);
+    lua_pushliteral(L, "v");
+    lua_setfield(L, -2, "__mode");
+    lua_setmetatable(L, -2);
     lua_pushvalue(L, -1);
     lua_setfield(L, LUA_REGISTRYINDEX, SP_LIST);
     lua_pop(L, 1);
@@ -1322,12 +6537,45 @@ LUALIB_API int luaopen_subprocess(lua_State *L)
 #else
     luaL_register(L, "subprocess", subprocess);
 #endif
+    /* grep, greplines and read_numbers, for any of the files we make */
+#if LUA_VERSION_NUM >= 502
+    luaL_setfuncs(L, liolib_copy_funcs, 0);
+#else
+    luaL_register(L, NULL, liolib_copy_funcs);
+#endif
 
     /* export PIPE and STDOUT constants */
     lua_pushlightuserdata(L, &PIPE);
     lua_setfield(L, -2, "PIPE");
     lua_pushlightuserdata(L, &STDOUT);
     lua_setfield(L, -2, "STDOUT");
+    lua_pushlightuserdata(L, &SOCKET);
+    lua_setfield(L, -2, "SOCKET");
+    lua_pushlightuserdata(L, &DEVNULL);
+    lua_setfield(L, -2, "DEVNULL");
+
+    /* metatable for sinks, and the sink table */
+    luaL_newmetatable(L, SP_SINK_META);
+#if LUA_VERSION_NUM >= 502
+    luaL_setfuncs(L, sink_meta, 0);
+#else
+    luaL_register(L, NULL, sink_meta);
+#endif
+    lua_newtable(L);
+#if LUA_VERSION_NUM >= 502
+    luaL_setfuncs(L, sink_methods, 0);
+#else
+    luaL_register(L, NULL, sink_methods);
+#endif
+    lua_setfield(L, -2, "__index");
+    lua_pop(L, 1);
+    lua_newtable(L);
+#if LUA_VERSION_NUM >= 502
+    luaL_setfuncs(L, sink_funcs, 0);
+#else
+    luaL_register(L, NULL, sink_funcs);
+#endif
+    lua_setfield(L, -2, "sink");
 
     /* create metatable for proc objects */
     luaL_newmetatable(L, SP_PROC_META);
@@ -1338,7 +6586,90 @@ LUALIB_API int luaopen_subprocess(lua_State *L)
 #endif
     lua_pushboolean(L, 0);
     lua_setfield(L, -2, "__metatable");
+    /* __index, with its table of methods and fields */
+    lua_newtable(L);
+#if LUA_VERSION_NUM >= 502
+    luaL_setfuncs(L, proc_methods, 0);
+#else
+    luaL_register(L, NULL, proc_methods);
+#endif
+    for (i=0; proc_fields[i]; ++i){
+        lua_pushinteger(L, PROC_PID + i);
+        lua_setfield(L, -2, proc_fields[i]);
+    }
+    lua_pushcclosure(L, proc_index, 1);
+    lua_setfield(L, -2, "__index");
+    lua_pop(L, 1);
+
+    /* metatable for call_capture's timelines, which only need freeing */
+    luaL_newmetatable(L, SP_TIMELINE_META);
+    lua_pushcfunction(L, timeline_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+
+#if defined(OS_POSIX)
+    /* metatable for wait sets, and the table to keep them in */
+    luaL_newmetatable(L, SP_WAITSET_META);
+    lua_pushcfunction(L, waitset_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+    lua_newtable(L);
+    lua_createtable(L, 0, 1);
+    lua_pushliteral(L, "k");
+    lua_setfield(L, -2, "__mode");
+    lua_setmetatable(L, -2);
+    lua_setfield(L, LUA_REGISTRYINDEX, SP_WAITSETS);
+
+#ifdef HAVE_SHMRING
+    /* metatable for rings */
+    luaL_newmetatable(L, SP_RING_META);
+#if LUA_VERSION_NUM >= 502
+    luaL_setfuncs(L, ring_meta, 0);
+#else
+    luaL_register(L, NULL, ring_meta);
+#endif
+    lua_newtable(L);
+#if LUA_VERSION_NUM >= 502
+    luaL_setfuncs(L, ring_methods, 0);
+#else
+    luaL_register(L, NULL, ring_methods);
+#endif
+    lua_setfield(L, -2, "__index");
+    lua_pop(L, 1);
+#endif
+
+    /* metatable for channels */
+    luaL_newmetatable(L, SP_CHANNEL_META);
+#if LUA_VERSION_NUM >= 502
+    luaL_setfuncs(L, channel_meta, 0);
+#else
+    luaL_register(L, NULL, channel_meta);
+#endif
+    lua_newtable(L);
+#if LUA_VERSION_NUM >= 502
+    luaL_setfuncs(L, channel_methods, 0);
+#else
+    luaL_register(L, NULL, channel_methods);
+#endif
+    lua_setfield(L, -2, "__index");
+    lua_pop(L, 1);
+
+    /* metatable for capture objects */
+    luaL_newmetatable(L, SP_CAPTURE_META);
+#if LUA_VERSION_NUM >= 502
+    luaL_setfuncs(L, capture_meta, 0);
+#else
+    luaL_register(L, NULL, capture_meta);
+#endif
+    lua_newtable(L);
+#if LUA_VERSION_NUM >= 502
+    luaL_setfuncs(L, capture_methods, 0);
+#else
+    luaL_register(L, NULL, capture_methods);
+#endif
+    lua_setfield(L, -2, "__index");
     lua_pop(L, 1);
+#endif
 
     return 1;
 }